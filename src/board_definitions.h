@@ -30,3 +30,40 @@
 // Common definitions
 // ------------------
 #define BOOTLOADER_MAX_RUN_TIME 5000ULL*48ULL   // 5 seconds
+#if L2BOOT
+#ifndef L2BOOT_LISTEN_TIME
+#define L2BOOT_LISTEN_TIME 1000ULL*48ULL        // Wait for a raw Ethernet sender before DHCP
+#endif
+#endif
+
+// W5500 retransmission timeout (100us units) and retry count, used for ARP
+// and UDP sends
+#ifndef W5X00_RETRY_TIME
+#define W5X00_RETRY_TIME  2000    // 200ms
+#endif
+#ifndef W5X00_RETRY_COUNT
+#define W5X00_RETRY_COUNT 8
+#endif
+
+// W5500 socket buffer sizes in KB, a comma separated list with one entry per
+// socket. Valid sizes are 0, 1, 2, 4, 8 and 16, and each direction has 16KB
+// in total (checked at build time). A board header can override these. DHCP
+// runs on socket 1 and TFTP on socket 3, which gets the largest RX share to
+// absorb bursts from the server. HTTP_BOOT uses socket 3 for TCP, where the RX
+// buffer is the window. Sockets 4-6 are left room for additional TFTP
+// sessions. L2BOOT builds give socket 0 (MACRAW) enough for a window of full
+// frames.
+#ifndef W5X00_RXBUF_SIZES
+#if L2BOOT
+#define W5X00_RXBUF_SIZES 8, 1, 0, 4, 1, 1, 1, 0
+#else
+#define W5X00_RXBUF_SIZES 0, 2, 0, 8, 2, 2, 2, 0
+#endif
+#endif
+#ifndef W5X00_TXBUF_SIZES
+#if L2BOOT
+#define W5X00_TXBUF_SIZES 2, 2, 0, 2, 2, 2, 2, 0
+#else
+#define W5X00_TXBUF_SIZES 0, 2, 0, 2, 2, 2, 2, 0
+#endif
+#endif
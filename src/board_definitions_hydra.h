@@ -90,9 +90,15 @@
 #define SPI_MISO                          PINMUX_PA09C_SERCOM0_PAD1
 #define SPI_MOSI                          PINMUX_PA08C_SERCOM0_PAD0
 #define SPI_SCK                           PINMUX_PA11C_SERCOM0_PAD3
+// netInit() starts at SPI_BITRATE and trains the link up towards SPI_MAX_BITRATE
 #define SPI_BITRATE                       (4000000UL)     // 4 MHz
 #define SPI_MAX_BITRATE                   (12000000UL)    // 12 MHz max, see 'SPI.h', SPI_MIN_CLOCK_DIVIDER
 
+// DMAC trigger sources for the SPI SERCOM. Remove these to use polled (PIO) transfers only.
+// These come from CMSIS-Atmel/CMSIS/CMSIS/Device/ATMEL/samd21/include/samd21g18a.h
+#define SPI_DMAC_TX_TRIGGER               SERCOM0_DMAC_ID_TX
+#define SPI_DMAC_RX_TRIGGER               SERCOM0_DMAC_ID_RX
+
 /*
  * I2C port
  */
@@ -111,6 +117,17 @@
 #define W5X00_CS_PORT                     (0U)   // Port A
 #define W5X00_CS_PIN                      (10U)   // PA10
 
+// Wiznet Ethernet chip INTn pin (optional). When defined, the receive path
+// only polls the W5500 after the EIC has seen INTn fall. Set these to the
+// pin INTn is wired to, if it is.
+//#define W5X00_INT_PORT                    (0U)   // Port A
+//#define W5X00_INT_PIN                     (21U)  // PA21
+//#define W5X00_INT_EXTINT                  (5U)   // EXTINT[5] (see the 'PORT Function Multiplexing' table)
+
+// Force the W5500 PHY mode (optional), skipping auto-negotiation when the
+// switch port is known. Any PHYCFGR_OPMDC_* value from w5500.h.
+//#define W5X00_PHY_MODE                    PHYCFGR_OPMDC_100FD
+
 // I2C Address of the MAC address chip
 #define MAC_CHIP_ADDRESS                  0x57
 #define MAC_CHIP_READ_OFFSET              0xFA
@@ -73,6 +73,7 @@ enum
   dhcpClientIdentifier  = 61,
   nextServerName        = 66,
   bootFileName          = 67,
+  tftpServerAddress     = 150,  // RFC 5859
   endOption             = 255
 };
 
@@ -113,7 +114,7 @@ static dhcpStateType _dhcpState;
 
 static void dhcpSendMessage(uint8_t messageType) {
   const uint8_t destIP[] = {255, 255, 255, 255};
-  netBeginPacketSocket3(destIP, DHCP_SERVER_PORT);
+  netBeginPacket(NET_SOCKET_DHCP, destIP, DHCP_SERVER_PORT);
 
   const uint16_t secondsElapsed = (millis() - _dhcpStartTime) / 1000;
 
@@ -161,22 +162,59 @@ static void dhcpSendMessage(uint8_t messageType) {
 
   // DHCP Param request
   *(opts++) = dhcpParamRequest;
-  *(opts++) = 0x02; // Length
+  *(opts++) = 0x03; // Length
   *(opts++) = subnetMask;
   *(opts++) = routersOnSubnet;
+  *(opts++) = tftpServerAddress;
 
   // End marker
   *(opts++) = endOption;
 
-  netWriteSocket3((uint8_t*)&packet, sizeof(packet));
+  netWrite(NET_SOCKET_DHCP, (uint8_t*)&packet, sizeof(packet));
 
-  netEndPacketSocket3();
+  netEndPacket(NET_SOCKET_DHCP);
+}
+
+// Option 66 normally holds one server name, some setups list several
+// addresses separated by spaces or commas. Names we can't resolve are skipped.
+static void dhcpParseServerNames(const uint8_t* opts, uint8_t optLen) {
+  const uint8_t* end = opts + optLen;
+
+  while (opts < end && netConfig.tftpServerCount < NET_MAX_TFTP_SERVERS) {
+    uint8_t addr[4];
+    uint8_t octets = 0;
+    bool valid = true;
+
+    while (opts < end && *opts != ' ' && *opts != ',' && *opts != 0) {
+      if (*opts >= '0' && *opts <= '9' && octets < 4) {
+        uint16_t value = 0;
+        while (opts < end && *opts >= '0' && *opts <= '9') {
+          value = value * 10 + (*(opts++) - '0');
+        }
+        valid = valid && value <= 255;
+        addr[octets++] = value;
+        if (opts < end && *opts == '.' && octets < 4) {
+          opts++;
+        }
+      } else {
+        valid = false;
+        opts++;
+      }
+    }
+    if (opts < end) {
+      opts++;
+    }
+
+    if (valid && octets == 4) {
+      memcpy(netConfig.tftpServers[netConfig.tftpServerCount++], addr, 4);
+    }
+  }
 }
 
 static uint8_t dhcpParsePacket() {
   dhcpPacket packet;
   uint8_t serverAddr[4];
-  uint16_t bufferLen = netReceivePacketSocket3((uint8_t*)&packet, serverAddr, NULL);
+  uint16_t bufferLen = netReceivePacket(NET_SOCKET_DHCP, (uint8_t*)&packet, serverAddr, NULL);
   if (bufferLen == 0) {
     return 0;
   }
@@ -218,6 +256,9 @@ static uint8_t dhcpParsePacket() {
 
   uint8_t messageType = 0;
 
+  // Filled from options 66 and 150
+  netConfig.tftpServerCount = 0;
+
   uint8_t* opts = packet.opts;
   while (opts < (opts + sizeof(packet.opts))) {
     uint8_t optType = *(opts++);
@@ -246,6 +287,17 @@ static uint8_t dhcpParsePacket() {
         case bootFileName:
           memcpy(netConfig.tftpFile, opts, optLen);
           break;
+
+        case nextServerName:
+          dhcpParseServerNames(opts, optLen);
+          break;
+
+        case tftpServerAddress:
+          // Option 66 may have filled some of the slots already
+          for (uint8_t i = 0; i < optLen / 4 && netConfig.tftpServerCount < NET_MAX_TFTP_SERVERS; i++) {
+            memcpy(netConfig.tftpServers[netConfig.tftpServerCount++], opts + i * 4, 4);
+          }
+          break;
       }
       opts += optLen;
     }
@@ -259,7 +311,7 @@ static uint8_t dhcpParsePacket() {
 void dhcpInit() {
   _dhcpState = DHCP_STATE_START;
 
-  netOpenUdpSocket3(DHCP_CLIENT_PORT);
+  netOpenUdpSocket(NET_SOCKET_DHCP, DHCP_CLIENT_PORT);
 
   // Use a 32bit value derived from the 128bit serial number as the transaction id
   _dhcpTransactionId = getDeviceSerialNumber32();
@@ -267,7 +319,7 @@ void dhcpInit() {
 }
 
 void dhcpEnd(void) {
-  netCloseSocket3();
+  netCloseSocket(NET_SOCKET_DHCP);
 }
 
 bool dhcpRun() {
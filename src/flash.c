@@ -37,10 +37,59 @@ static uint32_t PAGE_SIZE;
 #define MAX_FLASH             (PAGE_SIZE * PAGES)
 
 #define APP_FLASH_MEMORY_START_PTR  ((uint32_t *) &__sketch_vectors_ptr)
+#if FLASH_JOURNAL
+// The journal takes the top rows, the application gets everything below
+#define APP_FLASH_MEMORY_END_PTR    (journalPtr)
+#else
+// Flash starts at address 0, so the application may use everything up to MAX_FLASH
+#define APP_FLASH_MEMORY_END_PTR    ((uint32_t *) MAX_FLASH)
+#endif
+
+// Largest row the accumulator can hold. SAMD21 parts have 64 byte pages.
+#define FLASH_MAX_ROW_SIZE    (256)
 
 static uint32_t *flashProgrammingPtr;
 static uint32_t imageSize;
 
+// End of the announced image, and the rows flash_idle() has erased ahead of
+// flashProgrammingPtr, [flashErasedStartPtr, flashErasedEndPtr). The range
+// starts after the row that was being accumulated when erasing began, which
+// itself was never erased.
+static uint32_t *flashPlannedEndPtr;
+static uint32_t *flashErasedStartPtr;
+static uint32_t *flashErasedEndPtr;
+// Set once flash_seek() was used, rows ahead may then already hold data
+static bool flashRandomAccess;
+// Set once a row differed, from then on the rest of the image is expected to
+// differ too (code after a change usually moves), so erasing ahead pays off
+static bool flashChanged;
+
+// Incoming data is gathered in rowBuffer until a whole row can be programmed.
+// Word aligned so flash_write() can copy it straight into the page buffer.
+// There are two, so a completed row can wait in rowPending (for rowPendingPtr)
+// while the next one fills, see flash_buffer_commit_deferred().
+static uint32_t rowBuffers[2][FLASH_MAX_ROW_SIZE / 4];
+static uint32_t *rowBuffer = rowBuffers[0];
+static uint32_t rowFill;
+static uint32_t *rowPending;
+static uint32_t *rowPendingPtr;
+
+#if FLASH_JOURNAL
+// Progress journal. The first row holds a header naming the image, followed
+// by its tag, the rows after it a CRC-16 per image row, appended as each row
+// is programmed. An
+// erased entry (0xFFFF) ends the journal, so a row CRC of 0xFFFF is stored
+// as 0.
+#define JOURNAL_MAGIC         (0x4C4E524AUL)  // "JRNL"
+#define JOURNAL_ERASED        (0xFFFF)
+#define JOURNAL_HEADER_WORDS  (3)
+
+static uint32_t *journalPtr;
+static uint32_t journalRows;
+// Set while rows are being recorded
+static bool journalActive;
+#endif
+
 void flash_init() {
   //uint32_t pageSizes[] = { 8, 16, 32, 64, 128, 256, 512, 1024 };
   //PAGE_SIZE = pageSizes[NVMCTRL->PARAM.bit.PSZ];
@@ -48,6 +97,70 @@ void flash_init() {
 
   flashProgrammingPtr = APP_FLASH_MEMORY_START_PTR;
   imageSize = 0;
+  rowFill = 0;
+  rowPending = NULL;
+
+  flashPlannedEndPtr = APP_FLASH_MEMORY_START_PTR;
+  flashErasedStartPtr = APP_FLASH_MEMORY_START_PTR;
+  flashErasedEndPtr = APP_FLASH_MEMORY_START_PTR;
+  flashChanged = false;
+  flashRandomAccess = false;
+
+#if FLASH_JOURNAL
+  // A header row plus an entry for every row the application could use
+  uint32_t appRows = (MAX_FLASH - (uint32_t) APP_FLASH_MEMORY_START_PTR) / ROW_SIZE;
+  journalRows = 1 + (appRows * 2 + ROW_SIZE - 1) / ROW_SIZE;
+  journalPtr = (uint32_t *) (MAX_FLASH - journalRows * ROW_SIZE);
+  journalActive = false;
+#endif
+}
+
+uint32_t flash_row_size(void) {
+  return ROW_SIZE;
+}
+
+bool flash_seek(uint32_t offset) {
+  flash_program_pending();
+  if (rowFill != 0 || (offset % ROW_SIZE) != 0 || offset >= flash_capacity()) {
+    return false;
+  }
+
+  flashProgrammingPtr = APP_FLASH_MEMORY_START_PTR + offset / 4;
+
+  // Pre-erasing and the journal only work for sequential writes
+  flashErasedStartPtr = APP_FLASH_MEMORY_START_PTR;
+  flashErasedEndPtr = APP_FLASH_MEMORY_START_PTR;
+  flashRandomAccess = true;
+#if FLASH_JOURNAL
+  journalActive = false;
+#endif
+  return true;
+}
+
+uint32_t flash_capacity(void) {
+  return (uint32_t) APP_FLASH_MEMORY_END_PTR - (uint32_t) APP_FLASH_MEMORY_START_PTR;
+}
+
+uint32_t flash_crc32(uint32_t offset, uint32_t length) {
+  flash_program_pending();
+  if (offset >= flash_capacity()) {
+    return 0;
+  }
+  if (length > flash_capacity() - offset) {
+    length = flash_capacity() - offset;
+  }
+  return crc32((uint8_t *) APP_FLASH_MEMORY_START_PTR + offset, length, 0);
+}
+
+bool flash_plan(uint32_t size) {
+  if (size > flash_capacity()) {
+    LOG("flash: image too large");
+    return false;
+  }
+
+  // Round up to whole rows
+  flashPlannedEndPtr = APP_FLASH_MEMORY_START_PTR + (size + ROW_SIZE - 1) / ROW_SIZE * ROW_SIZE_IN_WORDS;
+  return true;
 }
 
 // Erase a single flash row
@@ -89,53 +202,294 @@ static void flash_write(uint32_t *src_addr, uint32_t *dst_addr, uint32_t size) {
   }
 }
 
-static void flash_update_row(uint8_t* rowBuffer, uint32_t* flashPtr) {
+#if FLASH_JOURNAL
+// Write a single half word, leaving the rest of the page as it is
+static void flash_write_halfword(uint16_t *dst_addr, uint16_t value) {
+  // The page is written with an explicit WP, even if this is its last half word
+  NVMCTRL->CTRLB.bit.MANW = 1;
+
+  NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | NVMCTRL_CTRLA_CMD_PBC;
+  while (NVMCTRL->INTFLAG.bit.READY == 0);
+
+  // The cleared page buffer is all 0xFF, which doesn't change the other bytes
+  *dst_addr = value;
+
+  NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | NVMCTRL_CTRLA_CMD_WP;
+  while (NVMCTRL->INTFLAG.bit.READY == 0);
+}
+
+static uint16_t *journal_entries(void) {
+  return (uint16_t *) (journalPtr + ROW_SIZE_IN_WORDS);
+}
+
+static uint16_t journal_row_crc(uint32_t *flashPtr) {
+  uint16_t crc = crc16(flashPtr, ROW_SIZE, 0xFFFF);
+  return crc == JOURNAL_ERASED ? 0 : crc;
+}
+
+// Invalidate the journal, a single erase of the header row is enough
+static void journal_clear(void) {
+  journalActive = false;
+  if (journalPtr[0] != 0xFFFFFFFF) {
+    flash_erase_row(journalPtr);
+  }
+}
+
+// Called after each row is programmed. Rows written outside of a journaled
+// transfer make any old journal stale.
+static void journal_record(uint32_t *flashPtr) {
+  if (!journalActive) {
+    journal_clear();
+    return;
+  }
+
+  uint16_t *entry = journal_entries() + (flashPtr - APP_FLASH_MEMORY_START_PTR) / ROW_SIZE_IN_WORDS;
+  if (*entry == JOURNAL_ERASED) {
+    flash_write_halfword(entry, journal_row_crc(flashPtr));
+  }
+}
+
+uint32_t flash_journal_check(uint32_t id, uint32_t* size) {
+  flash_program_pending();
+  if (journalPtr[0] != JOURNAL_MAGIC || journalPtr[1] != id) {
+    return 0;
+  }
+
+  *size = journalPtr[2];
+  if (*size == 0 || *size > flash_capacity() ||
+      memchr(flash_journal_tag(), 0, FLASH_JOURNAL_MAX_TAG) == NULL) {
+    return 0;
+  }
+
+  // Trust only the rows that still match what was recorded
+  uint32_t rows = (*size + ROW_SIZE - 1) / ROW_SIZE;
+  uint16_t *entries = journal_entries();
+  uint32_t done = 0;
+  while (done < rows && entries[done] != JOURNAL_ERASED &&
+         entries[done] == journal_row_crc(APP_FLASH_MEMORY_START_PTR + done * ROW_SIZE_IN_WORDS)) {
+    done++;
+  }
+
+  if (done < rows && entries[done] != JOURNAL_ERASED) {
+    // A row changed under the journal, its entry can't be rewritten
+    return 0;
+  }
+  if (done == rows) {
+    // Power was lost just before the end, fetch the last row again so the
+    // transfer still ends normally
+    done--;
+  }
+  return done * ROW_SIZE;
+}
+
+const char* flash_journal_tag(void) {
+  return (const char*) (journalPtr + JOURNAL_HEADER_WORDS);
+}
+
+void flash_journal_start(uint32_t id, uint32_t size, const char* tag) {
+  flash_program_pending();
+  for (uint32_t row = 0; row < journalRows; row++) {
+    uint32_t *rowPtr = journalPtr + row * ROW_SIZE_IN_WORDS;
+    for (uint32_t i = 0; i < ROW_SIZE_IN_WORDS; i++) {
+      if (rowPtr[i] != 0xFFFFFFFF) {
+        flash_erase_row(rowPtr);
+        break;
+      }
+    }
+  }
+
+  uint32_t header[JOURNAL_HEADER_WORDS + FLASH_JOURNAL_MAX_TAG / 4] = { JOURNAL_MAGIC, id, size };
+  size_t tagLength = strlen(tag) + 1;
+  if (tagLength > FLASH_JOURNAL_MAX_TAG) {
+    // Too long to record, so the journal can't be resumed
+    tagLength = 1;
+    tag = "";
+  }
+  memcpy(header + JOURNAL_HEADER_WORDS, tag, tagLength);
+  flash_write(header, journalPtr, JOURNAL_HEADER_WORDS + (tagLength + 3) / 4);
+  journalActive = true;
+}
+
+bool flash_journal_resume(uint32_t offset) {
+  flash_program_pending();
+  if (rowFill != 0 || flashProgrammingPtr != APP_FLASH_MEMORY_START_PTR ||
+      (offset % ROW_SIZE) != 0 || offset >= flash_capacity()) {
+    return false;
+  }
+
+  flashProgrammingPtr = APP_FLASH_MEMORY_START_PTR + offset / 4;
+  imageSize = offset;
+  journalActive = true;
+  return true;
+}
+#endif
+
+static void flash_update_row(uint8_t* row, uint32_t* flashPtr) {
   LOG_STR("Flash: ptr:");
   LOG_HEX(flashPtr);
-  if (memcmp(rowBuffer, flashPtr, ROW_SIZE) != 0) {
+  if (flashPtr >= flashErasedStartPtr && flashPtr < flashErasedEndPtr) {
+    // Already erased by flash_idle()
+    flash_write((uint32_t *) row, flashPtr, ROW_SIZE_IN_WORDS);
+    LOG(" PROG (pre-erased) ");
+  } else if (memcmp(row, flashPtr, ROW_SIZE) != 0) {
     flash_erase_row(flashPtr);
-    flash_write((uint32_t *) rowBuffer, flashPtr, ROW_SIZE_IN_WORDS);
+    flash_write((uint32_t *) row, flashPtr, ROW_SIZE_IN_WORDS);
+    flashChanged = true;
     LOG(" PROG ");
   } else {
     LOG(" skip ");
   }
 }
 
-bool flash_tftp_buffer(uint8_t* buffer, uint32_t length) {
-  // Flash full rows from the buffer
-  while (length >= ROW_SIZE) {
-    flash_update_row(buffer, flashProgrammingPtr);
-    flashProgrammingPtr += ROW_SIZE_IN_WORDS;
-    imageSize += ROW_SIZE;
-    buffer += ROW_SIZE;
-    length -= ROW_SIZE;
+bool flash_idle(void) {
+  if (flash_program_pending()) {
+    return true;
+  }
+  if (!flashChanged || flashRandomAccess) {
+    return false;
   }
 
-  // Flash a partial row
-  if (length > 0) {
-    uint8_t rowBuffer[ROW_SIZE];
+  // Never touch the row being accumulated or anything past the image
+  uint32_t* next = flashErasedEndPtr;
+  if (next <= flashProgrammingPtr) {
+    // Starting out, or programming caught up. The row being accumulated
+    // isn't erased, so the new range begins after it.
+    next = flashProgrammingPtr + ROW_SIZE_IN_WORDS;
+    flashErasedStartPtr = next;
+  }
+  if (next >= flashPlannedEndPtr) {
+    return false;
+  }
 
-    memcpy(rowBuffer, buffer, length);
+  flash_erase_row(next);
+  flashErasedEndPtr = next + ROW_SIZE_IN_WORDS;
+  return true;
+}
 
-    // Fill remaining bytes with 0xFF
-    for (uint16_t idx = length; idx < ROW_SIZE; idx++) {
-      rowBuffer[idx] = 0xFF;
-    }
+// Hand the accumulated row over for programming, now or (deferred) by the
+// next flash_program_pending(), and start a new one in the other buffer
+static bool flash_complete_row(bool deferred) {
+  if (flashProgrammingPtr + ROW_SIZE_IN_WORDS > APP_FLASH_MEMORY_END_PTR) {
+    LOG("flash overflow");
+    return false;
+  }
 
-    flash_update_row(rowBuffer, flashProgrammingPtr);
-    flashProgrammingPtr += ROW_SIZE_IN_WORDS;
-    imageSize += length;
+  // Only one row can wait
+  flash_program_pending();
+  rowPending = rowBuffer;
+  rowPendingPtr = flashProgrammingPtr;
+  rowBuffer = (rowBuffer == rowBuffers[0]) ? rowBuffers[1] : rowBuffers[0];
+  flashProgrammingPtr += ROW_SIZE_IN_WORDS;
+  rowFill = 0;
+
+  if (!deferred) {
+    flash_program_pending();
   }
+  return true;
+}
 
-  LOG_STR("size: ");
-  LOG_HEX(imageSize);
-  LOG_STR("\r\n");
+bool flash_program_pending(void) {
+  if (!rowPending) {
+    return false;
+  }
 
-  if (flashProgrammingPtr - APP_FLASH_MEMORY_START_PTR >= MAX_FLASH) {
-    LOG("flash overflow");
+  uint32_t *row = rowPending;
+  rowPending = NULL;
+  flash_update_row((uint8_t *) row, rowPendingPtr);
+#if FLASH_JOURNAL
+  journal_record(rowPendingPtr);
+#endif
+  return true;
+}
+
+bool flash_write_row(uint32_t offset, uint32_t* row) {
+  if ((offset % ROW_SIZE) != 0 || offset >= flash_capacity()) {
     return false;
   }
 
+  flash_program_pending();
+
+  // Rows come from several places at once, so no pre-erasing
+  flashErasedStartPtr = APP_FLASH_MEMORY_START_PTR;
+  flashErasedEndPtr = APP_FLASH_MEMORY_START_PTR;
+  flashRandomAccess = true;
+
+  uint32_t* flashPtr = APP_FLASH_MEMORY_START_PTR + offset / 4;
+  flash_update_row((uint8_t *) row, flashPtr);
+#if FLASH_JOURNAL
+  journal_record(flashPtr);
+#endif
+  return true;
+}
+
+bool flash_write_row_deferred(uint32_t offset, const uint32_t* row) {
+  if ((offset % ROW_SIZE) != 0 || offset >= flash_capacity()) {
+    return false;
+  }
+
+  // Only one row can wait
+  flash_program_pending();
+
+  flashErasedStartPtr = APP_FLASH_MEMORY_START_PTR;
+  flashErasedEndPtr = APP_FLASH_MEMORY_START_PTR;
+  flashRandomAccess = true;
+
+  // The accumulator isn't in use, so its other buffer holds the copy
+  rowPending = (rowBuffer == rowBuffers[0]) ? rowBuffers[1] : rowBuffers[0];
+  rowPendingPtr = APP_FLASH_MEMORY_START_PTR + offset / 4;
+  memcpy(rowPending, row, ROW_SIZE);
   return true;
 }
 
+bool flash_buffer_fits(uint32_t length) {
+  // Rows still needed, including the one being accumulated
+  uint32_t rows = (rowFill + length + ROW_SIZE - 1) / ROW_SIZE;
+  return flashProgrammingPtr + rows * ROW_SIZE_IN_WORDS <= APP_FLASH_MEMORY_END_PTR;
+}
+
+uint8_t* flash_buffer_get(uint32_t* space) {
+  *space = ROW_SIZE - rowFill;
+  return (uint8_t *) rowBuffer + rowFill;
+}
+
+bool flash_buffer_commit(uint32_t length) {
+  rowFill += length;
+  imageSize += length;
+
+  if (rowFill < ROW_SIZE) {
+    return true;
+  }
+  return flash_complete_row(false);
+}
+
+bool flash_buffer_commit_deferred(uint32_t length) {
+  rowFill += length;
+  imageSize += length;
+
+  if (rowFill < ROW_SIZE) {
+    return true;
+  }
+  return flash_complete_row(true);
+}
+
+bool flash_finish(void) {
+  LOG_STR("size: ");
+  LOG_HEX(imageSize);
+  LOG_STR("\r\n");
+
+  bool ok = true;
+  if (rowFill != 0) {
+    // Fill remaining bytes with 0xFF
+    memset((uint8_t *) rowBuffer + rowFill, 0xFF, ROW_SIZE - rowFill);
+    ok = flash_complete_row(false);
+  }
+  flash_program_pending();
+
+#if FLASH_JOURNAL
+  // The image is complete, nothing left to resume
+  if (ok) {
+    journal_clear();
+  }
+#endif
+  return ok;
+}
@@ -25,6 +25,65 @@
 #include <stdbool.h>
 
 void flash_init();
-bool flash_tftp_buffer(uint8_t* buffer, uint32_t length);
+
+// Bytes available for the application image
+uint32_t flash_capacity(void);
+// Announce the size of the upcoming image, returns false if it can't fit
+bool flash_plan(uint32_t size);
+// CRC-32 of what is currently in flash at offset into the image
+uint32_t flash_crc32(uint32_t offset, uint32_t length);
+// Size of a flash row, the unit flash_seek() works in
+uint32_t flash_row_size(void);
+// Continue writing at a row aligned offset into the image. The current row
+// must be complete (or finished with flash_finish()).
+bool flash_seek(uint32_t offset);
+// Erase a row ahead of the incoming data while there is nothing else to do,
+// returns false when there was no work
+bool flash_idle(void);
+
+#if FLASH_JOURNAL
+// Progress journal in the top rows of flash, so an interrupted transfer can
+// pick up where it stopped. id identifies the image, size is its length and
+// tag is whatever the server gave to identify the content (a CRC, an HTTP
+// validator), "" if nothing. A resume is only safe once the server has
+// confirmed the same tag.
+//
+// flash_journal_check() returns how many bytes of the image named id are
+// already in flash (row aligned, 0 if none) and the image size recorded,
+// flash_journal_tag() the tag recorded with it.
+// flash_journal_start() begins a new journal for a transfer from offset 0,
+// flash_journal_resume() continues the existing one at the checked offset.
+#define FLASH_JOURNAL_MAX_TAG (80)   // Including the NUL
+uint32_t flash_journal_check(uint32_t id, uint32_t* size);
+const char* flash_journal_tag(void);
+void flash_journal_start(uint32_t id, uint32_t size, const char* tag);
+bool flash_journal_resume(uint32_t offset);
+#endif
+
+// Row accumulator. flash_buffer_get() returns where the next bytes go and how
+// many fit before the row is full, flash_buffer_commit() accounts for the bytes
+// written there and programs the row once it is complete. flash_finish() pads
+// and programs the final partial row. flash_buffer_fits() checks up front
+// that length more bytes can be stored.
+//
+// flash_buffer_commit_deferred() leaves a completed row for the next
+// flash_program_pending() instead, while the next row fills, so programming
+// can overlap a DMA transfer into the accumulator. Every other flash_*() call
+// (and flash_idle()) programs it first. flash_program_pending() returns false
+// if there was nothing to do.
+bool flash_buffer_fits(uint32_t length);
+uint8_t* flash_buffer_get(uint32_t* space);
+bool flash_buffer_commit(uint32_t length);
+bool flash_buffer_commit_deferred(uint32_t length);
+bool flash_program_pending(void);
+bool flash_finish(void);
+
+// Program a whole row at a row aligned offset into the image, bypassing the
+// accumulator. row must be word aligned and flash_row_size() bytes long.
+// flash_write_row_deferred() copies the row and leaves it for the next
+// flash_program_pending(), like flash_buffer_commit_deferred(), so row can
+// be filled again right away. Not for use while the accumulator holds data.
+bool flash_write_row(uint32_t offset, uint32_t* row);
+bool flash_write_row_deferred(uint32_t offset, const uint32_t* row);
 
 #endif
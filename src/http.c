@@ -0,0 +1,516 @@
+// HTTP image transfer
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <string.h>
+#include "http.h"
+#include "networking.h"
+#include "w5500.h"
+#include "utils.h"
+#include "log.h"
+#include "flash.h"
+
+#define HTTP_PORT           (80)
+// Largest segment that fits an Ethernet frame without IP or TCP options
+#define HTTP_MSS            (1460)
+// First local port. Every connection takes the next one, so a reconnect
+// never collides with the server's TIME_WAIT for the last one.
+#define HTTP_LOCAL_PORT     (0xC200)
+// Wait before reconnecting after a refused or dropped connection
+#define HTTP_RETRY_TIME     (500ULL*48ULL)   // 500ms
+// Header lines are only looked at this far, enough for the ones we need
+#define HTTP_MAX_LINE       (96)
+// Longest ETag or Last-Modified value we keep, including the NUL
+#define HTTP_MAX_VALIDATOR  (80)
+
+typedef enum {
+  HTTP_IDLE,
+  HTTP_WAITING,
+  HTTP_CONNECTING,
+  HTTP_HEADERS,
+  HTTP_BODY,
+  HTTP_FAILED
+} httpState_t;
+
+static httpState_t state;
+static uint8_t httpServer[4];
+static uint16_t httpPort;
+static const char* httpHost;
+static uint8_t httpHostLength;
+static const char* httpPath;
+static uint16_t localPort;
+static uint64_t retryTime;
+
+// Response headers
+static char line[HTTP_MAX_LINE];
+static uint8_t lineLength;
+static bool lineTruncated;
+static uint16_t statusCode;
+static bool haveLength;
+static uint32_t contentLength;
+static bool haveRange;
+static uint32_t rangeStart;
+static uint32_t rangeTotal;
+static bool chunked;
+
+// Bytes of the image handed to the flash row accumulator so far, and where
+// the current request starts. imageSize is 0 until the server says.
+static uint32_t received;
+static uint32_t requestOffset;
+static uint32_t imageSize;
+
+// The image's strong ETag, or else its Last-Modified date, from the 200 that
+// started it. A range is only asked for with If-Range set to it, so a server
+// whose image has changed sends the whole new one instead of a piece of it.
+static char validator[HTTP_MAX_VALIDATOR];
+static bool validatorIsEtag;
+
+#if FLASH_JOURNAL
+static uint32_t imageId;
+static uint32_t resumeOffset;
+static uint32_t resumeSize;
+#endif
+
+bool httpBootFile(const char* file) {
+  return strncmp(file, "http://", 7) == 0;
+}
+
+// "http://a.b.c.d[:port]/path"
+static bool httpParseUrl(const char* url) {
+  const char* p = url + 7;
+
+  httpHost = p;
+  for (uint8_t i = 0; i < 4; i++) {
+    if (*p < '0' || *p > '9') {
+      return false;
+    }
+    uint32_t octet = parseNumber(p);
+    if (octet > 255) {
+      return false;
+    }
+    httpServer[i] = octet;
+    while (*p >= '0' && *p <= '9') {
+      p++;
+    }
+    if (i < 3 && *(p++) != '.') {
+      return false;
+    }
+  }
+
+  httpPort = HTTP_PORT;
+  if (*p == ':') {
+    httpPort = parseNumber(++p);
+    while (*p >= '0' && *p <= '9') {
+      p++;
+    }
+  }
+  httpHostLength = p - httpHost;
+
+  if (*p != '/' && *p != 0) {
+    return false;
+  }
+  httpPath = *p ? p : "/";
+  return httpPort != 0;
+}
+
+void httpInit (void) {
+  state = HTTP_IDLE;
+  // Not the same ports as on the last boot, in case the server remembers them
+  localPort = HTTP_LOCAL_PORT + (millis() & 0x3FF);
+}
+
+void httpEnd (void) {
+  netCloseSocket(NET_SOCKET_HTTP);
+}
+
+static void httpConnect(void) {
+  requestOffset = received;
+#if FLASH_JOURNAL
+  if (received == 0) {
+    requestOffset = resumeOffset;
+  }
+#endif
+  if (requestOffset && (validator[0] == 0 || (received && imageSize == 0))) {
+    // Nothing to check a range against, either which image it's of or the
+    // image's size, so fetch the whole image again
+    requestOffset = 0;
+    if (received) {
+      received = 0;
+      flash_init();
+    }
+  }
+
+  lineLength = 0;
+  lineTruncated = false;
+  statusCode = 0;
+  haveLength = false;
+  contentLength = 0;
+  haveRange = false;
+  rangeStart = 0;
+  rangeTotal = 0;
+  chunked = false;
+
+  netOpenTcpSocket(NET_SOCKET_HTTP, localPort, HTTP_MSS);
+  localPort = (localPort == 0xFFFF) ? HTTP_LOCAL_PORT : localPort + 1;
+  netConnect(NET_SOCKET_HTTP, httpServer, httpPort);
+  state = HTTP_CONNECTING;
+}
+
+// Drop the connection and try again later, asking for the rest of the image
+static void httpRetry(void) {
+  netCloseSocket(NET_SOCKET_HTTP);
+  state = HTTP_WAITING;
+  retryTime = millis() + HTTP_RETRY_TIME;
+  LOG("HTTP: reconnecting");
+}
+
+static void httpFail(void) {
+  netCloseSocket(NET_SOCKET_HTTP);
+  state = HTTP_FAILED;
+}
+
+bool httpRequestUrl(const char* url) {
+  if (!httpParseUrl(url)) {
+    LOG("HTTP: the host must be an IP address");
+    return false;
+  }
+
+  received = 0;
+  imageSize = 0;
+  validator[0] = 0;
+  validatorIsEtag = false;
+
+  // Reset flashing
+  flash_init();
+
+#if FLASH_JOURNAL
+  imageId = crc16(url, strlen(url), 0xFFFF);
+  resumeOffset = flash_journal_check(imageId, &resumeSize);
+  if (resumeOffset && strlen(flash_journal_tag()) < sizeof(validator)) {
+    // The journal's tag is the validator of the image it was written for
+    strcpy(validator, flash_journal_tag());
+  }
+  if (resumeOffset) {
+    LOG_STR("HTTP resume at ");
+    LOG_HEX(resumeOffset);
+    LOG_STR("\r\n");
+  }
+#endif
+
+  httpConnect();
+  return true;
+}
+
+static void httpSendRequest(void) {
+  uint8_t txBuffer[sizeof(netConfig.tftpFile) + 96 + HTTP_MAX_VALIDATOR + 12];
+  uint8_t* txPtr = txBuffer;
+
+  txPtr = appendText(txPtr, "GET ");
+  txPtr = appendText(txPtr, httpPath);
+  txPtr = appendText(txPtr, " HTTP/1.1\r\nHost: ");
+  memcpy(txPtr, httpHost, httpHostLength);
+  txPtr += httpHostLength;
+  txPtr = appendText(txPtr, "\r\n");
+  if (requestOffset) {
+    txPtr = appendText(txPtr, "Range: bytes=");
+    txPtr = appendDecimal(txPtr, requestOffset);
+    txPtr = appendText(txPtr, "-\r\nIf-Range: ");
+    txPtr = appendText(txPtr, validator);
+    txPtr = appendText(txPtr, "\r\n");
+  }
+  // One request per connection, the end of the body is the end of the image
+  txPtr = appendText(txPtr, "Connection: close\r\n\r\n");
+
+  netBeginFrame(NET_SOCKET_HTTP);
+  netWrite(NET_SOCKET_HTTP, txBuffer, txPtr - txBuffer);
+  netEndPacket(NET_SOCKET_HTTP);
+}
+
+// Returns the value if the line is the named header, name in lower case
+static const char* httpHeaderValue(const char* name) {
+  const char* p = line;
+  while (*name) {
+    if ((*(p++) | 0x20) != *(name++)) {
+      return NULL;
+    }
+  }
+  if (*(p++) != ':') {
+    return NULL;
+  }
+  while (*p == ' ') {
+    p++;
+  }
+  return p;
+}
+
+static void httpHeaderLine(void) {
+  const char* value;
+
+  if (statusCode == 0) {
+    // "HTTP/1.1 206 Partial Content"
+    value = strchr(line, ' ');
+    statusCode = value ? parseNumber(value + 1) : 0;
+    if (statusCode == 0) {
+      statusCode = 1;
+    }
+    if (statusCode == 200) {
+      // A new image, which brings its own validator
+      validator[0] = 0;
+      validatorIsEtag = false;
+    }
+  } else if (statusCode == 200 && !lineTruncated && (value = httpHeaderValue("etag"))) {
+    // Weak ETags (W/"...") can't be used with If-Range
+    if (value[0] == '"' && strlen(value) < sizeof(validator)) {
+      strcpy(validator, value);
+      validatorIsEtag = true;
+    }
+  } else if (statusCode == 200 && !lineTruncated && !validatorIsEtag &&
+             (value = httpHeaderValue("last-modified"))) {
+    if (strlen(value) < sizeof(validator)) {
+      strcpy(validator, value);
+    }
+  } else if ((value = httpHeaderValue("content-length"))) {
+    contentLength = parseNumber(value);
+    haveLength = true;
+  } else if ((value = httpHeaderValue("content-range"))) {
+    // "bytes first-last/total", the total may be '*'
+    value = strchr(value, ' ');
+    if (value) {
+      rangeStart = parseNumber(value + 1);
+      value = strchr(value, '/');
+      rangeTotal = value ? parseNumber(value + 1) : 0;
+      haveRange = true;
+    }
+  } else if ((value = httpHeaderValue("transfer-encoding"))) {
+    chunked = strstr(value, "chunked") != NULL;
+  }
+}
+
+// Returns true at the blank line that ends the headers
+static bool httpHeaderByte(uint8_t c) {
+  if (c == '\r') {
+    return false;
+  }
+  if (c != '\n') {
+    if (lineLength < sizeof(line) - 1) {
+      line[lineLength++] = c;
+    } else {
+      lineTruncated = true;
+    }
+    return false;
+  }
+
+  line[lineLength] = 0;
+  bool end = (lineLength == 0);
+  if (!end) {
+    httpHeaderLine();
+  }
+  lineLength = 0;
+  lineTruncated = false;
+  return end;
+}
+
+// Decide what to do with the body, returns the next state
+static httpState_t httpHeadersDone(void) {
+  LOG_STR("HTTP: status ");
+  LOG_HEX(statusCode);
+  LOG_STR(" length ");
+  LOG_HEX(contentLength);
+  LOG_STR("\r\n");
+
+  if (chunked) {
+    LOG("HTTP: chunked responses aren't supported");
+    return HTTP_FAILED;
+  }
+
+  // If-Range already made the server check it's the same image, the total
+  // has to agree as well
+  if (statusCode == 206 && haveRange && rangeStart == requestOffset) {
+    if (received == requestOffset && imageSize && rangeTotal == imageSize) {
+      // The rest of the image after a dropped connection
+      return HTTP_BODY;
+    }
+#if FLASH_JOURNAL
+    // The rest of the image after a reset, if the server still has the
+    // image the journal was written for
+    if (received == 0 && rangeTotal == resumeSize && flash_plan(rangeTotal) &&
+        flash_journal_resume(requestOffset)) {
+      received = requestOffset;
+      imageSize = rangeTotal;
+      return HTTP_BODY;
+    }
+    resumeOffset = 0;
+#endif
+    // Start over without a range
+    received = 0;
+    flash_init();
+    return HTTP_WAITING;
+  }
+
+  if (statusCode != 200) {
+    return HTTP_FAILED;
+  }
+
+  // The whole image, whatever we asked for
+  if (received) {
+    received = 0;
+    flash_init();
+  }
+  imageSize = haveLength ? contentLength : 0;
+  if (imageSize && !flash_plan(imageSize)) {
+    return HTTP_FAILED;
+  }
+#if FLASH_JOURNAL
+  if (imageSize) {
+    flash_journal_start(imageId, imageSize, validator);
+  }
+#endif
+  return HTTP_BODY;
+}
+
+static void httpDone(void) {
+  flash_finish();
+  netDisconnect(NET_SOCKET_HTTP);
+
+  LOG("HTTP DONE");
+  startApplication();
+}
+
+// Stream body bytes into the flash row accumulator, from data if they have
+// already been read or else straight from the socket
+static void httpStoreBody(const uint8_t* data, uint32_t length) {
+  if (imageSize && length > imageSize - received) {
+    // Anything past the end isn't ours
+    length = imageSize - received;
+  }
+  if (!flash_buffer_fits(length)) {
+    LOG("HTTP: image too large");
+    state = HTTP_FAILED;
+    return;
+  }
+
+  received += length;
+  while (length > 0) {
+    uint32_t space;
+    uint8_t* dest = flash_buffer_get(&space);
+    if (space > length) {
+      space = length;
+    }
+
+    if (data) {
+      memcpy(dest, data, space);
+      data += space;
+    } else {
+      // The last row completed is programmed while the DMAC fetches the
+      // next bytes
+      netReadPacketBegin(NET_SOCKET_HTTP, dest, space);
+      flash_program_pending();
+      netReadPacketEnd();
+    }
+    length -= space;
+
+    flash_buffer_commit_deferred(space);
+  }
+
+  if (imageSize && received == imageSize) {
+    httpDone();
+  }
+}
+
+static void httpReadHeaders(uint16_t length) {
+  uint8_t buffer[64];
+
+  while (length > 0 && state == HTTP_HEADERS) {
+    uint16_t n = length < sizeof(buffer) ? length : sizeof(buffer);
+    netReadPacket(NET_SOCKET_HTTP, buffer, n);
+    length -= n;
+
+    for (uint16_t i = 0; i < n; i++) {
+      if (httpHeaderByte(buffer[i])) {
+        state = httpHeadersDone();
+        if (state == HTTP_BODY) {
+          httpStoreBody(buffer + i + 1, n - i - 1);
+        }
+        break;
+      }
+    }
+  }
+
+  if (state == HTTP_BODY && length > 0) {
+    httpStoreBody(NULL, length);
+  }
+}
+
+bool httpRun (void) {
+  uint8_t status;
+  uint16_t length;
+
+  switch (state) {
+    case HTTP_WAITING:
+      if (millis() > retryTime) {
+        httpConnect();
+      }
+      return false;
+
+    case HTTP_CONNECTING:
+      status = netSocketStatus(NET_SOCKET_HTTP);
+      if (status == SOCK_ESTABLISHED) {
+        httpSendRequest();
+        state = HTTP_HEADERS;
+        return true;
+      }
+      if (status == SOCK_CLOSED) {
+        // Refused, or the SYN timed out
+        httpRetry();
+      }
+      return false;
+
+    case HTTP_HEADERS:
+    case HTTP_BODY:
+      // Status first, so data that arrived with the FIN is read before the
+      // close is acted on
+      status = netSocketStatus(NET_SOCKET_HTTP);
+      length = netPeekStream(NET_SOCKET_HTTP, UINT16_MAX);
+      if (length == 0) {
+        if (status == SOCK_CLOSE_WAIT && state == HTTP_BODY && imageSize == 0 && received > 0) {
+          // No Content-Length, so the server closing ends the image
+          httpDone();
+        } else if (status == SOCK_CLOSE_WAIT || status == SOCK_CLOSED) {
+          httpRetry();
+        }
+        return false;
+      }
+
+      if (state == HTTP_HEADERS) {
+        httpReadHeaders(length);
+      } else {
+        httpStoreBody(NULL, length);
+      }
+
+      // Hands the space back to the W5500, which reopens the TCP window
+      netConsumePacket(NET_SOCKET_HTTP);
+      if (state == HTTP_WAITING) {
+        httpRetry();
+      } else if (state == HTTP_FAILED) {
+        httpFail();
+      }
+      return true;
+
+    default:
+      return false;
+  }
+}
@@ -0,0 +1,36 @@
+// HTTP image transfer
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// True if the boot file is an "http://" URL
+bool httpBootFile(const char* file);
+
+void httpInit (void);
+void httpEnd (void);
+bool httpRun (void);
+
+// GET the image at url, "http://a.b.c.d[:port]/path". There's no DNS, so
+// the host has to be an IP address. Returns false if the URL can't be used.
+bool httpRequestUrl(const char* url);
+
+#endif   // __HTTP_H__
@@ -0,0 +1,210 @@
+// Raw Ethernet image transfer
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <string.h>
+#include "l2boot.h"
+#include "networking.h"
+#include "utils.h"
+#include "log.h"
+#include "flash.h"
+
+#define ETH_HEADER_SIZE     14
+#define ETH_MIN_FRAME       60
+
+// Resend the REQUEST, or the last ACK once a transfer is running
+#define L2BOOT_RETRY_TIME   (200ULL*48ULL)   // 200ms
+
+// W5500 RX buffer space taken by a full frame, including its length field
+#define L2BOOT_FRAME_SPACE  (2 + ETH_HEADER_SIZE + L2BOOT_HEADER_SIZE + L2BOOT_MAX_DATA)
+
+static const uint8_t broadcastMac[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+static const char* requestFile;
+static uint8_t serverMac[6];
+static bool serverLocked;
+static uint16_t nextSeq;
+static uint8_t window;
+// In order frames received since the last ACK
+static uint8_t unacked;
+static uint64_t retryTime;
+
+void l2bootInit (void) {
+  netOpenMacrawSocket(NET_SOCKET_MACRAW);
+
+  // Only advertise as many frames as the socket buffer can hold
+  window = netRxBufferSize(NET_SOCKET_MACRAW) / L2BOOT_FRAME_SPACE;
+  if (window == 0) {
+    window = 1;
+  }
+}
+
+void l2bootEnd (void) {
+  netCloseSocket(NET_SOCKET_MACRAW);
+}
+
+bool l2bootActive (void) {
+  return serverLocked;
+}
+
+static void l2bootSend(const uint8_t dest[6], uint8_t type, const uint8_t* payload, uint16_t len) {
+  uint8_t head[ETH_HEADER_SIZE + L2BOOT_HEADER_SIZE];
+
+  memcpy(head, dest, 6);
+  memcpy(head + 6, netConfig.macAddr, 6);
+  head[12] = L2BOOT_ETHERTYPE >> 8;
+  head[13] = L2BOOT_ETHERTYPE & 0xff;
+  head[14] = type;
+  head[15] = 0;
+  head[16] = nextSeq >> 8;
+  head[17] = nextSeq & 0xff;
+  head[18] = len >> 8;
+  head[19] = len & 0xff;
+
+  netBeginFrame(NET_SOCKET_MACRAW);
+  netWrite(NET_SOCKET_MACRAW, head, sizeof(head));
+  netWrite(NET_SOCKET_MACRAW, payload, len);
+
+  // Pad up to the Ethernet minimum, the length field says what's real
+  uint16_t frameLen = sizeof(head) + len;
+  if (frameLen < ETH_MIN_FRAME) {
+    uint8_t pad[ETH_MIN_FRAME - sizeof(head)];
+    memset(pad, 0, sizeof(pad));
+    netWrite(NET_SOCKET_MACRAW, pad, ETH_MIN_FRAME - frameLen);
+  }
+
+  netEndPacket(NET_SOCKET_MACRAW);
+
+  retryTime = millis() + L2BOOT_RETRY_TIME;
+}
+
+void l2bootRequestFile(const char* file) {
+  uint8_t payload[1 + sizeof(netConfig.tftpFile)];
+  size_t fileLen = strlen(file) + 1; // Include the null terminator
+
+  requestFile = file;
+  serverLocked = false;
+  nextSeq = 0;
+  unacked = 0;
+
+  // Reset flashing
+  flash_init();
+
+  payload[0] = window;
+  memcpy(payload + 1, file, fileLen);
+  l2bootSend(broadcastMac, L2BOOT_TYPE_REQUEST, payload, 1 + fileLen);
+}
+
+static void l2bootSendACK(void) {
+  l2bootSend(serverMac, L2BOOT_TYPE_ACK, &window, 1);
+  unacked = 0;
+}
+
+// Stream a DATA payload into the flash row accumulator
+static void l2bootStoreData(uint16_t length) {
+  while (length > 0) {
+    uint32_t space;
+    uint8_t* dest = flash_buffer_get(&space);
+    if (space > length) {
+      space = length;
+    }
+
+    netReadPacket(NET_SOCKET_MACRAW, dest, space);
+    length -= space;
+
+    flash_buffer_commit(space);
+  }
+}
+
+// Handle a frame whose headers are in head, returns true if it was ours
+static bool l2bootHandleFrame(const uint8_t* head, uint16_t payloadLen) {
+  if (((head[12] << 8) + head[13]) != L2BOOT_ETHERTYPE || head[14] != L2BOOT_TYPE_DATA) {
+    return false;
+  }
+
+  uint8_t flags = head[15];
+  uint16_t seq = (head[16] << 8) + head[17];
+  uint16_t len = (head[18] << 8) + head[19];
+  if (len > payloadLen || len > L2BOOT_MAX_DATA) {
+    return false;
+  }
+
+  if (!serverLocked) {
+    // The first sender to start from frame 0 gets the transfer
+    if (seq != 0) {
+      return false;
+    }
+    memcpy(serverMac, head + 6, 6);
+    serverLocked = true;
+    LOG("L2BOOT: sender found");
+  } else if (memcmp(serverMac, head + 6, 6) != 0) {
+    return false;
+  }
+
+  if (seq != nextSeq) {
+    // Lost or repeated frame, tell the sender where to go back to
+    l2bootSendACK();
+    return true;
+  }
+
+  if (!flash_buffer_fits(len)) {
+    l2bootSend(serverMac, L2BOOT_TYPE_ERROR, NULL, 0);
+    return true;
+  }
+
+  l2bootStoreData(len);
+  nextSeq++;
+  unacked++;
+
+  if (flags & L2BOOT_FLAG_LAST) {
+    flash_finish();
+    l2bootSendACK();
+
+    // Make sure the final ACK has left before the W5500 is abandoned
+    while (netSendStatus(NET_SOCKET_MACRAW) == NET_SEND_BUSY);
+
+    LOG("L2BOOT DONE");
+    startApplication();
+  }
+
+  // ACK every half window so the sender never stalls waiting for one
+  if (unacked >= (window + 1) / 2) {
+    l2bootSendACK();
+  }
+  return true;
+}
+
+bool l2bootRun (void) {
+  uint8_t head[ETH_HEADER_SIZE + L2BOOT_HEADER_SIZE];
+
+  uint16_t frameLen = netPeekFrame(NET_SOCKET_MACRAW, head, sizeof(head));
+  if (frameLen == 0) {
+    if (millis() > retryTime) {
+      if (serverLocked) {
+        l2bootSendACK();
+      } else {
+        l2bootRequestFile(requestFile);
+      }
+    }
+    return false;
+  }
+
+  bool handled = frameLen >= sizeof(head) && l2bootHandleFrame(head, frameLen - sizeof(head));
+  netConsumePacket(NET_SOCKET_MACRAW);
+
+  return handled;
+}
@@ -0,0 +1,54 @@
+// Raw Ethernet image transfer
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef __L2BOOT_H__
+#define __L2BOOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Protocol, shared with tools/l2boot_sender.c
+//
+// Every frame carries a 6 byte header after the Ethernet header: type,
+// flags, sequence number and payload length, big endian. The device
+// broadcasts a REQUEST (payload: window, file name) until a sender answers
+// with DATA frames numbered from 0. ACKs carry the next sequence number the
+// device expects plus its window, and the sender goes back to that frame on
+// a duplicate ACK or a timeout.
+#define L2BOOT_ETHERTYPE      0x88B5  // IEEE 802 local experimental
+#define L2BOOT_HEADER_SIZE    6
+#define L2BOOT_MAX_DATA       1488
+
+#define L2BOOT_TYPE_REQUEST   1
+#define L2BOOT_TYPE_DATA      2
+#define L2BOOT_TYPE_ACK       3
+#define L2BOOT_TYPE_ERROR     4
+
+#define L2BOOT_FLAG_LAST      0x01
+
+void l2bootInit (void);
+void l2bootEnd (void);
+bool l2bootRun (void);
+
+// Broadcast a request for the file
+void l2bootRequestFile(const char* file);
+
+// True once a sender has started the transfer
+bool l2bootActive (void);
+
+#endif   // __L2BOOT_H__
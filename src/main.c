@@ -26,10 +26,17 @@
 #include "board_driver_led.h"
 #include "board_driver_i2c.h"
 #include "networking.h"
+#include "spi.h"
 #include "tftp.h"
 #include "utils.h"
 #include "log.h"
 #include "dhcp.h"
+#if L2BOOT
+#include "l2boot.h"
+#endif
+#if HTTP_BOOT
+#include "http.h"
+#endif
 
 extern void board_init(void);
 
@@ -122,7 +129,7 @@ int main(void)
   LED_init();
 
   /* Start the sys tick (1/48th of a millisecond) */
-  SysTick_Config(1000);
+  SysTick_Config(SYSTICK_CYCLES);
 
   // Init logging & wait for a USB connection (only debug mode)
   logInit();
@@ -142,9 +149,43 @@ int main(void)
     LOG("netInit: failed")
   }
 
+#if SPI_BENCHMARK
+  spiBenchmark();
+#endif
+
+  // Nothing sent before the link is up gets anywhere, and DHCP doesn't
+  // retransmit, so wait for it rather than losing the first DISCOVER
+  uint64_t bootloaderExitTime = millis() + BOOTLOADER_MAX_RUN_TIME;
+  while (!netLinkUp()) {
+    if (exitBootloaderAfterTimeout && (millis() > bootloaderExitTime)) {
+      LOG("No link, booting");
+      startApplication();
+    }
+  }
+
+#if L2BOOT
+  // Try a raw Ethernet transfer first, it needs neither DHCP nor ARP
+  l2bootInit();
+  l2bootRequestFile(netConfig.tftpFile);
+  uint64_t l2bootExitTime = millis() + L2BOOT_LISTEN_TIME;
+  while (millis() < l2bootExitTime) {
+    if (l2bootRun()) {
+      led_pulse_rate = 4;
+      // Once a sender is talking, give it the full timeout
+      l2bootExitTime = millis() + BOOTLOADER_MAX_RUN_TIME;
+    }
+  }
+  if (l2bootActive()) {
+    LOG("L2BOOT: transfer stalled");
+  } else {
+    LOG("L2BOOT: no sender");
+  }
+  l2bootEnd();
+#endif
+
   // Send DHCP request
   dhcpInit();
-  uint64_t bootloaderExitTime = millis() + BOOTLOADER_MAX_RUN_TIME;
+  bootloaderExitTime = millis() + BOOTLOADER_MAX_RUN_TIME;
   while(1) {
     if(dhcpRun()) {
       LOG("DHCP: got response");
@@ -161,6 +202,32 @@ int main(void)
 
   led_pulse_rate = 2; // 2x second is after DHCP
 
+#if HTTP_BOOT
+  // An http:// boot file is fetched over TCP instead of TFTP
+  if (httpBootFile(netConfig.tftpFile)) {
+    httpInit();
+    LOG_STR("HTTP: Start '");
+    LOG_STR(netConfig.tftpFile);
+    LOG_STR("'\r\n");
+
+    if (httpRequestUrl(netConfig.tftpFile)) {
+      bootloaderExitTime = millis() + BOOTLOADER_MAX_RUN_TIME;
+      while (1) {
+        if (httpRun()) {
+          led_pulse_rate = 4;
+          bootloaderExitTime = millis() + BOOTLOADER_MAX_RUN_TIME;
+        }
+
+        if (exitBootloaderAfterTimeout && (millis() > bootloaderExitTime)) {
+          LOG("No HTTP response, booting");
+          startApplication();
+        }
+      }
+    }
+    httpEnd();
+  }
+#endif
+
   // Start TFTP
   tftpInit();
   LOG_STR("TFTP: Start ");
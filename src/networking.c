@@ -40,6 +40,24 @@
 #define STRINGIZE2(s) #s
 #define STRINGIZE(s) STRINGIZE2(s)
 
+// Socket buffer partitioning, in KB
+static const uint8_t rxBufferSizes[8] = { W5X00_RXBUF_SIZES };
+static const uint8_t txBufferSizes[8] = { W5X00_TXBUF_SIZES };
+
+// The W5500 ignores a partitioning that doesn't fit, so catch it at build time
+#define NET_BUF_VALID(n) ((n) == 0 || (n) == 1 || (n) == 2 || (n) == 4 || (n) == 8 || (n) == 16)
+#define NET_BUF_CHECK2(a, b, c, d, e, f, g, h) \
+  ((a) + (b) + (c) + (d) + (e) + (f) + (g) + (h) <= 16 && \
+   NET_BUF_VALID(a) && NET_BUF_VALID(b) && NET_BUF_VALID(c) && NET_BUF_VALID(d) && \
+   NET_BUF_VALID(e) && NET_BUF_VALID(f) && NET_BUF_VALID(g) && NET_BUF_VALID(h))
+#define NET_BUF_CHECK(sizes) NET_BUF_CHECK2(sizes)
+_Static_assert(NET_BUF_CHECK(W5X00_RXBUF_SIZES), "W5X00_RXBUF_SIZES: sizes must be 0, 1, 2, 4, 8 or 16 and add up to at most 16");
+_Static_assert(NET_BUF_CHECK(W5X00_TXBUF_SIZES), "W5X00_TXBUF_SIZES: sizes must be 0, 1, 2, 4, 8 or 16 and add up to at most 16");
+
+// The buffer sizes are powers of 2, so the wrap point comes from a mask
+#define NET_RXBUF_SIZE(socket) ((uint16_t)rxBufferSizes[socket] << 10)
+#define NET_TXBUF_SIZE(socket) ((uint16_t)txBufferSizes[socket] << 10)
+
 // Declare the network settings
 netConfig_t netConfig = {
   .macAddr = {0x00, 0xAA, 0xBB, 0xCC, 0xDE, 0x02},
@@ -50,6 +68,16 @@ netConfig_t netConfig = {
   .tftpFile = STRINGIZE(TFTP_DEFAULT),
 };
 
+// Sockets with a SEND whose SEND_OK/TIMEOUT hasn't been collected yet, and
+// sockets whose last SEND timed out
+static uint8_t sendPending;
+static uint8_t sendTimedOut;
+
+#ifdef W5X00_INT_PIN
+// Sockets that INTn signalled received data for, cleared once RX_RSR reads back 0
+static uint8_t rxPending;
+#endif
+
 #ifdef MAC_CHIP_ADDRESS
 static void readMACAddress() {
   // Read the MAC (6 bytes) from address 0xFA
@@ -69,6 +97,47 @@ static void readMACAddress() {
 }
 #endif
 
+// Step the SPI clock up from SPI_BITRATE towards SPI_MAX_BITRATE while the
+// W5500 passes the pattern check. If some rate fails, settle one step below
+// the fastest passing rate to leave some margin.
+static void netTrainSpi(void) {
+  const uint8_t slowestBaud = SPI_BAUD(SPI_BITRATE);
+  uint8_t fastestBaud = SPI_BAUD(SPI_MAX_BITRATE);
+  uint8_t bestBaud = slowestBaud;
+  bool failed = false;
+
+  for (uint8_t baud = slowestBaud; baud > fastestBaud; baud--) {
+    spiSetBaud(baud - 1);
+    if (!w5x00CheckSpi()) {
+      failed = true;
+      break;
+    }
+    bestBaud = baud - 1;
+  }
+
+  if (failed && bestBaud < slowestBaud) {
+    bestBaud++;
+  }
+
+  spiSetBaud(bestBaud);
+
+  LOG_STR("SPI: ");
+  LOG_HEX(SPI_BITRATE_FOR_BAUD(bestBaud));
+  LOG_STR("\r\n");
+}
+
+// Called when data read from the W5500 is inconsistent. Drop back one
+// clock step (never below SPI_BITRATE) in case the link is marginal.
+static void netSpiError(void) {
+  uint8_t baud = spiGetBaud();
+
+  LOG("SPI: error");
+
+  if (baud < SPI_BAUD(SPI_BITRATE)) {
+    spiSetBaud(baud + 1);
+  }
+}
+
 bool netInit() {
   spiInit(SPI_BITRATE);
 
@@ -76,6 +145,8 @@ bool netInit() {
     spiEnd();
     return false;
   }
+
+  netTrainSpi();
 #ifdef MAC_CHIP_ADDRESS
   readMACAddress();
 #endif
@@ -91,22 +162,53 @@ bool netInit() {
   LOG_STR("\r\n")
 #endif
   // Write MAC address
-  w5x00WriteBuffer(REG_SHAR0, GP_W_CB, netConfig.macAddr, 6);
+  w5x00StageBuffer(REG_SHAR0, GP_W_CB, netConfig.macAddr, 6);
 
-  // Assign 2KB RX and TX memory per socket
+  // Partition the RX and TX memory between the sockets
   for (uint8_t idx = 0; idx < 8; ++idx) {
     uint8_t controlByte = (0x0C + (idx << 5));
-    w5x00WriteReg(0x1E, controlByte, 2);   //0x1E - Sn_RXBUF_SIZE
-    w5x00WriteReg(0x1F, controlByte, 2);   //0x1F - Sn_TXBUF_SIZE
+    const uint8_t bufferSizes[2] = {
+      rxBufferSizes[idx],   //0x1E - Sn_RXBUF_SIZE
+      txBufferSizes[idx],   //0x1F - Sn_TXBUF_SIZE
+    };
+    w5x00StageBuffer(0x1E, controlByte, bufferSizes, sizeof(bufferSizes));
   }
+  w5x00Flush();
+
+#ifdef W5X00_INT_PIN
+  w5x00InitInterrupt();
+#endif
 
   return true;
 }
 
+bool netLinkUp(void) {
+  static uint8_t lastStatus;
+
+  uint8_t status = w5x00LinkStatus();
+  if (status != lastStatus) {
+    lastStatus = status;
+    LOG_STR("Link: ");
+    LOG_HEX_BYTE(status);
+    LOG_STR("\r\n");
+  }
+  return status & PHYCFGR_LNK;
+}
+
+uint16_t netRxBufferSize(uint8_t socket) {
+  return NET_RXBUF_SIZE(socket);
+}
+
 void netCommitConfig() {
-  w5x00WriteBuffer(REG_SIPR0, GP_W_CB, netConfig.ipAddr, 4);
-  w5x00WriteBuffer(REG_SUBR0, GP_W_CB, netConfig.netMask, 4);
-  w5x00WriteBuffer(REG_GAR0,  GP_W_CB, netConfig.gwAddr, 4);
+  // GAR, SUBR, SHAR and SIPR are adjacent, so write them in a single burst
+  uint8_t regs[REG_SIPR3 - REG_GAR0 + 1];
+  memcpy(&regs[REG_GAR0 - REG_GAR0], netConfig.gwAddr, 4);
+  memcpy(&regs[REG_SUBR0 - REG_GAR0], netConfig.netMask, 4);
+  memcpy(&regs[REG_SHAR0 - REG_GAR0], netConfig.macAddr, 6);
+  memcpy(&regs[REG_SIPR0 - REG_GAR0], netConfig.ipAddr, 4);
+
+  w5x00StageBuffer(REG_GAR0, GP_W_CB, regs, sizeof(regs));
+  w5x00Flush();
 }
 
 void netEnd (void) {
@@ -115,62 +217,211 @@ void netEnd (void) {
   spiEnd();
 }
 
-void netCloseSocket3 (void) {
-  // Close the socket
-  w5x00WriteReg(REG_S3_CR, S3_W_CB, CR_CLOSE);
+#ifdef W5X00_INT_PIN
+// SIMR is only written by the host, so read-modify-write it through the shadow
+static void netSetSocketInterrupt(uint8_t socket, bool enable) {
+  uint8_t simr;
+  w5x00CachedReadBuffer(REG_SIMR, GP_R_CB, &simr, 1);
+  if (enable) {
+    simr |= 1 << socket;
+  } else {
+    simr &= ~(1 << socket);
+  }
+  w5x00StageReg(REG_SIMR, GP_W_CB, simr);
+}
+#endif
 
-  // Wait for command to complete
-  while (w5x00ReadReg(REG_S3_CR, S3_R_CB));
+void netCloseSocket (uint8_t socket) {
+#ifdef W5X00_INT_PIN
+  // Stop the socket from driving INTn
+  netSetSocketInterrupt(socket, false);
+#endif
+
+  // Close the socket, which also abandons any SEND in progress
+  w5x00Command(SOCK_W_CB(socket), CR_CLOSE);
+  sendPending &= ~(1 << socket);
+  sendTimedOut &= ~(1 << socket);
 }
 
-void netOpenUdpSocket3 (uint16_t port) {
-  netCloseSocket3();
+static void netOpenSocket (uint8_t socket, uint8_t mode, uint16_t port, uint8_t status) {
+  netCloseSocket(socket);
 
   // Clear the socket interrupt register
-  w5x00WriteReg(REG_S3_IR, S3_W_CB, 0xFF);
-  // Set UDP mode
-  w5x00WriteReg(REG_S3_MR, S3_W_CB, MR_UDP);
+  w5x00WriteReg(REG_SN_IR, SOCK_W_CB(socket), 0xFF);
+#ifdef W5X00_INT_PIN
+  // Received data and SEND completions drive INTn
+  w5x00StageReg(REG_SN_IMR, SOCK_W_CB(socket), IR_RECV | IR_SEND_OK | IR_TIMEOUT);
+  netSetSocketInterrupt(socket, true);
+  rxPending |= 1 << socket;
+#endif
+  // Set the socket mode
+  w5x00StageReg(REG_SN_MR, SOCK_W_CB(socket), mode);
   // Set the socket port
-  w5x00WriteWord(REG_S3_PORT0, S3_W_CB, port);
+  w5x00StageWord(REG_SN_PORT0, SOCK_W_CB(socket), port);
 
   // Open Socket
-  w5x00WriteReg(REG_S3_CR, S3_W_CB, CR_OPEN);
+  w5x00Command(SOCK_W_CB(socket), CR_OPEN);
 
   // Wait for socket to be opened
-  while (w5x00ReadReg(REG_S3_SR, S3_R_CB) != SOCK_UDP);
+  while (w5x00ReadReg(REG_SN_SR, SOCK_R_CB(socket)) != status);
+}
+
+void netOpenUdpSocket (uint8_t socket, uint16_t port) {
+  netOpenSocket(socket, MR_UDP, port, SOCK_UDP);
+}
+
+void netOpenMulticastSocket (uint8_t socket, const uint8_t group[4], uint16_t port) {
+  // The group's MAC address is 01:00:5E followed by the low 23 bits of the
+  // group address. DHAR/DIPR/DPORT must be set before the socket is opened.
+  uint8_t regs[12] = { 0x01, 0x00, 0x5E, group[1] & 0x7F, group[2], group[3],
+                       group[0], group[1], group[2], group[3], port >> 8, port & 0xff };
+  w5x00StageBuffer(REG_SN_DHAR0, SOCK_W_CB(socket), regs, sizeof(regs));
+
+  netOpenSocket(socket, MR_UDP | MR_MULTI, port, SOCK_UDP);
+}
+
+void netOpenMacrawSocket (uint8_t socket) {
+  netOpenSocket(socket, MR_MACRAW | MR_MFEN, 0, SOCK_MACRAW);
+}
+
+void netOpenTcpSocket (uint8_t socket, uint16_t port, uint16_t mss) {
+  // Goes out with the CLOSE in netOpenSocket(), before the socket opens
+  w5x00StageWord(REG_SN_MSSR0, SOCK_W_CB(socket), mss);
+
+  netOpenSocket(socket, MR_TCP, port, SOCK_INIT);
+}
+
+void netConnect (uint8_t socket, const uint8_t address[4], uint16_t port) {
+  uint8_t regs[6];
+  memcpy(regs, address, 4);
+  regs[4] = port >> 8;
+  regs[5] = port & 0xff;
+  w5x00StageBuffer(REG_SN_DIPR0, SOCK_W_CB(socket), regs, sizeof(regs));
+
+  // The SYN and its retries are up to the W5500, the socket goes back to
+  // SOCK_CLOSED if they time out
+  w5x00Command(SOCK_W_CB(socket), CR_CONNECT);
+}
+
+void netDisconnect (uint8_t socket) {
+  w5x00Command(SOCK_W_CB(socket), CR_DISCON);
+  sendPending &= ~(1 << socket);
+}
+
+uint8_t netSocketStatus (uint8_t socket) {
+  return w5x00ReadReg(REG_SN_SR, SOCK_R_CB(socket));
 }
 
-static uint16_t netReceivedDataSizeSocket3(void) {
+// Returns the number of bytes waiting in the socket's RX buffer. Only the
+// host moves RX_RD, so the read pointer comes from the register shadow.
+static uint16_t netReceivedDataSize(uint8_t socket, uint16_t* readPointer) {
   // This is from https://github.com/sstaub/Ethernet3/blob/d2b7dc0efcddfd9d7c7bd07b8c131a240cd5f148/src/utility/w5500.cpp#L93
   uint16_t val=0,val1=0;
   do {
-    val1 = w5x00ReadWord(REG_S3_RX_RSR0, S3_R_CB);
+    val1 = w5x00ReadWord(REG_SN_RX_RSR0, SOCK_R_CB(socket));
     if (val1 != 0)
-      val = w5x00ReadWord(REG_S3_RX_RSR0, S3_R_CB);
+      val = w5x00ReadWord(REG_SN_RX_RSR0, SOCK_R_CB(socket));
   }
   while (val != val1);
+
+  *readPointer = w5x00CachedReadWord(REG_SN_RX_RD0, SOCK_R_CB(socket));
   return val;
 }
 
-static void netReadBufferSocket3(uint16_t* readPointer, uint8_t* buffer, uint16_t len) {
-  for(uint16_t i = 0; i < len; i++) {
-    buffer[i] = w5x00ReadReg((*readPointer)++, S3_RXBUF_CB);
+static void netReadBuffer(uint8_t socket, uint16_t* readPointer, uint8_t* buffer, uint16_t len) {
+  const uint16_t bufferSize = NET_RXBUF_SIZE(socket);
+
+  while (len > 0) {
+    // Split the burst where the data wraps around the end of the socket buffer
+    uint16_t chunk = bufferSize - (*readPointer & (bufferSize - 1));
+    if (chunk > len) {
+      chunk = len;
+    }
+
+    w5x00ReadBuffer(*readPointer, SOCK_RXBUF_CB(socket), buffer, chunk);
+
+    // The read pointer is free running, uint16_t overflow follows the W5500's internal pointer
+    *readPointer += chunk;
+    buffer += chunk;
+    len -= chunk;
   }
 }
 
-uint16_t netReceivePacketSocket3(uint8_t* buffer, uint8_t* fromAddr, uint16_t* fromPort) {
-  // Get packet size
-  uint16_t packetSize = netReceivedDataSizeSocket3();
-  if (packetSize == 0) {
+// Record how a SEND finished, from the socket's SEND_OK/TIMEOUT bits
+static void netSendDone(uint8_t socket, uint8_t ir) {
+  sendPending &= ~(1 << socket);
+  if (ir & IR_TIMEOUT) {
+    LOG("SEND TIMEOUT");
+    sendTimedOut |= 1 << socket;
+  } else {
+    sendTimedOut &= ~(1 << socket);
+  }
+}
+
+#ifdef W5X00_INT_PIN
+// Collect the sockets INTn fired for. RECV is cleared before RX_RSR is
+// looked at, so anything that arrives later pulls INTn low again. SEND_OK and
+// TIMEOUT are cleared and recorded here too, for netSendStatus(), because
+// INTn is edge triggered: a completion left latched would hold it low and
+// hide every later RECV. SIR is re-read until it is empty so that INTn is
+// released.
+static void netCollectInterrupts(void) {
+  if (!w5x00InterruptPending()) {
+    return;
+  }
+
+  uint8_t sir;
+  while ((sir = w5x00ReadReg(REG_SIR, GP_R_CB)) != 0) {
+    for (uint8_t socket = 0; socket < 8; socket++) {
+      if (!(sir & (1 << socket))) {
+        continue;
+      }
+      uint8_t ir = w5x00ReadReg(REG_SN_IR, SOCK_R_CB(socket)) & (IR_RECV | IR_SEND_OK | IR_TIMEOUT);
+      w5x00WriteReg(REG_SN_IR, SOCK_W_CB(socket), ir);
+      if (ir & IR_RECV) {
+        rxPending |= 1 << socket;
+      }
+      if ((ir & (IR_SEND_OK | IR_TIMEOUT)) && (sendPending & (1 << socket))) {
+        netSendDone(socket, ir);
+      }
+    }
+  }
+}
+#endif
+
+// Packet currently being read on each socket, between netPeekPacket() and
+// netConsumePacket()
+typedef struct {
+  uint16_t readPointer;
+  uint16_t remaining;
+} netRxPacket_t;
+
+static netRxPacket_t rxPacket[8];
+
+uint16_t netPeekPacket(uint8_t socket, uint8_t* buffer, uint16_t len, uint8_t* fromAddr, uint16_t* fromPort) {
+#ifdef W5X00_INT_PIN
+  netCollectInterrupts();
+
+  if (!(rxPending & (1 << socket))) {
+    // Nothing new, leave the SPI bus alone
     return 0;
   }
+#endif
 
-  // Get the current read pointer
-  uint16_t readPointer = w5x00ReadWord(REG_S3_RX_RD0, S3_R_CB);
+  netRxPacket_t* packet = &rxPacket[socket];
+
+  // Get packet size and the current read pointer
+  uint16_t packetSize = netReceivedDataSize(socket, &packet->readPointer);
+  if (packetSize == 0) {
+#ifdef W5X00_INT_PIN
+    rxPending &= ~(1 << socket);
+#endif
+    return 0;
+  }
 
   // Read UDP header
   uint8_t head[8];
-  netReadBufferSocket3(&readPointer, head, sizeof(head));
+  netReadBuffer(socket, &packet->readPointer, head, sizeof(head));
 
   if (fromAddr) {
     memcpy(fromAddr, head, 4);
@@ -182,42 +433,240 @@ uint16_t netReceivePacketSocket3(uint8_t* buffer, uint8_t* fromAddr, uint16_t* f
 
   uint16_t dataSize = (head[6] << 8) + head[7];
 
-  netReadBufferSocket3(&readPointer, buffer, dataSize);
+  if (packetSize < sizeof(head) || dataSize > packetSize - sizeof(head)) {
+    // The header can't be right, so the SPI link is corrupting data. Slow
+    // it down and throw away everything that has been received.
+    netSpiError();
+    uint16_t pending = netReceivedDataSize(socket, &packet->readPointer);
+    packet->readPointer += pending;
+    packet->remaining = 0;
+    netConsumePacket(socket);
+    return 0;
+  }
+
+  packet->remaining = dataSize;
+  netReadPacket(socket, buffer, len);
 
-  // Send the new pointer value back to the chip
-  w5x00WriteWord(REG_S3_RX_RD0, S3_W_CB, readPointer);
+  return dataSize;
+}
+
+uint16_t netPeekFrame(uint8_t socket, uint8_t* buffer, uint16_t len) {
+#ifdef W5X00_INT_PIN
+  netCollectInterrupts();
+
+  if (!(rxPending & (1 << socket))) {
+    return 0;
+  }
+#endif
+
+  netRxPacket_t* packet = &rxPacket[socket];
+
+  uint16_t packetSize = netReceivedDataSize(socket, &packet->readPointer);
+  if (packetSize == 0) {
+#ifdef W5X00_INT_PIN
+    rxPending &= ~(1 << socket);
+#endif
+    return 0;
+  }
+
+  // MACRAW frames are preceded by their length, which includes the 2 byte
+  // length field itself
+  uint8_t head[2];
+  netReadBuffer(socket, &packet->readPointer, head, sizeof(head));
+  uint16_t frameSize = (head[0] << 8) + head[1];
+
+  if (packetSize < sizeof(head) || frameSize < sizeof(head) || frameSize > packetSize) {
+    netSpiError();
+    uint16_t pending = netReceivedDataSize(socket, &packet->readPointer);
+    packet->readPointer += pending;
+    packet->remaining = 0;
+    netConsumePacket(socket);
+    return 0;
+  }
+
+  packet->remaining = frameSize - sizeof(head);
+  netReadPacket(socket, buffer, len);
+
+  return frameSize - sizeof(head);
+}
+
+uint16_t netPeekStream(uint8_t socket, uint16_t len) {
+#ifdef W5X00_INT_PIN
+  netCollectInterrupts();
+
+  if (!(rxPending & (1 << socket))) {
+    return 0;
+  }
+#endif
+
+  netRxPacket_t* packet = &rxPacket[socket];
+
+  uint16_t available = netReceivedDataSize(socket, &packet->readPointer);
+  if (available == 0) {
+#ifdef W5X00_INT_PIN
+    rxPending &= ~(1 << socket);
+#endif
+    return 0;
+  }
+
+  // Whatever is left over stays in the buffer for the next call
+  if (available > len) {
+    available = len;
+  }
+  packet->remaining = available;
+  return available;
+}
+
+uint16_t netReadPacket(uint8_t socket, uint8_t* buffer, uint16_t len) {
+  netRxPacket_t* packet = &rxPacket[socket];
+
+  if (len > packet->remaining) {
+    len = packet->remaining;
+  }
+
+  netReadBuffer(socket, &packet->readPointer, buffer, len);
+  packet->remaining -= len;
+
+  return len;
+}
+
+#ifdef SPI_DMAC_TX_TRIGGER
+// Set while the DMAC is still reading for netReadPacketBegin()
+static bool rxDmaActive;
+#endif
+
+uint16_t netReadPacketBegin(uint8_t socket, uint8_t* buffer, uint16_t len) {
+#ifdef SPI_DMAC_TX_TRIGGER
+  netRxPacket_t* packet = &rxPacket[socket];
+  const uint16_t bufferSize = NET_RXBUF_SIZE(socket);
+
+  if (len > packet->remaining) {
+    len = packet->remaining;
+  }
+
+  // Up to the end of the socket buffer with the CPU if the data wraps, the
+  // rest as a single burst on the DMAC
+  uint16_t chunk = bufferSize - (packet->readPointer & (bufferSize - 1));
+  if (chunk < len) {
+    netReadBuffer(socket, &packet->readPointer, buffer, chunk);
+  } else {
+    chunk = 0;
+  }
+  uint16_t tail = len - chunk;
+  if (tail >= SPI_DMA_MIN_SIZE) {
+    w5x00ReadBufferBegin(packet->readPointer, SOCK_RXBUF_CB(socket), buffer + chunk, tail);
+    rxDmaActive = true;
+    packet->readPointer += tail;
+  } else {
+    netReadBuffer(socket, &packet->readPointer, buffer + chunk, tail);
+  }
+  packet->remaining -= len;
+  return len;
+#else
+  return netReadPacket(socket, buffer, len);
+#endif
+}
+
+void netReadPacketEnd(void) {
+#ifdef SPI_DMAC_TX_TRIGGER
+  if (rxDmaActive) {
+    w5x00TransferEnd();
+    rxDmaActive = false;
+  }
+#endif
+}
 
-  w5x00WriteReg(REG_S3_CR, S3_W_CB, CR_RECV);
+void netConsumePacket(uint8_t socket) {
+  netRxPacket_t* packet = &rxPacket[socket];
 
-  while (w5x00ReadReg(REG_S3_CR, S3_R_CB));
+  // Skip whatever the caller didn't read
+  packet->readPointer += packet->remaining;
+  packet->remaining = 0;
 
+  // Send the new pointer value back to the chip
+  w5x00StageWord(REG_SN_RX_RD0, SOCK_W_CB(socket), packet->readPointer);
+
+  w5x00Command(SOCK_W_CB(socket), CR_RECV);
+}
+
+uint16_t netReceivePacket(uint8_t socket, uint8_t* buffer, uint8_t* fromAddr, uint16_t* fromPort) {
+  uint16_t dataSize = netPeekPacket(socket, buffer, UINT16_MAX, fromAddr, fromPort);
+  if (dataSize > 0) {
+    netConsumePacket(socket);
+  }
   return dataSize;
 }
 
-void netBeginPacketSocket3(const uint8_t address[4], uint16_t port) {
-  for (uint8_t i = 0; i < 4; ++i) {
-    w5x00WriteReg(REG_S3_DIPR0 + i, S3_W_CB, address[i]);
+netSendStatus_t netSendStatus(uint8_t socket) {
+  if (sendPending & (1 << socket)) {
+#ifdef W5X00_INT_PIN
+    // The completion arrives through INTn
+    netCollectInterrupts();
+    if (sendPending & (1 << socket)) {
+      return NET_SEND_BUSY;
+    }
+#else
+    uint8_t ir = w5x00ReadReg(REG_SN_IR, SOCK_R_CB(socket));
+    if (!(ir & (IR_SEND_OK | IR_TIMEOUT))) {
+      return NET_SEND_BUSY;
+    }
+
+    // Acknowledge the completion and remember how it went
+    w5x00WriteReg(REG_SN_IR, SOCK_W_CB(socket), ir & (IR_SEND_OK | IR_TIMEOUT));
+    netSendDone(socket, ir);
+#endif
   }
-  w5x00WriteWord(REG_S3_DPORT0, S3_W_CB, port);
+
+  return (sendTimedOut & (1 << socket)) ? NET_SEND_TIMEOUT : NET_SEND_OK;
 }
 
-void netWriteSocket3(const uint8_t *data, uint16_t size) {
-  uint16_t writePointer = w5x00ReadWord(REG_S3_TX_WR0, S3_R_CB);
+void netBeginFrame(uint8_t socket) {
+  // The W5500 can only have one SEND in flight per socket
+  while (netSendStatus(socket) == NET_SEND_BUSY);
+}
+
+void netBeginPacket(uint8_t socket, const uint8_t address[4], uint16_t port) {
+  // The previous SEND may still be using DIPR/DPORT for ARP
+  netBeginFrame(socket);
+
+  // DIPR and DPORT are adjacent, so write them in a single burst
+  uint8_t regs[6];
+  memcpy(regs, address, 4);
+  regs[4] = port >> 8;
+  regs[5] = port & 0xff;
+
+  // Skipped by the shadow when the destination hasn't changed
+  w5x00StageBuffer(REG_SN_DIPR0, SOCK_W_CB(socket), regs, sizeof(regs));
+}
+
+void netWrite(uint8_t socket, const uint8_t *data, uint16_t size) {
+  const uint16_t bufferSize = NET_TXBUF_SIZE(socket);
+
+  // Only the host moves TX_WR, so it comes from the register shadow
+  uint16_t writePointer = w5x00CachedReadWord(REG_SN_TX_WR0, SOCK_R_CB(socket));
+
+  while (size > 0) {
+    // Split the burst where the data wraps around the end of the socket buffer
+    uint16_t chunk = bufferSize - (writePointer & (bufferSize - 1));
+    if (chunk > size) {
+      chunk = size;
+    }
+
+    w5x00WriteBuffer(writePointer, SOCK_TXBUF_CB(socket), data, chunk);
 
-  while (size--)
-  {
-    w5x00WriteReg(writePointer++, S3_TXBUF_CB, *data++);
     // W5500 auto increments the readpointer by memory mapping a 16 bit address
     // Use uint16_t overflow from 0xFFFF to 0x10000 to follow W5500 internal pointer
+    writePointer += chunk;
+    data += chunk;
+    size -= chunk;
   }
-  w5x00WriteWord(REG_S3_TX_WR0, S3_W_CB, writePointer);
+  w5x00StageWord(REG_SN_TX_WR0, SOCK_W_CB(socket), writePointer);
 }
 
-void netEndPacketSocket3() {
-  // Transmit the data
-  w5x00WriteReg(REG_S3_CR, S3_W_CB, CR_SEND);
-
-  // Wait for transmission to complete
-  while (w5x00ReadReg(REG_S3_CR, S3_R_CB));
+void netEndPacket(uint8_t socket) {
+  // Transmit the data (flushes the staged destination and TX_WR first). This
+  // doesn't wait for SEND_OK, which is collected by netSendStatus() or the
+  // next netBeginPacket(), so ARP and transmission overlap with other work.
+  w5x00Command(SOCK_W_CB(socket), CR_SEND);
+  sendPending |= 1 << socket;
 }
-
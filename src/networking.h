@@ -38,16 +38,80 @@ void netEnd();
 
 void netCommitConfig();
 
-void netOpenUdpSocket3(uint16_t port);
-void netCloseSocket3(void);
+// True while the Ethernet link is up
+bool netLinkUp(void);
+
+// Size of a socket's RX buffer in the W5500
+uint16_t netRxBufferSize(uint8_t socket);
+
+// Socket roles. Only socket 0 can do MACRAW, 4-6 are kept for additional
+// TFTP sessions and socket 7's registers are scratch space for SPI link
+// training.
+#define NET_SOCKET_MACRAW 0
+#define NET_SOCKET_DHCP 1
+#define NET_SOCKET_TFTP 3
+#define NET_SOCKET_TFTP_MCAST 4
+// HTTP_BOOT replaces TFTP, so it takes over TFTP's socket and its RX buffer
+#define NET_SOCKET_HTTP 3
+
+void netOpenUdpSocket(uint8_t socket, uint16_t port);
+void netCloseSocket(uint8_t socket);
+// Joins the group with IGMP, sends go to the group
+void netOpenMulticastSocket(uint8_t socket, const uint8_t group[4], uint16_t port);
+// Raw Ethernet frames, only valid on socket 0
+void netOpenMacrawSocket(uint8_t socket);
+
+// TCP client sockets. The W5500 runs the connection itself, retransmits
+// included, and advertises the free space in the socket's RX buffer as the
+// window. mss goes into Sn_MSSR.
+void netOpenTcpSocket(uint8_t socket, uint16_t port, uint16_t mss);
+void netConnect(uint8_t socket, const uint8_t address[4], uint16_t port);
+void netDisconnect(uint8_t socket);
+// Sn_SR, one of the SOCK_* states in w5500.h
+uint8_t netSocketStatus(uint8_t socket);
 
 // Receiving packets
-uint16_t netReceivePacketSocket3(uint8_t* buffer, uint8_t* fromAddr, uint16_t* fromPort);
+uint16_t netReceivePacket(uint8_t socket, uint8_t* buffer, uint8_t* fromAddr, uint16_t* fromPort);
+
+// Receiving packets in pieces. netPeekPacket() returns the payload size and
+// copies up to len bytes of it, netReadPacket() streams the next part of the
+// payload and netConsumePacket() releases the packet back to the W5500. Every
+// packet that netPeekPacket() returned non-zero for must be consumed.
+uint16_t netPeekPacket(uint8_t socket, uint8_t* buffer, uint16_t len, uint8_t* fromAddr, uint16_t* fromPort);
+uint16_t netReadPacket(uint8_t socket, uint8_t* buffer, uint16_t len);
+void netConsumePacket(uint8_t socket);
+// netReadPacket() in two halves. With the DMAC the data may still be arriving
+// in buffer until netReadPacketEnd(), so the CPU can do other work that keeps
+// off the SPI bus (and buffer) in between. Without it the read is done by
+// netReadPacketBegin().
+uint16_t netReadPacketBegin(uint8_t socket, uint8_t* buffer, uint16_t len);
+void netReadPacketEnd(void);
+// As netPeekPacket(), for MACRAW sockets. The frame starts at the destination
+// MAC address and the returned size excludes the FCS.
+uint16_t netPeekFrame(uint8_t socket, uint8_t* buffer, uint16_t len);
+// As netPeekPacket(), for TCP sockets. Returns how many of the bytes waiting
+// (up to len) make up the next piece of the stream, there is no header.
+uint16_t netPeekStream(uint8_t socket, uint16_t len);
+
+// Sending Packets. On a connected TCP socket use netBeginFrame() instead of
+// netBeginPacket().
+void netBeginPacket(uint8_t socket, const uint8_t address[4], uint16_t port);
+void netWrite(uint8_t socket, const uint8_t *data, uint16_t size);
+void netEndPacket(uint8_t socket);
+// Start a MACRAW frame, which is written whole with netWrite()
+void netBeginFrame(uint8_t socket);
+
+// Sends complete in the background. netEndPacket() returns as soon as the
+// SEND command has been issued; this reports how the last one went.
+typedef enum {
+  NET_SEND_OK,
+  NET_SEND_BUSY,
+  NET_SEND_TIMEOUT,
+} netSendStatus_t;
+
+netSendStatus_t netSendStatus(uint8_t socket);
 
-// Sending Packets
-void netBeginPacketSocket3(const uint8_t address[4], uint16_t port);
-void netWriteSocket3(const uint8_t *data, uint16_t size);
-void netEndPacketSocket3();
+#define NET_MAX_TFTP_SERVERS 4
 
 typedef struct {
   uint8_t macAddr[6];
@@ -56,6 +120,9 @@ typedef struct {
   uint8_t gwAddr[4];
   uint8_t tftpServer[4];
   char tftpFile[128];
+  // TFTP server list from DHCP option 150, one per TFTP socket (3-6)
+  uint8_t tftpServers[NET_MAX_TFTP_SERVERS][4];
+  uint8_t tftpServerCount;
 } netConfig_t;
 
 extern netConfig_t netConfig;
@@ -20,14 +20,30 @@
 //  (code adapted from Arduino SAMD core)
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <sam.h>
 #include "spi.h"
 #include "board_definitions.h"
-
-#define SERCOM_FREQ_REF (48000000)   // See 'SERCOM.h'
+#include "utils.h"
+#include "log.h"
 
 static bool spiInitialized = false;
 
+#ifdef SPI_DMAC_TX_TRIGGER
+// RX gets the lower channel number so it wins the static arbitration and
+// the SERCOM receive buffer can never overflow
+#define SPI_DMA_RX_CHANNEL  (0U)
+#define SPI_DMA_TX_CHANNEL  (1U)
+#define SPI_DMA_CHANNELS    (2U)
+
+// The DMAC requires both descriptor tables to be 128 bit aligned
+static DmacDescriptor dmaDescriptors[SPI_DMA_CHANNELS] __attribute__ ((aligned (16)));
+static DmacDescriptor dmaWriteback[SPI_DMA_CHANNELS] __attribute__ ((aligned (16)));
+
+// Source of the dummy bytes for reads, sink for the received bytes of writes
+static uint8_t dmaDummy;
+#endif
+
 // This comes from http://ww1.microchip.com/downloads/en/AppNotes/00002465A.pdf
 static void setPeripheralPinMux(uint32_t pinmux) {
   uint8_t port = (uint8_t)((pinmux >> 16)/32);
@@ -38,6 +54,43 @@ static void setPeripheralPinMux(uint32_t pinmux) {
   PORT->Group[port].PINCFG[((pinmux >> 16) - (port*32))].bit.PMUXEN = 1;
 }
 
+#ifdef SPI_DMAC_TX_TRIGGER
+static void spiDmaInitChannel(uint8_t channel, uint8_t trigger) {
+  DMAC->CHID.reg = DMAC_CHID_ID(channel);
+
+  DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+  DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+  while (DMAC->CHCTRLA.reg & DMAC_CHCTRLA_SWRST);
+
+  // One beat (byte) per trigger from the SERCOM
+  DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) |
+    DMAC_CHCTRLB_TRIGSRC(trigger) |
+    DMAC_CHCTRLB_TRIGACT_BEAT;
+}
+
+static void spiDmaInit (void) {
+  PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+  PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+
+  DMAC->CTRL.reg &= ~DMAC_CTRL_DMAENABLE;
+  DMAC->CTRL.reg = DMAC_CTRL_SWRST;
+  while (DMAC->CTRL.reg & DMAC_CTRL_SWRST);
+
+  DMAC->BASEADDR.reg = (uint32_t)dmaDescriptors;
+  DMAC->WRBADDR.reg = (uint32_t)dmaWriteback;
+  DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xF);
+
+  spiDmaInitChannel(SPI_DMA_RX_CHANNEL, SPI_DMAC_RX_TRIGGER);
+  spiDmaInitChannel(SPI_DMA_TX_CHANNEL, SPI_DMAC_TX_TRIGGER);
+}
+
+static void spiDmaStartChannel(uint8_t channel) {
+  DMAC->CHID.reg = DMAC_CHID_ID(channel);
+  DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_TCMPL | DMAC_CHINTFLAG_TERR | DMAC_CHINTFLAG_SUSP;
+  DMAC->CHCTRLA.reg |= DMAC_CHCTRLA_ENABLE;
+}
+#endif
+
 static void spiReset (void) {
   SPI_SERCOM->SPI.CTRLA.bit.SWRST = 1;
   while (SPI_SERCOM->SPI.CTRLA.bit.SWRST || SPI_SERCOM->SPI.SYNCBUSY.bit.SWRST);
@@ -79,7 +132,7 @@ void spiInit (uint32_t bitrate) {
   SPI_SERCOM->SPI.CTRLB.reg = SERCOM_SPI_CTRLB_RXEN;
   while(SPI_SERCOM->SPI.SYNCBUSY.bit.CTRLB);
 
-  SPI_SERCOM->SPI.BAUD.reg = SERCOM_FREQ_REF / (2 * bitrate) - 1;
+  SPI_SERCOM->SPI.BAUD.reg = SPI_BAUD(bitrate);
 
   // Enable SPI
   SPI_SERCOM->SPI.CTRLA.bit.ENABLE = 1;
@@ -89,10 +142,32 @@ void spiInit (uint32_t bitrate) {
   while (SPI_SERCOM->SPI.SYNCBUSY.bit.CTRLB);
   while (!SPI_SERCOM->SPI.CTRLB.bit.RXEN);
 
+#ifdef SPI_DMAC_TX_TRIGGER
+  spiDmaInit();
+#endif
+
   spiInitialized = true;
 }
 
+// BAUD is enable protected, so the SERCOM has to be stopped to change it
+void spiSetBaud (uint8_t baud) {
+  SPI_SERCOM->SPI.CTRLA.bit.ENABLE = 0;
+  while (SPI_SERCOM->SPI.SYNCBUSY.bit.ENABLE);
+
+  SPI_SERCOM->SPI.BAUD.reg = baud;
+
+  SPI_SERCOM->SPI.CTRLA.bit.ENABLE = 1;
+  while (SPI_SERCOM->SPI.SYNCBUSY.bit.ENABLE);
+}
+
+uint8_t spiGetBaud (void) {
+  return SPI_SERCOM->SPI.BAUD.reg;
+}
+
 void spiEnd (void) {
+#ifdef SPI_DMAC_TX_TRIGGER
+  DMAC->CTRL.reg &= ~DMAC_CTRL_DMAENABLE;
+#endif
   spiReset();
 }
 
@@ -104,12 +179,41 @@ uint8_t spiTransfer (uint8_t data) {
   return SPI_SERCOM->SPI.DATA.bit.DATA;
 }
 
+// Exchange size bytes in place
 void spiTransferBytes (uint8_t *data, uint16_t size) {
-  while (size--)
-  {
-    SPI_SERCOM->SPI.DATA.bit.DATA = *(data++);
+  spiTransferFrame(0, 0, data, data, size);
+}
+
+// Clock out a headerSize byte header (MSB first) followed by size bytes of
+// txData (zeros if NULL), storing the bytes received during the data phase in
+// rxData (discarded if NULL). DATA is refilled as soon as DRE says the
+// holding register is free, so the shifter doesn't idle between bytes while
+// RXC is serviced.
+void spiTransferFrame (uint32_t header, uint8_t headerSize, const uint8_t *txData, uint8_t *rxData, uint16_t size) {
+  uint16_t total = headerSize + size;
+  uint16_t sent = 0;
+  uint16_t received = 0;
 
-    while (SPI_SERCOM->SPI.INTFLAG.bit.RXC == 0);
+  while (received < total) {
+    // At most two bytes in flight (shifter + holding register) so RX can't overflow
+    if (sent < total && (uint16_t)(sent - received) < 2 && SPI_SERCOM->SPI.INTFLAG.bit.DRE) {
+      uint8_t out;
+      if (sent < headerSize) {
+        out = header >> (8 * (headerSize - 1 - sent));
+      } else {
+        out = txData ? txData[sent - headerSize] : 0;
+      }
+      SPI_SERCOM->SPI.DATA.reg = out;
+      sent++;
+    }
+
+    if (SPI_SERCOM->SPI.INTFLAG.bit.RXC) {
+      uint8_t in = SPI_SERCOM->SPI.DATA.reg;
+      if (rxData && received >= headerSize) {
+        rxData[received - headerSize] = in;
+      }
+      received++;
+    }
   }
 }
 
@@ -118,3 +222,67 @@ uint16_t spiTransfer16 (uint16_t data) {
   uint8_t lsb = spiTransfer(data & 0x00FF);
   return msb << 8 | lsb;
 }
+
+#if SPI_BENCHMARK
+// Compare the cycles per byte of a byte-at-a-time loop with the pipelined
+// loop. Nothing is selected on the bus, so this only clocks SCK.
+void spiBenchmark (void) {
+  static uint8_t buffer[SPI_BENCHMARK_SIZE];
+
+  uint64_t start = cycles();
+  for (uint16_t i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = spiTransfer(0U);
+  }
+  uint32_t serial = cycles() - start;
+
+  start = cycles();
+  spiTransferFrame(0, 0, NULL, buffer, sizeof(buffer));
+  uint32_t pipelined = cycles() - start;
+
+  LOG_STR("SPI bench (cycles/byte) baud: ");
+  LOG_HEX_BYTE(spiGetBaud());
+  LOG_STR(" serial: ");
+  LOG_HEX(serial / sizeof(buffer));
+  LOG_STR(" pipelined: ");
+  LOG_HEX(pipelined / sizeof(buffer));
+  LOG_STR("\r\n");
+}
+#endif
+
+#ifdef SPI_DMAC_TX_TRIGGER
+// Start a DMA transfer of size bytes. A NULL txData clocks out zeros, a
+// NULL rxData discards the received bytes. The transfer runs without the
+// CPU, use spiDmaBusy() or spiDmaWait() to find out when it is done.
+void spiDmaStart (const uint8_t *txData, uint8_t *rxData, uint16_t size) {
+  DmacDescriptor *rx = &dmaDescriptors[SPI_DMA_RX_CHANNEL];
+  DmacDescriptor *tx = &dmaDescriptors[SPI_DMA_TX_CHANNEL];
+
+  // Incrementing addresses point to the end of the block, see the DMAC chapter of the datasheet
+  rx->BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | (rxData ? DMAC_BTCTRL_DSTINC : 0);
+  rx->BTCNT.reg = size;
+  rx->SRCADDR.reg = (uint32_t)&SPI_SERCOM->SPI.DATA.reg;
+  rx->DSTADDR.reg = rxData ? (uint32_t)(rxData + size) : (uint32_t)&dmaDummy;
+  rx->DESCADDR.reg = 0;
+
+  dmaDummy = 0;
+  tx->BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | (txData ? DMAC_BTCTRL_SRCINC : 0);
+  tx->BTCNT.reg = size;
+  tx->SRCADDR.reg = txData ? (uint32_t)(txData + size) : (uint32_t)&dmaDummy;
+  tx->DSTADDR.reg = (uint32_t)&SPI_SERCOM->SPI.DATA.reg;
+  tx->DESCADDR.reg = 0;
+
+  // Arm RX before TX so that no received byte is missed
+  spiDmaStartChannel(SPI_DMA_RX_CHANNEL);
+  spiDmaStartChannel(SPI_DMA_TX_CHANNEL);
+}
+
+// The RX channel finishes last, once the final byte has been clocked in
+bool spiDmaBusy (void) {
+  DMAC->CHID.reg = DMAC_CHID_ID(SPI_DMA_RX_CHANNEL);
+  return (DMAC->CHINTFLAG.reg & (DMAC_CHINTFLAG_TCMPL | DMAC_CHINTFLAG_TERR)) == 0;
+}
+
+void spiDmaWait (void) {
+  while (spiDmaBusy());
+}
+#endif
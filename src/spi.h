@@ -21,13 +21,41 @@
 #ifndef __SPI_H__
 #define __SPI_H__
 
+#include <stdint.h>
+#include <stdbool.h>
+#include "board_definitions.h"
+
+#define SERCOM_FREQ_REF (48000000)   // See 'SERCOM.h'
+
+// BAUD register value for a bitrate, and the bitrate a BAUD value results in
+#define SPI_BAUD(bitrate) (SERCOM_FREQ_REF / (2 * (bitrate)) - 1)
+#define SPI_BITRATE_FOR_BAUD(baud) (SERCOM_FREQ_REF / (2 * ((baud) + 1)))
 
 void spiInit (uint32_t bitrate);
 void spiEnd (void);
 
+void spiSetBaud (uint8_t baud);
+uint8_t spiGetBaud (void);
+
 uint8_t spiTransfer (uint8_t data);
 void spiTransferBytes (uint8_t *data, uint16_t size);
+void spiTransferFrame (uint32_t header, uint8_t headerSize, const uint8_t *txData, uint8_t *rxData, uint16_t size);
 uint16_t spiTransfer16 (uint16_t data);
 
+#if SPI_BENCHMARK
+#define SPI_BENCHMARK_SIZE (512U)
+
+void spiBenchmark (void);
+#endif
+
+#ifdef SPI_DMAC_TX_TRIGGER
+// Transfers shorter than this are cheaper to do with the CPU
+#define SPI_DMA_MIN_SIZE (16U)
+
+void spiDmaStart (const uint8_t *txData, uint8_t *rxData, uint16_t size);
+bool spiDmaBusy (void);
+void spiDmaWait (void);
+#endif
+
 
 #endif   // __SPI_H__
@@ -44,26 +44,359 @@
 #define TFTP_OPCODE_DATA  ((uint16_t) 3)
 #define TFTP_OPCODE_ACK   ((uint16_t) 4)
 #define TFTP_OPCODE_ERROR ((uint16_t) 5)
+// Option acknowledgement from RFC 2347
+#define TFTP_OPCODE_OACK  ((uint16_t) 6)
 
 #define TFTP_ERROR_DISK_FULL ((uint16_t) 3)
+#define TFTP_ERROR_OPTIONS   ((uint16_t) 8)
 
-#define TFTP_MAX_PAYLOAD     (512)
+// Block sizes (RFC 2348). The largest block that still fits a 1500 byte
+// Ethernet MTU without IP fragmentation, which the W5500 can't reassemble.
+#define TFTP_DEFAULT_BLKSIZE (512)
+#define TFTP_MAX_BLKSIZE     (1468)
+
+// Every block takes the 8 byte W5500 UDP header plus the 4 byte TFTP header
+// in a socket's RX buffer
+#define TFTP_BLOCK_OVERHEAD  (12)
+
+// Largest OACK we accept, enough for every option we send echoed back
+#define TFTP_MAX_OACK        (160)
+
+// Retransmission timeout, estimated from the round trip time as in RFC 6298.
+// All times are in SysTick ticks (1/48th of a millisecond).
+#define TFTP_INITIAL_RTO     (250UL*48UL)
+#define TFTP_MIN_RTO         (10UL*48UL)
+#define TFTP_MAX_RTO         (2000UL*48UL)
+#define TFTP_MAX_RETRIES     (8)
+
+// Stack kept free below the reorder pool
+#define TFTP_STACK_RESERVE   (4096)
+
+// The "offset" and "length" options are used by several features
+#define TFTP_RANGES (FLASH_JOURNAL || TFTP_ROWS || TFTP_STRIPES || TFTP_SELECT)
+
+#if TFTP_MULTICAST
+// Multicast blocks arrive in any order, so they are a whole number of flash
+// rows and each one is programmed where it belongs
+#define TFTP_MCAST_BLKSIZE    (1024)
+#define TFTP_MCAST_MAX_BLOCKS (1024)
+#endif
 
 static uint16_t nextBlockNumber;
+// Last block we ACKed, so the server already knows we have it
+static uint16_t ackedBlock;
 static uint8_t tftpServer[4];
+static const char* tftpFile;
+// Negotiated block size, anything shorter ends the transfer
+static uint16_t blockSize;
+// Negotiated number of blocks per ACK, and how far into the current window we are
+static uint16_t windowSize;
+static uint16_t blocksInWindow;
+// Set once a gap or retransmit has been answered, until the next in order block
+static bool gapAcked;
+static bool optionsRequested;
+// Image size from the tsize option, 0 if the server didn't say
+static uint32_t transferSize;
+// Port the server answers from (its TID), 0 until it has answered
+static uint16_t serverPort;
+
+// Retransmission state
+static uint32_t srtt;
+static uint32_t rttvar;
+static uint32_t rto;
+static bool rttValid;
+// Set while the reply to the last send can be timed. Replies to
+// retransmissions are ambiguous, so they are never sampled (Karn's rule).
+static bool rttSampling;
+static uint64_t timerStart;
+// Last repeated block that put the timer off since it started, see tftpRun()
+static uint16_t timerPostponed;
+static uint8_t retries;
+static bool retransmitEnabled;
+
+// Reorder pool, see tftpPoolInit()
+extern uint32_t __end__;
+extern uint32_t __StackTop;
+static uint8_t* poolStart;
+static uint16_t poolStride;
+static uint16_t poolSlots;
+// Blocks delivered from the pool, each one a retransmit the server didn't have to do
+static uint16_t retransmitsAvoided;
+
+// Socket the packet being handled came in on
+static uint8_t rxSocket = NET_SOCKET_TFTP;
+
+#if TFTP_MULTICAST
+// RFC 2090 state. nextBlockNumber is the first block still missing.
+static bool multicastAllowed;
+static bool multicastOffered;
+static bool multicast;
+static bool masterClient;
+static uint8_t mcastGroup[4];
+static uint16_t mcastPort;
+// Block number of the short final block, 0 until known
+static uint16_t lastBlockNumber;
+static uint8_t blockMap[TFTP_MCAST_MAX_BLOCKS / 8];
+
+// The group socket must hold a whole block, which it doesn't in builds that
+// give most of the buffer memory to other sockets
+static bool tftpMulticastFits(uint16_t size) {
+  return netRxBufferSize(NET_SOCKET_TFTP_MCAST) >= size + TFTP_BLOCK_OVERHEAD;
+}
+#endif
+
+#if TFTP_RANGES
+// Byte range asked for with the "offset" and "length" options, 0 leaves the
+// option out. Block 1 starts requestOffset bytes into the file. imageOffset
+// and imageLength are what the server's OACK agreed to.
+static uint32_t requestOffset;
+static uint32_t requestLength;
+static uint32_t imageOffset;
+static uint32_t imageLength;
+#endif
+
+#if FLASH_JOURNAL
+// Image identity for the flash journal, and what it says is already in flash.
+// imageCrc is the server's "crc32" option, the CRC-32 of the whole file as
+// text, which has to match the journal's tag before a resume.
+static uint32_t imageId;
+static uint32_t resumeOffset;
+static uint32_t resumeSize;
+static char imageCrc[11];
+#endif
+
+#if TFTP_ROWS
+// Row manifest, "<file>.rows": little endian words, a magic, the chunk size
+// (a multiple of the flash row size), the image size, then the CRC-32 of
+// every chunk of the image. It is compared with flash as it streams in, and
+// only the chunks that differ are fetched, a run of them at a time.
+#define TFTP_ROWS_MAGIC       (0x53574F52UL)  // "ROWS"
+#define TFTP_ROWS_HEADER      (3)
+#define TFTP_ROWS_MAX_CHUNKS  (1024)
+
+typedef enum {
+  ROWS_OFF,
+  ROWS_MANIFEST,
+  ROWS_RANGES
+} tftpRowsPhase_t;
+
+static tftpRowsPhase_t rowsPhase;
+static const char* imageFile;
+static char rowsFile[sizeof(netConfig.tftpFile) + 5];
+// Manifest parsing
+static bool rowsValid;
+static uint32_t rowsWords;
+static uint32_t rowsWord;
+static uint8_t rowsWordFill;
+static uint32_t rowsChunkSize;
+static uint32_t rowsImageSize;
+static uint16_t rowsChunks;
+static uint16_t rowsChanged;
+// Chunks that differ from flash, and the next one to look at
+static uint8_t rowsDiff[TFTP_ROWS_MAX_CHUNKS / 8];
+static uint16_t rowsNext;
+// TID of the last finished range, in case our final ACK got lost
+static uint16_t rowsStalePort;
+#endif
+
+#if TFTP_SELECT
+// Server selection: the candidates are probed at once, each on its own
+// socket (3-6), with a request that only asks for tsize. The first to
+// answer gets the transfer, the rest are kept in order for failover.
+#define TFTP_PROBE_PORT       ((uint16_t) 0xC100)
+// Retransmissions without an answer before moving to the next server
+#define TFTP_FAILOVER_RETRIES (3)
+
+static uint8_t candidates[NET_MAX_TFTP_SERVERS][4];
+static uint8_t candidateCount;
+static uint8_t currentCandidate;
+// Bit per candidate that answered a probe with an error
+static uint8_t candidatesFailed;
+static bool probing;
+static uint8_t probeRetries;
+static uint32_t probeRto;
+static uint64_t probeStart;
+// Where the image continues after a failover, and the size it must have,
+// until the new server's OACK confirms it
+static uint32_t failoverOffset;
+static uint32_t failoverSize;
+// Failovers so far, limited so dead mirrors aren't cycled through forever
+static uint8_t failovers;
+#endif
+
+#if TFTP_STRIPES
+// Striped transfers: with several servers from DHCP option 150, each one
+// sends a row aligned stripe of the image on its own socket (3-6), and every
+// stripe has its own row accumulator. A server that is done takes over part
+// of another one's stripe, see tftpStripeSteal().
+#define TFTP_STRIPE_MIN_ROWS  (16)
+#define TFTP_STRIPE_PORT      ((uint16_t) 0xC000)
+// SAMD21 flash rows are 256 bytes
+#define TFTP_STRIPE_ROW_WORDS (64)
+
+typedef struct {
+  uint8_t server[4];
+  // Server TID, 0 until its OACK, and the TID of the previous request,
+  // whose stragglers are dropped
+  uint16_t port;
+  uint16_t previousPort;
+  // Next image byte expected, the end of the stripe and the end of the
+  // range the server was asked for, which is further on once another
+  // server has taken over the tail
+  uint32_t offset;
+  uint32_t end;
+  uint32_t requestEnd;
+  // Where and when the request started, for the server's rate
+  uint32_t requestStart;
+  uint64_t requestTime;
+  uint16_t nextBlock;
+  uint16_t blockSize;
+  uint16_t window;
+  uint16_t blocksInWindow;
+  bool gapAcked;
+  bool done;
+  // Done because another server took the stripe over
+  bool abandoned;
+  uint8_t retries;
+  uint32_t rto;
+  uint64_t timerStart;
+  uint16_t timerPostponed;
+  uint32_t rowFill;
+  uint32_t row[TFTP_STRIPE_ROW_WORDS];
+} tftpStripe_t;
+
+static tftpStripe_t stripes[NET_MAX_TFTP_SERVERS];
+// 0 unless a striped transfer is running
+static uint8_t stripeCount;
+// Set when a stripe can't continue, handled once its packet is consumed
+static bool stripesFailed;
+// Cleared once striping failed, so the fallback fetches the whole image
+static bool stripesAllowed;
+#endif
 
 void tftpInit (void) {
-  netOpenUdpSocket3(TFTP_PORT_LOCAL);
+  netOpenUdpSocket(NET_SOCKET_TFTP, TFTP_PORT_LOCAL);
 }
 
 void tftpEnd (void) {
-  netCloseSocket3();
+  netCloseSocket(NET_SOCKET_TFTP);
+#if TFTP_STRIPES
+  for (uint8_t i = 1; i < stripeCount; i++) {
+    netCloseSocket(NET_SOCKET_TFTP + i);
+  }
+#endif
+#if TFTP_SELECT
+  for (uint8_t i = 1; probing && i < candidateCount; i++) {
+    netCloseSocket(NET_SOCKET_TFTP + i);
+  }
+#endif
+#if TFTP_MULTICAST
+  if (multicast) {
+    netCloseSocket(NET_SOCKET_TFTP_MCAST);
+  }
+#endif
+}
+
+static void tftpTimerStart(bool retransmission) {
+  timerStart = millis();
+  timerPostponed = 0;
+  rttSampling = !retransmission;
+}
+
+static void tftpTimerSample(uint32_t rtt) {
+  if (!rttValid) {
+    srtt = rtt;
+    rttvar = rtt / 2;
+    rttValid = true;
+  } else {
+    uint32_t delta = (srtt > rtt) ? srtt - rtt : rtt - srtt;
+    rttvar = (3 * rttvar + delta) / 4;
+    srtt = (7 * srtt + rtt) / 8;
+  }
+
+  rto = srtt + 4 * rttvar;
+  if (rto < TFTP_MIN_RTO) {
+    rto = TFTP_MIN_RTO;
+  } else if (rto > TFTP_MAX_RTO) {
+    rto = TFTP_MAX_RTO;
+  }
+}
+
+// The server made progress, so restart the timer (and time the round trip
+// if this answers a fresh send)
+static void tftpTimerProgress(void) {
+  uint64_t now = millis();
+  if (rttSampling) {
+    tftpTimerSample(now - timerStart);
+    rttSampling = false;
+  }
+  retries = 0;
+  timerStart = now;
+  timerPostponed = 0;
+}
+
+// Reorder pool. Blocks that arrive ahead of a gap are parked in the RAM left
+// between the end of .bss and the stack, in slots indexed by block number.
+// A slot is a 4 byte header (block number, length) followed by the payload.
+static uint8_t* tftpPoolSlot(uint16_t blockNumber) {
+  return poolStart + (blockNumber % poolSlots) * poolStride;
+}
+
+static void tftpPoolInit(void) {
+  uint8_t* poolEnd = (uint8_t*) &__StackTop - TFTP_STACK_RESERVE;
+  poolStart = (uint8_t*) &__end__;
+  poolStride = (4 + blockSize + 3) & ~3;
+  poolSlots = (poolEnd > poolStart) ? (poolEnd - poolStart) / poolStride : 0;
+
+  // Block 0 never carries data, so it marks an empty slot
+  for (uint16_t slot = 0; slot < poolSlots; slot++) {
+    memset(poolStart + slot * poolStride, 0, 2);
+  }
+}
+
+// Park the payload of an early block, returns false if it can't be kept
+static bool tftpPoolStore(uint16_t blockNumber, uint16_t length) {
+  if (blockNumber - nextBlockNumber >= poolSlots || length > blockSize) {
+    return false;
+  }
+
+  uint8_t* slot = tftpPoolSlot(blockNumber);
+  if ((slot[0] << 8) + slot[1] == blockNumber) {
+    // Already have it
+    return true;
+  }
+
+  slot[0] = blockNumber >> 8;
+  slot[1] = blockNumber & 0xff;
+  slot[2] = length >> 8;
+  slot[3] = length & 0xff;
+  netReadPacket(rxSocket, slot + 4, length);
+  return true;
+}
+
+// Returns the payload of a parked block and frees its slot, NULL if it isn't there
+static uint8_t* tftpPoolTake(uint16_t blockNumber, uint16_t* length) {
+  if (poolSlots == 0) {
+    return NULL;
+  }
+
+  uint8_t* slot = tftpPoolSlot(blockNumber);
+  if ((slot[0] << 8) + slot[1] != blockNumber) {
+    return NULL;
+  }
+
+  // The payload stays intact until the slot is reused, which can't happen
+  // before this block has been delivered
+  slot[0] = 0;
+  slot[1] = 0;
+  *length = (slot[2] << 8) + slot[3];
+  return slot + 4;
 }
 
+// TFTP strings and numbers are NUL terminated
 static uint8_t* appendString(uint8_t* ptr, const char* str)  {
-  size_t fileLen = strlen(str) + 1; // Include the null terminator
-  memcpy(ptr, str, fileLen);
-  ptr += fileLen;
+  ptr = appendText(ptr, str);
+  *(ptr++) = 0;
   return ptr;
 }
 
@@ -73,30 +406,381 @@ static uint8_t* appendUint16(uint8_t* ptr, uint16_t val)  {
   return ptr;
 }
 
-void tftpRequestFile(const uint8_t destIP[4], const char* file) {
-  uint8_t txBuffer[100];
-  uint8_t* txPtr = txBuffer;
+static uint8_t* appendNumber(uint8_t* ptr, uint32_t val)  {
+  ptr = appendDecimal(ptr, val);
+  *(ptr++) = 0;
+  return ptr;
+}
 
-  memcpy(tftpServer, destIP, 4);
+// Option names are case insensitive
+static bool optionIs(const char* name, const char* option) {
+  while (*option) {
+    if ((*(name++) | 0x20) != *(option++)) {
+      return false;
+    }
+  }
+  return *name == 0;
+}
+
+// A whole window has to fit in the socket's RX buffer, behind the last block
+// of the previous one, which is still there when its ACK goes out
+static uint16_t tftpMaxWindowSize(void) {
+  uint16_t blocks = netRxBufferSize(NET_SOCKET_TFTP) / (TFTP_MAX_BLKSIZE + TFTP_BLOCK_OVERHEAD);
+  return blocks > 1 ? blocks - 1 : 1;
+}
+
+static void tftpSendRequest(bool withOptions) {
+  // Opcode, file name (maybe with ".rows"), mode and options
+  uint8_t txBuffer[2 + sizeof(netConfig.tftpFile) + 5 + 128];
+  uint8_t* txPtr = txBuffer;
 
   // Start with opcode
   txPtr = appendUint16(txPtr, TFTP_OPCODE_RRQ);
 
   // File name
-  txPtr = appendString(txPtr, file);
+  txPtr = appendString(txPtr, tftpFile);
 
   // Mode
   txPtr = appendString(txPtr, "octet");
 
+  // Options, the server answers with an OACK if it supports them
+  optionsRequested = withOptions;
+  if (withOptions) {
+    txPtr = appendString(txPtr, "blksize");
+#if TFTP_MULTICAST
+    txPtr = appendNumber(txPtr, multicastAllowed ? TFTP_MCAST_BLKSIZE : TFTP_MAX_BLKSIZE);
+    if (multicastAllowed) {
+      // Empty value, the server picks the group
+      txPtr = appendString(txPtr, "multicast");
+      txPtr = appendString(txPtr, "");
+    }
+#else
+    txPtr = appendNumber(txPtr, TFTP_MAX_BLKSIZE);
+#endif
+    txPtr = appendString(txPtr, "windowsize");
+    txPtr = appendNumber(txPtr, tftpMaxWindowSize());
+    // Ask the server for the image size
+    txPtr = appendString(txPtr, "tsize");
+    txPtr = appendNumber(txPtr, 0);
+#if FLASH_JOURNAL
+    // And what's in it, so a journal is only resumed for the same content
+    txPtr = appendString(txPtr, "crc32");
+    txPtr = appendNumber(txPtr, 0);
+#endif
+#if TFTP_RANGES
+    if (requestOffset) {
+      txPtr = appendString(txPtr, "offset");
+      txPtr = appendNumber(txPtr, requestOffset);
+    }
+    if (requestLength) {
+      txPtr = appendString(txPtr, "length");
+      txPtr = appendNumber(txPtr, requestLength);
+    }
+#endif
+  }
+
+  // Until an OACK says otherwise
+  blockSize = TFTP_DEFAULT_BLKSIZE;
+  windowSize = 1;
+  blocksInWindow = 0;
+  gapAcked = false;
+  transferSize = 0;
+#if TFTP_RANGES
+  imageOffset = 0;
+  imageLength = 0;
+#endif
+#if FLASH_JOURNAL
+  imageCrc[0] = 0;
+#endif
+  tftpPoolInit();
+#if TFTP_MULTICAST
+  multicastOffered = false;
+#endif
+
+  netBeginPacket(NET_SOCKET_TFTP, tftpServer, TFTP_PORT);
+  netWrite(NET_SOCKET_TFTP, txBuffer, txPtr - txBuffer);
+  netEndPacket(NET_SOCKET_TFTP);
+}
+
+// Send the request for tftpFile and wait for its first block
+static void tftpStartTransfer(void) {
+  nextBlockNumber = 1;
+  ackedBlock = 0;
+  serverPort = 0;
+  retries = 0;
+  retransmitEnabled = true;
+  tftpSendRequest(true);
+  tftpTimerStart(false);
+}
+
+// Fetch the image itself, from the start or from where the journal says an
+// earlier attempt got to
+static void tftpRequestImage(void) {
+#if TFTP_ROWS
+  rowsPhase = ROWS_OFF;
+  tftpFile = imageFile;
+#endif
+#if TFTP_ROWS || TFTP_STRIPES || TFTP_SELECT
+  // Ranges may have been written already
+  flash_init();
+#endif
+#if TFTP_SELECT
+  failoverOffset = 0;
+#endif
+#if TFTP_RANGES
+  requestOffset = 0;
+  requestLength = 0;
+#endif
+#if TFTP_MULTICAST
+  multicastAllowed = tftpMulticastFits(TFTP_MCAST_BLKSIZE);
+#endif
+
+#if FLASH_JOURNAL
+  resumeOffset = flash_journal_check(imageId, &resumeSize);
+  if (*flash_journal_tag() == 0) {
+    // The server never said what it sent, so there's nothing to confirm
+    resumeOffset = 0;
+  }
+  if (resumeOffset) {
+    LOG_STR("TFTP resume at ");
+    LOG_HEX(resumeOffset);
+    LOG_STR("\r\n");
+    requestOffset = resumeOffset;
+#if TFTP_MULTICAST
+    // Only worth it for the whole image
+    multicastAllowed = false;
+#endif
+  }
+#endif
+
+  tftpStartTransfer();
+}
+
+#if TFTP_ROWS
+static void tftpRequestManifest(void) {
+  size_t len = strlen(imageFile);
+  memcpy(rowsFile, imageFile, len);
+  memcpy(rowsFile + len, ".rows", 6);
+  tftpFile = rowsFile;
+
+  rowsPhase = ROWS_MANIFEST;
+  rowsValid = false;
+  rowsWords = 0;
+  rowsWord = 0;
+  rowsWordFill = 0;
+  rowsChunks = 0;
+  rowsChanged = 0;
+  rowsStalePort = 0;
+  memset(rowsDiff, 0, sizeof(rowsDiff));
+
+  requestOffset = 0;
+  requestLength = 0;
+#if TFTP_MULTICAST
+  // The manifest is compared with our own flash, so it's only for us
+  multicastAllowed = false;
+#endif
+
+  tftpStartTransfer();
+}
+#endif
+
+// First request of the transfer, to tftpServer
+static void tftpBegin(void) {
+#if TFTP_ROWS
+  // Find out what changed first
+  tftpRequestManifest();
+#else
+  tftpRequestImage();
+#endif
+}
+
+#if TFTP_SELECT
+static void tftpProbeSend(void) {
+  uint8_t txBuffer[2 + sizeof(netConfig.tftpFile) + 16];
+  uint8_t* txPtr = txBuffer;
+
+  txPtr = appendUint16(txPtr, TFTP_OPCODE_RRQ);
+  txPtr = appendString(txPtr, tftpFile);
+  txPtr = appendString(txPtr, "octet");
+  txPtr = appendString(txPtr, "tsize");
+  txPtr = appendNumber(txPtr, 0);
+
+  for (uint8_t i = 0; i < candidateCount; i++) {
+    if (candidatesFailed & (1 << i)) {
+      continue;
+    }
+    netBeginPacket(NET_SOCKET_TFTP + i, candidates[i], TFTP_PORT);
+    netWrite(NET_SOCKET_TFTP + i, txBuffer, txPtr - txBuffer);
+    netEndPacket(NET_SOCKET_TFTP + i);
+  }
+  probeStart = millis();
+}
+
+static void tftpAddCandidate(const uint8_t addr[4]) {
+  if (candidateCount == NET_MAX_TFTP_SERVERS || (addr[0] | addr[1] | addr[2] | addr[3]) == 0) {
+    return;
+  }
+  for (uint8_t i = 0; i < candidateCount; i++) {
+    if (memcmp(candidates[i], addr, 4) == 0) {
+      return;
+    }
+  }
+  memcpy(candidates[candidateCount++], addr, 4);
+}
+
+// Probe every server DHCP named, returns false if there is only one
+static bool tftpProbeStart(void) {
+  candidateCount = 0;
+  candidatesFailed = 0;
+  currentCandidate = 0;
+  failoverOffset = 0;
+  failovers = 0;
+  tftpAddCandidate(tftpServer);
+  for (uint8_t i = 0; i < netConfig.tftpServerCount; i++) {
+    tftpAddCandidate(netConfig.tftpServers[i]);
+  }
+  if (candidateCount < 2) {
+    return false;
+  }
+
+  LOG_STR("TFTP probing ");
+  LOG_HEX_BYTE(candidateCount);
+  LOG_STR(" servers\r\n");
+
+  for (uint8_t i = 1; i < candidateCount; i++) {
+    netOpenUdpSocket(NET_SOCKET_TFTP + i, TFTP_PROBE_PORT + i);
+  }
+  probing = true;
+  probeRetries = 0;
+  probeRto = TFTP_INITIAL_RTO;
+  tftpProbeSend();
+  return true;
+}
+
+// Go with candidate winner, the others follow it in their original order
+static void tftpProbeDone(uint8_t winner) {
+  uint8_t chosen[4];
+  memcpy(chosen, candidates[winner], 4);
+  memmove(candidates[1], candidates[0], winner * 4);
+  memcpy(candidates[0], chosen, 4);
+
+  for (uint8_t i = 1; i < candidateCount; i++) {
+    netCloseSocket(NET_SOCKET_TFTP + i);
+  }
+  probing = false;
+
+  LOG_STR("TFTP server: ");
+  LOG_HEX_BYTE(chosen[0]);
+  LOG_HEX_BYTE(chosen[1]);
+  LOG_HEX_BYTE(chosen[2]);
+  LOG_HEX_BYTE(chosen[3]);
+  LOG_STR("\r\n");
+
+  memcpy(tftpServer, chosen, 4);
+  tftpBegin();
+}
+
+static bool tftpProbeRun(void) {
+  for (uint8_t i = 0; i < candidateCount; i++) {
+    uint8_t socket = NET_SOCKET_TFTP + i;
+    uint8_t head[4];
+    uint8_t fromAddr[4];
+    uint16_t fromPort;
+
+    uint16_t bufferLen = netPeekPacket(socket, head, sizeof(head), fromAddr, &fromPort);
+    if (bufferLen == 0) {
+      continue;
+    }
+    netConsumePacket(socket);
+
+    if (bufferLen < sizeof(head) || memcmp(fromAddr, candidates[i], 4) != 0) {
+      continue;
+    }
+
+    uint16_t opcode = (head[0] << 8) + head[1];
+    if (opcode == TFTP_OPCODE_ERROR) {
+      // No such file there, or no room for us
+      candidatesFailed |= 1 << i;
+      continue;
+    }
+
+    // An OACK, or DATA from a server without options. Either way it's alive,
+    // and this request was only a probe.
+    uint8_t txBuffer[5];
+    uint8_t* txPtr = appendUint16(txBuffer, TFTP_OPCODE_ERROR);
+    txPtr = appendUint16(txPtr, TFTP_ERROR_OPTIONS);
+    *(txPtr++) = 0;
+    netBeginPacket(socket, fromAddr, fromPort);
+    netWrite(socket, txBuffer, txPtr - txBuffer);
+    netEndPacket(socket);
+    while (netSendStatus(socket) == NET_SEND_BUSY);
+    tftpProbeDone(i);
+    return true;
+  }
+
+  if (candidatesFailed == (1 << candidateCount) - 1) {
+    // Let the primary report the error
+    tftpProbeDone(0);
+  } else if (millis() - probeStart > probeRto) {
+    if (++probeRetries > TFTP_MAX_RETRIES) {
+      tftpProbeDone(0);
+    } else {
+      probeRto = (probeRto * 2 > TFTP_MAX_RTO) ? TFTP_MAX_RTO : probeRto * 2;
+      tftpProbeSend();
+    }
+  }
+  return false;
+}
+#endif
+
+void tftpRequestFile(const uint8_t destIP[4], const char* file) {
+  memcpy(tftpServer, destIP, 4);
+  tftpFile = file;
+
   // Reset nextBlockNumber
   nextBlockNumber = 1;
+  ackedBlock = 0;
+  serverPort = 0;
 
   // Reset flashing
   flash_init();
 
-  netBeginPacketSocket3(destIP, TFTP_PORT);
-  netWriteSocket3(txBuffer, txPtr - txBuffer);
-  netEndPacketSocket3();
+  // Nothing known about the path yet
+  rttValid = false;
+  rto = TFTP_INITIAL_RTO;
+  retries = 0;
+  retransmitEnabled = true;
+  retransmitsAvoided = 0;
+
+#if TFTP_MULTICAST
+  multicastAllowed = tftpMulticastFits(TFTP_MCAST_BLKSIZE);
+  multicast = false;
+  masterClient = false;
+  lastBlockNumber = 0;
+  memset(blockMap, 0, sizeof(blockMap));
+#endif
+
+#if TFTP_STRIPES
+  stripeCount = 0;
+  stripesAllowed = true;
+#endif
+
+#if FLASH_JOURNAL
+  imageId = crc16(file, strlen(file), 0xFFFF);
+#endif
+
+#if TFTP_ROWS
+  imageFile = file;
+#endif
+
+#if TFTP_SELECT
+  if (tftpProbeStart()) {
+    // tftpBegin() once a server answers
+    return;
+  }
+#endif
+
+  tftpBegin();
 }
 
 static void tftpSendACK(uint16_t blockNum) {
@@ -109,7 +793,7 @@ static void tftpSendACK(uint16_t blockNum) {
   // Block number to ACK
   txPtr = appendUint16(txPtr, blockNum);
 
-  netWriteSocket3(txBuffer, txPtr - txBuffer);
+  netWrite(NET_SOCKET_TFTP, txBuffer, txPtr - txBuffer);
 }
 
 static void tftpSendERROR(uint16_t code) {
@@ -125,89 +809,1338 @@ static void tftpSendERROR(uint16_t code) {
   // No message string, but we still need the terminator
   *(txPtr++) = 0;
 
-  netWriteSocket3(txBuffer, txPtr - txBuffer);
+  netWrite(NET_SOCKET_TFTP, txBuffer, txPtr - txBuffer);
+}
+
+#if TFTP_MULTICAST
+// "addr,port,mc". Address and port may be left empty in the OACKs that only
+// change who the master client is.
+static void tftpParseMulticast(const char* value) {
+  if (*value != ',') {
+    for (uint8_t i = 0; i < 4; i++) {
+      mcastGroup[i] = parseNumber(value);
+      while (*value >= '0' && *value <= '9') {
+        value++;
+      }
+      if (*value == '.') {
+        value++;
+      }
+    }
+  }
+
+  value = strchr(value, ',');
+  if (!value) {
+    return;
+  }
+  if (*(++value) != ',') {
+    mcastPort = parseNumber(value);
+  }
+
+  value = strchr(value, ',');
+  if (!value) {
+    return;
+  }
+  masterClient = (parseNumber(value + 1) == 1);
+  multicastOffered = true;
+}
+#endif
+
+// Apply the options of an OACK. Unknown options are ignored, and anything
+// the server didn't echo keeps its RFC 1350 default.
+static void tftpParseOptions(const char* options, uint16_t len) {
+  const char* end = options + len;
+
+  while (options < end) {
+    const char* name = options;
+    const char* value = name + strlen(name) + 1;
+    if (value >= end) {
+      break;
+    }
+    options = value + strlen(value) + 1;
+
+    if (optionIs(name, "blksize")) {
+      uint32_t size = parseNumber(value);
+      // The server may only lower what we asked for
+      if (size >= 8 && size <= TFTP_MAX_BLKSIZE) {
+        blockSize = size;
+      }
+    } else if (optionIs(name, "tsize")) {
+      transferSize = parseNumber(value);
+#if FLASH_JOURNAL
+    } else if (optionIs(name, "crc32")) {
+      if (strlen(value) < sizeof(imageCrc)) {
+        strcpy(imageCrc, value);
+      }
+#endif
+#if TFTP_MULTICAST
+    } else if (optionIs(name, "multicast")) {
+      tftpParseMulticast(value);
+#endif
+#if TFTP_RANGES
+    } else if (optionIs(name, "offset")) {
+      imageOffset = parseNumber(value);
+    } else if (optionIs(name, "length")) {
+      imageLength = parseNumber(value);
+#endif
+    } else if (optionIs(name, "windowsize")) {
+      uint32_t window = parseNumber(value);
+      if (window >= 1 && window <= tftpMaxWindowSize()) {
+        windowSize = window;
+      }
+    }
+  }
+}
+
+// Copy a block's payload into the flash row accumulator, either straight
+// from the socket or from the reorder pool. The caller has already checked
+// that it fits with flash_buffer_fits().
+static void tftpStoreData(uint16_t length, const uint8_t* pooled) {
+  while (length > 0) {
+    uint32_t space;
+    uint8_t* dest = flash_buffer_get(&space);
+    if (space > length) {
+      space = length;
+    }
+
+    if (pooled) {
+      memcpy(dest, pooled, space);
+      pooled += space;
+    } else {
+      // The last row completed is programmed while the DMAC fetches the
+      // next bytes
+      netReadPacketBegin(rxSocket, dest, space);
+      flash_program_pending();
+      netReadPacketEnd();
+    }
+    length -= space;
+
+    flash_buffer_commit_deferred(space);
+  }
+}
+
+#if TFTP_ROWS
+// The last chunk only covers the image, rounded up to whole rows
+static uint32_t tftpRowsChunkLength(uint32_t chunk) {
+  uint32_t left = rowsImageSize - chunk * rowsChunkSize;
+  if (left >= rowsChunkSize) {
+    return rowsChunkSize;
+  }
+  return (left + flash_row_size() - 1) / flash_row_size() * flash_row_size();
+}
+
+static void tftpRowsWord(uint32_t word) {
+  uint32_t index = rowsWords++;
+
+  if (index == 0) {
+    rowsValid = (word == TFTP_ROWS_MAGIC);
+  } else if (index == 1) {
+    rowsChunkSize = word;
+    rowsValid = rowsValid && word && (word % flash_row_size()) == 0;
+  } else if (index == 2) {
+    rowsImageSize = word;
+    rowsValid = rowsValid && word && word <= flash_capacity() &&
+                (word + rowsChunkSize - 1) / rowsChunkSize <= TFTP_ROWS_MAX_CHUNKS;
+    if (rowsValid) {
+      rowsChunks = (word + rowsChunkSize - 1) / rowsChunkSize;
+    }
+  } else if (rowsValid) {
+    uint32_t chunk = index - TFTP_ROWS_HEADER;
+    if (chunk >= rowsChunks) {
+      rowsValid = false;
+    } else if (flash_crc32(chunk * rowsChunkSize, tftpRowsChunkLength(chunk)) != word) {
+      rowsDiff[chunk / 8] |= 1 << (chunk % 8);
+      rowsChanged++;
+    }
+  }
+}
+
+// Parse manifest data, straight from the socket or from the reorder pool
+static void tftpRowsData(uint16_t length, const uint8_t* pooled) {
+  uint8_t buffer[32];
+
+  while (length > 0) {
+    uint16_t chunk = length > sizeof(buffer) ? sizeof(buffer) : length;
+    if (pooled) {
+      memcpy(buffer, pooled, chunk);
+      pooled += chunk;
+    } else {
+      netReadPacket(rxSocket, buffer, chunk);
+    }
+    length -= chunk;
+
+    for (uint16_t i = 0; i < chunk; i++) {
+      rowsWord |= (uint32_t) buffer[i] << (8 * rowsWordFill);
+      if (++rowsWordFill == 4) {
+        tftpRowsWord(rowsWord);
+        rowsWord = 0;
+        rowsWordFill = 0;
+      }
+    }
+  }
+}
+
+// Request the next run of changed chunks, returns false when there are none
+static bool tftpRowsNextRange(void) {
+  while (rowsNext < rowsChunks && !(rowsDiff[rowsNext / 8] & (1 << (rowsNext % 8)))) {
+    rowsNext++;
+  }
+  if (rowsNext == rowsChunks) {
+    return false;
+  }
+
+  uint32_t start = (uint32_t) rowsNext * rowsChunkSize;
+  while (rowsNext < rowsChunks && (rowsDiff[rowsNext / 8] & (1 << (rowsNext % 8)))) {
+    rowsNext++;
+  }
+  uint32_t end = (uint32_t) rowsNext * rowsChunkSize;
+  if (end > rowsImageSize) {
+    end = rowsImageSize;
+  }
+
+  if (!flash_seek(start)) {
+    // Can't write there, so don't trust the ranges either
+    tftpRequestImage();
+    return true;
+  }
+
+  LOG_STR("TFTP range: ");
+  LOG_HEX(start);
+  LOG_STR(" ");
+  LOG_HEX(end - start);
+  LOG_STR("\r\n");
+
+  requestOffset = start;
+  requestLength = end - start;
+  tftpStartTransfer();
+  return true;
+}
+
+// The manifest or a range is complete
+static void tftpRowsDone(void) {
+  rowsStalePort = serverPort;
+
+  if (rowsPhase == ROWS_MANIFEST) {
+    if (!rowsValid || rowsWordFill != 0 || rowsWords != TFTP_ROWS_HEADER + (uint32_t) rowsChunks ||
+        !flash_plan(rowsImageSize)) {
+      LOG("TFTP: bad manifest");
+      tftpRequestImage();
+      return;
+    }
+
+    LOG_STR("TFTP changed chunks: ");
+    LOG_HEX(rowsChanged);
+    LOG_STR("/");
+    LOG_HEX(rowsChunks);
+    LOG_STR("\r\n");
+    rowsPhase = ROWS_RANGES;
+    rowsNext = 0;
+  } else {
+    // Pads the row at the end of the image, ranges end on whole rows otherwise
+    flash_finish();
+  }
+
+  if (tftpRowsNextRange()) {
+    return;
+  }
+
+  // Make sure the final ACK has left before the W5500 is abandoned
+  while (netSendStatus(NET_SOCKET_TFTP) == NET_SEND_BUSY);
+
+  LOG("TFTP DONE");
+  startApplication();
+}
+#endif
+
+// Hand the next block in order to the flash layer
+static void tftpDeliver(uint16_t blockNumber, uint16_t length, const uint8_t* pooled) {
+  LOG_STR("TFTP DATA: ");
+  LOG_HEX(blockNumber);
+  LOG_STR(" ");
+  LOG_HEX(length);
+  if (transferSize) {
+    LOG_STR(" ");
+#if TFTP_RANGES
+    LOG_HEX(imageOffset + (uint32_t)(blockNumber - 1) * blockSize + length);
+#else
+    LOG_HEX((uint32_t)(blockNumber - 1) * blockSize + length);
+#endif
+    LOG_STR("/");
+    LOG_HEX(transferSize);
+  }
+  LOG_STR("\r\n");
+
+  // A smaller than negotiated payload means we're done with the transfer
+  bool lastBlock = length < blockSize;
+
+#if TFTP_ROWS
+  // The manifest isn't flashed
+  bool toFlash = (rowsPhase != ROWS_MANIFEST);
+#else
+  bool toFlash = true;
+#endif
+
+  if (toFlash && !flash_buffer_fits(length)) {
+    // No room for the image, so let's call that 'disk full'
+    netBeginPacket(NET_SOCKET_TFTP, tftpServer, serverPort);
+    tftpSendERROR(TFTP_ERROR_DISK_FULL);
+    netEndPacket(NET_SOCKET_TFTP);
+    retransmitEnabled = false;
+    return;
+  }
+
+  // Only a block that fits counts as delivered
+  nextBlockNumber = blockNumber + 1;
+  gapAcked = false;
+  tftpTimerProgress();
+
+  // Only the last block of each window is ACKed (RFC 7440). The ACK goes out
+  // first and completes in the background while this block is programmed,
+  // so the server can already be sending the next window.
+  if (++blocksInWindow >= windowSize || lastBlock) {
+    blocksInWindow = 0;
+    netBeginPacket(NET_SOCKET_TFTP, tftpServer, serverPort);
+    tftpSendACK(blockNumber);
+    netEndPacket(NET_SOCKET_TFTP);
+    ackedBlock = blockNumber;
+    tftpTimerStart(false);
+  }
+
+  // Write to flash
+  if (toFlash) {
+    tftpStoreData(length, pooled);
+  }
+#if TFTP_ROWS
+  else {
+    tftpRowsData(length, pooled);
+  }
+#endif
+
+  if (lastBlock) {
+#if TFTP_ROWS
+    if (rowsPhase != ROWS_OFF) {
+      tftpRowsDone();
+      return;
+    }
+#endif
+    flash_finish();
+
+    // Make sure the final ACK has left before the W5500 is abandoned
+    while (netSendStatus(NET_SOCKET_TFTP) == NET_SEND_BUSY);
+
+    LOG_STR("TFTP DONE, reordered blocks: ");
+    LOG_HEX(retransmitsAvoided);
+    LOG_STR("\r\n");
+    startApplication();
+  }
+}
+
+#if TFTP_MULTICAST
+static bool tftpHaveBlock(uint16_t blockNumber) {
+  return blockMap[(blockNumber - 1) / 8] & (1 << ((blockNumber - 1) % 8));
+}
+
+// ACK the block before the first one still missing, which is what the
+// server sends next
+static void tftpMulticastACK(void) {
+  netBeginPacket(NET_SOCKET_TFTP, tftpServer, serverPort);
+  tftpSendACK(nextBlockNumber - 1);
+  netEndPacket(NET_SOCKET_TFTP);
+  tftpTimerStart(false);
+}
+
+// Switch to the group the server offered, returns false if the offer can't
+// be used
+static bool tftpMulticastStart(void) {
+  if ((blockSize % flash_row_size()) != 0 || !tftpMulticastFits(blockSize) ||
+      (transferSize && transferSize / blockSize + 1 > TFTP_MCAST_MAX_BLOCKS)) {
+    return false;
+  }
+
+  if (transferSize) {
+    lastBlockNumber = transferSize / blockSize + 1;
+  }
+
+  netOpenMulticastSocket(NET_SOCKET_TFTP_MCAST, mcastGroup, mcastPort);
+  multicast = true;
+  LOG_STR("TFTP multicast, master: ");
+  LOG_HEX_BYTE(masterClient);
+  LOG_STR("\r\n");
+  return true;
+}
+
+// Multicast blocks come in any order, from the group or unicast when the
+// server fills in gaps for us, and late joiners start somewhere in the
+// middle. Every new block is programmed at its own offset, and the master
+// client asks for the first block still missing.
+static void tftpMulticastData(uint16_t blockNumber, uint16_t length) {
+  if (blockNumber == 0 || blockNumber > TFTP_MCAST_MAX_BLOCKS || length > blockSize ||
+      (lastBlockNumber && blockNumber > lastBlockNumber) || tftpHaveBlock(blockNumber)) {
+    return;
+  }
+
+  LOG_STR("TFTP MDATA: ");
+  LOG_HEX(blockNumber);
+  LOG_STR(" ");
+  LOG_HEX(length);
+  LOG_STR("\r\n");
+
+  if (!flash_seek((uint32_t)(blockNumber - 1) * blockSize) || !flash_buffer_fits(length)) {
+    netBeginPacket(NET_SOCKET_TFTP, tftpServer, serverPort);
+    tftpSendERROR(TFTP_ERROR_DISK_FULL);
+    netEndPacket(NET_SOCKET_TFTP);
+    retransmitEnabled = false;
+    return;
+  }
+
+  if (length < blockSize) {
+    lastBlockNumber = blockNumber;
+  }
+
+  blockMap[(blockNumber - 1) / 8] |= 1 << ((blockNumber - 1) % 8);
+  while (nextBlockNumber <= TFTP_MCAST_MAX_BLOCKS && tftpHaveBlock(nextBlockNumber)) {
+    nextBlockNumber++;
+  }
+  tftpTimerProgress();
+
+  // As with unicast, ACK before programming
+  if (masterClient) {
+    tftpMulticastACK();
+  }
+
+  tftpStoreData(length, NULL);
+  if (length < blockSize) {
+    // Pad out the final row
+    flash_finish();
+  }
+
+  if (lastBlockNumber && nextBlockNumber > lastBlockNumber) {
+    // Make sure the final ACK has left before the W5500 is abandoned
+    while (netSendStatus(NET_SOCKET_TFTP) == NET_SEND_BUSY);
+
+    LOG("TFTP DONE");
+    startApplication();
+  }
+}
+#endif
+
+#if FLASH_JOURNAL
+// Set up the journal once the OACK is in. Returns false if the server
+// answered the offset with something other than the image in the journal.
+static bool tftpJournalStart(void) {
+#if TFTP_SELECT
+  if (failoverOffset) {
+    // Carrying on with the journal the first server started
+    return true;
+  }
+#endif
+#if TFTP_ROWS
+  if (rowsPhase != ROWS_OFF) {
+    // Manifest and ranges are small, and the manifest finds what's done
+    return true;
+  }
+#endif
+#if TFTP_MULTICAST
+  if (multicast) {
+    // Blocks arrive out of order, nothing to journal
+    return true;
+  }
+#endif
+
+  if (imageOffset == 0) {
+    // A full transfer, which can only be journaled if its size is known
+    if (transferSize) {
+      flash_journal_start(imageId, transferSize, imageCrc);
+    }
+    return true;
+  }
+
+  // The same name and size isn't enough, the content has to match too
+  if (imageOffset != resumeOffset || transferSize != resumeSize ||
+      imageCrc[0] == 0 || strcmp(imageCrc, flash_journal_tag()) != 0) {
+    return false;
+  }
+  return flash_journal_resume(imageOffset);
+}
+#endif
+
+#if TFTP_STRIPES
+// The stripe sockets don't all get the same RX buffer, so each asks for the
+// largest block of which its own holds two. The ACK goes out before the
+// block is read, and the next one has to fit behind it.
+static uint16_t tftpStripeBlockSize(uint8_t socket) {
+  uint16_t size = netRxBufferSize(socket) / 2 - TFTP_BLOCK_OVERHEAD;
+  return (size < TFTP_MAX_BLKSIZE) ? size : TFTP_MAX_BLKSIZE;
+}
+
+static uint16_t tftpStripeMaxWindow(uint8_t socket) {
+  // Leaves room for the block the ACK goes out on, as tftpMaxWindowSize()
+  uint16_t blocks = netRxBufferSize(socket) / (tftpStripeBlockSize(socket) + TFTP_BLOCK_OVERHEAD);
+  return blocks > 1 ? blocks - 1 : 1;
+}
+
+static void tftpStripeRequest(uint8_t i) {
+  tftpStripe_t* stripe = &stripes[i];
+  uint8_t socket = NET_SOCKET_TFTP + i;
+  uint8_t txBuffer[2 + sizeof(netConfig.tftpFile) + 96];
+  uint8_t* txPtr = txBuffer;
+
+  txPtr = appendUint16(txPtr, TFTP_OPCODE_RRQ);
+  txPtr = appendString(txPtr, tftpFile);
+  txPtr = appendString(txPtr, "octet");
+  txPtr = appendString(txPtr, "blksize");
+  txPtr = appendNumber(txPtr, tftpStripeBlockSize(socket));
+  txPtr = appendString(txPtr, "windowsize");
+  txPtr = appendNumber(txPtr, tftpStripeMaxWindow(socket));
+  // Sent even when 0, the echo is how we know the server does ranges
+  txPtr = appendString(txPtr, "offset");
+  txPtr = appendNumber(txPtr, stripe->offset);
+  txPtr = appendString(txPtr, "length");
+  txPtr = appendNumber(txPtr, stripe->requestEnd - stripe->offset);
+
+  netBeginPacket(socket, stripe->server, TFTP_PORT);
+  netWrite(socket, txBuffer, txPtr - txBuffer);
+  netEndPacket(socket);
+  stripe->timerStart = millis();
+}
+
+static void tftpStripeSend(uint8_t i, uint16_t opcode, uint16_t value) {
+  uint8_t txBuffer[5];
+  uint8_t* txPtr = txBuffer;
+  uint8_t socket = NET_SOCKET_TFTP + i;
+
+  txPtr = appendUint16(txPtr, opcode);
+  txPtr = appendUint16(txPtr, value);
+  if (opcode == TFTP_OPCODE_ERROR) {
+    *(txPtr++) = 0;
+  }
+
+  netBeginPacket(socket, stripes[i].server, stripes[i].port);
+  netWrite(socket, txBuffer, txPtr - txBuffer);
+  netEndPacket(socket);
+  stripes[i].timerStart = millis();
+}
+
+// Ask stripe i's server for the image bytes from offset to end
+static void tftpStripeAssign(uint8_t i, uint32_t offset, uint32_t end) {
+  tftpStripe_t* stripe = &stripes[i];
+
+  stripe->previousPort = stripe->port;
+  stripe->port = 0;
+  stripe->offset = offset;
+  stripe->end = end;
+  stripe->requestEnd = end;
+  stripe->requestStart = offset;
+  stripe->requestTime = millis();
+  stripe->nextBlock = 1;
+  stripe->blockSize = TFTP_DEFAULT_BLKSIZE;
+  stripe->window = 1;
+  stripe->blocksInWindow = 0;
+  stripe->gapAcked = false;
+  stripe->done = false;
+  stripe->retries = 0;
+  stripe->rto = TFTP_INITIAL_RTO;
+  stripe->timerPostponed = 0;
+  stripe->rowFill = 0;
+  tftpStripeRequest(i);
+}
+
+// Split the image across the servers DHCP gave us. Returns false if there
+// aren't enough of them, or enough image, to be worth it.
+static bool tftpStripesStart(void) {
+  uint32_t rowSize = flash_row_size();
+  uint32_t rows = (transferSize + rowSize - 1) / rowSize;
+  uint8_t count = netConfig.tftpServerCount;
+
+  if (!stripesAllowed || imageOffset || rowSize > sizeof(stripes[0].row)) {
+    return false;
+  }
+#if TFTP_ROWS
+  if (rowsPhase != ROWS_OFF) {
+    return false;
+  }
+#endif
+#if TFTP_MULTICAST
+  if (multicast) {
+    return false;
+  }
+#endif
+  if (count > rows / TFTP_STRIPE_MIN_ROWS) {
+    count = rows / TFTP_STRIPE_MIN_ROWS;
+  }
+  for (uint8_t i = 1; i < count; i++) {
+    // Stop at the first socket without room for two default sized blocks
+    if (netRxBufferSize(NET_SOCKET_TFTP + i) < 2 * (TFTP_DEFAULT_BLKSIZE + TFTP_BLOCK_OVERHEAD)) {
+      count = i;
+    }
+  }
+  if (count < 2) {
+    return false;
+  }
+
+  LOG_STR("TFTP stripes: ");
+  LOG_HEX_BYTE(count);
+  LOG_STR("\r\n");
+
+  // The equal shares are only a start: faster servers take over the tails
+  // of the slower ones as they finish
+  uint32_t offset = 0;
+  stripeCount = count;
+  for (uint8_t i = 0; i < count; i++) {
+    tftpStripe_t* stripe = &stripes[i];
+    // Earlier stripes take the odd rows
+    uint32_t stripeRows = rows / count + (i < rows % count ? 1 : 0);
+    uint32_t end = offset + stripeRows * rowSize;
+
+    memcpy(stripe->server, netConfig.tftpServers[i], 4);
+    stripe->port = 0;
+    stripe->abandoned = false;
+    if (i > 0) {
+      netOpenUdpSocket(NET_SOCKET_TFTP + i, TFTP_STRIPE_PORT + i);
+    }
+    tftpStripeAssign(i, offset, (end > transferSize) ? transferSize : end);
+    offset = end;
+  }
+  stripesFailed = false;
+  return true;
+}
+
+// Something went wrong with a stripe, so fetch the whole image from the
+// primary server instead
+static void tftpStripesAbort(void) {
+  LOG("TFTP stripes failed");
+  for (uint8_t i = 0; i < stripeCount; i++) {
+    if (stripes[i].port && !stripes[i].done) {
+      tftpStripeSend(i, TFTP_OPCODE_ERROR, TFTP_ERROR_OPTIONS);
+    }
+    if (i > 0) {
+      netCloseSocket(NET_SOCKET_TFTP + i);
+    }
+  }
+  stripeCount = 0;
+  stripesAllowed = false;
+  tftpRequestImage();
+}
+
+// Image bytes per millisecond the stripe's server has sent since the request
+static uint32_t tftpStripeRate(tftpStripe_t* stripe) {
+  uint32_t rate = (stripe->offset - stripe->requestStart) / (millis() - stripe->requestTime + 1);
+  return rate ? rate : 1;
+}
+
+// Give stripe i, whose server is done, more work from the stripe expected to
+// finish last: all of it if its server has gone quiet, or if stripe i's
+// server would be done with it before the other finishes its current row,
+// else the rows after that row, shared in proportion to the two servers'
+// rates. Returns false if there is nothing worth taking.
+static bool tftpStripeSteal(uint8_t i) {
+  uint32_t rowSize = flash_row_size();
+  uint32_t rate = tftpStripeRate(&stripes[i]);
+  uint8_t victim = i;
+  bool stalled = false;
+  uint32_t latest = 0;
+
+  for (uint8_t j = 0; j < stripeCount; j++) {
+    tftpStripe_t* stripe = &stripes[j];
+    if (stripe->done) {
+      continue;
+    }
+    // A server that is retrying, or hasn't answered in half the time stripe
+    // i's took for all of its share, has gone quiet
+    bool quiet = stripe->retries ||
+                 (!stripe->port && (millis() - stripe->requestTime) * 2 > millis() - stripes[i].requestTime);
+    if (!quiet && stripe->offset == stripe->requestStart) {
+      // No rate to go by yet
+      continue;
+    }
+    uint32_t left = (stripe->end - stripe->offset) / tftpStripeRate(stripe);
+    if (quiet ? !stalled || left > latest : !stalled && left >= latest) {
+      victim = j;
+      stalled = quiet;
+      latest = left;
+    }
+  }
+  if (victim == i) {
+    return false;
+  }
+
+  tftpStripe_t* stripe = &stripes[victim];
+  uint32_t victimRate = tftpStripeRate(stripe);
+  uint32_t end = stripe->end;
+  // The row in progress is lost if the server is dropped
+  uint32_t start = stripe->offset - stripe->rowFill;
+  uint32_t next = start + (stripe->rowFill ? rowSize : 0);
+
+  if (!stalled && (uint64_t) (next - stripe->offset) * rate <= (uint64_t) (end - start) * victimRate) {
+    if (end <= next) {
+      return false;
+    }
+    uint32_t rows = (end - next + rowSize - 1) / rowSize;
+    uint32_t taken = ((uint64_t) rows * rate + (rate + victimRate) / 2) / (rate + victimRate);
+    // Less than a block of it doesn't pay for the request
+    if (taken * rowSize < stripes[i].blockSize) {
+      return false;
+    }
+    start = next + (rows - taken) * rowSize;
+  }
+
+  LOG_STR("TFTP stripe ");
+  LOG_HEX_BYTE(i);
+  LOG_STR(" takes ");
+  LOG_HEX(start);
+  LOG_STR(" from ");
+  LOG_HEX_BYTE(victim);
+  LOG_STR("\r\n");
+
+  stripe->end = start;
+  if (start <= stripe->offset) {
+    if (stripe->port) {
+      tftpStripeSend(victim, TFTP_OPCODE_ERROR, TFTP_ERROR_OPTIONS);
+    }
+    stripe->offset = start;
+    stripe->rowFill = 0;
+    stripe->done = true;
+    stripe->abandoned = true;
+  }
+  tftpStripeAssign(i, start, end);
+  return true;
+}
+
+// Move a block's payload into the stripe's row, programming full rows
+static bool tftpStripeStore(uint8_t i, uint16_t length) {
+  tftpStripe_t* stripe = &stripes[i];
+  uint32_t rowSize = flash_row_size();
+
+  while (length > 0) {
+    uint32_t space = rowSize - stripe->rowFill;
+    if (space > length) {
+      space = length;
+    }
+    // The last row completed, of any stripe, is programmed while the DMAC
+    // fetches the next bytes
+    netReadPacketBegin(NET_SOCKET_TFTP + i, (uint8_t*) stripe->row + stripe->rowFill, space);
+    flash_program_pending();
+    netReadPacketEnd();
+    stripe->rowFill += space;
+    stripe->offset += space;
+    length -= space;
+
+    if (stripe->rowFill == rowSize) {
+      if (!flash_write_row_deferred(stripe->offset - rowSize, stripe->row)) {
+        return false;
+      }
+      stripe->rowFill = 0;
+    }
+  }
+  return true;
+}
+
+static void tftpStripeData(uint8_t i, uint16_t blockNumber, uint16_t length) {
+  tftpStripe_t* stripe = &stripes[i];
+
+  if (blockNumber < stripe->nextBlock) {
+    // Already ACKed or about to be, as in tftpRun()
+    if (blockNumber > stripe->timerPostponed) {
+      stripe->timerPostponed = blockNumber;
+      stripe->timerStart = millis();
+    }
+    return;
+  }
+  if (blockNumber != stripe->nextBlock) {
+    // Same go-back as tftpRun(), without the reorder pool
+    if (!stripe->gapAcked) {
+      stripe->gapAcked = true;
+      tftpStripeSend(i, TFTP_OPCODE_ACK, stripe->nextBlock - 1);
+    }
+    stripe->blocksInWindow = 0;
+    return;
+  }
+
+  bool lastBlock = length < stripe->blockSize;
+  if (length > stripe->requestEnd - stripe->offset ||
+      (lastBlock && stripe->offset + length != stripe->requestEnd)) {
+    // Not the stripe we asked for
+    stripesFailed = true;
+    return;
+  }
+
+  stripe->nextBlock++;
+  stripe->gapAcked = false;
+  stripe->retries = 0;
+  stripe->rto = TFTP_INITIAL_RTO;
+  stripe->timerStart = millis();
+  stripe->timerPostponed = 0;
+  if (++stripe->blocksInWindow >= stripe->window || lastBlock) {
+    stripe->blocksInWindow = 0;
+    tftpStripeSend(i, TFTP_OPCODE_ACK, blockNumber);
+  }
+
+  // Anything past the end now belongs to another server
+  if (length > stripe->end - stripe->offset) {
+    length = stripe->end - stripe->offset;
+  }
+  if (!tftpStripeStore(i, length)) {
+    stripesFailed = true;
+    return;
+  }
+  if (stripe->offset < stripe->end) {
+    return;
+  }
+  if (!lastBlock) {
+    // Stop the server short of the range it was asked for
+    tftpStripeSend(i, TFTP_OPCODE_ERROR, TFTP_ERROR_OPTIONS);
+  }
+
+  if (stripe->rowFill) {
+    // Only the last stripe ends part way through a row
+    memset((uint8_t*) stripe->row + stripe->rowFill, 0xFF, flash_row_size() - stripe->rowFill);
+    flash_write_row(stripe->offset - stripe->rowFill, stripe->row);
+    stripe->rowFill = 0;
+  }
+  stripe->done = true;
+
+  for (uint8_t j = 0; j < stripeCount; j++) {
+    if (!stripes[j].done) {
+      return;
+    }
+  }
+
+  flash_program_pending();
+
+  // Make sure the final ACKs have left before the W5500 is abandoned
+  for (uint8_t j = 0; j < stripeCount; j++) {
+    while (netSendStatus(NET_SOCKET_TFTP + j) == NET_SEND_BUSY);
+  }
+
+  LOG("TFTP DONE");
+  startApplication();
+}
+
+static void tftpStripeOACK(uint8_t i, uint16_t bufferLen, const uint8_t head[4]) {
+  tftpStripe_t* stripe = &stripes[i];
+  char options[TFTP_MAX_OACK];
+  uint16_t optionsLen = bufferLen + 2;
+  if (optionsLen >= sizeof(options)) {
+    // A truncated OACK would be misread, so don't use this server
+    stripesFailed = true;
+    return;
+  }
+  memcpy(options, head + 2, 2);
+  netReadPacket(NET_SOCKET_TFTP + i, (uint8_t*) options + 2, optionsLen - 2);
+  options[optionsLen] = 0;
+
+  // Parsed into the single transfer state, which is idle while striping
+  blockSize = TFTP_DEFAULT_BLKSIZE;
+  windowSize = 1;
+  imageOffset = 0;
+  imageLength = 0;
+  tftpParseOptions(options, optionsLen);
+
+  if (imageOffset != stripe->offset || imageLength != stripe->requestEnd - stripe->offset ||
+      blockSize > tftpStripeBlockSize(NET_SOCKET_TFTP + i)) {
+    stripesFailed = true;
+    return;
+  }
+
+  stripe->blockSize = blockSize;
+  stripe->window = (windowSize < tftpStripeMaxWindow(NET_SOCKET_TFTP + i)) ?
+                   windowSize : tftpStripeMaxWindow(NET_SOCKET_TFTP + i);
+  tftpStripeSend(i, TFTP_OPCODE_ACK, 0);
+}
+
+static void tftpStripesRun(void) {
+  for (uint8_t i = 0; i < stripeCount; i++) {
+    tftpStripe_t* stripe = &stripes[i];
+    uint8_t socket = NET_SOCKET_TFTP + i;
+    uint8_t head[4];
+    uint8_t fromAddr[4];
+    uint16_t fromPort;
+
+    if (stripe->done && !stripe->abandoned && tftpStripeSteal(i)) {
+      continue;
+    }
+
+    uint16_t bufferLen = netPeekPacket(socket, head, sizeof(head), fromAddr, &fromPort);
+    if (bufferLen == 0) {
+      if (!stripe->done && millis() - stripe->timerStart > stripe->rto) {
+        if (++stripe->retries > TFTP_MAX_RETRIES) {
+          tftpStripesAbort();
+          return;
+        }
+        stripe->rto = (stripe->rto * 2 > TFTP_MAX_RTO) ? TFTP_MAX_RTO : stripe->rto * 2;
+        if (stripe->port == 0) {
+          tftpStripeRequest(i);
+        } else {
+          tftpStripeSend(i, TFTP_OPCODE_ACK, stripe->nextBlock - 1);
+          stripe->blocksInWindow = 0;
+        }
+        stripe->timerPostponed = 0;
+      }
+      continue;
+    }
+
+    if (stripe->done || bufferLen < sizeof(head) || memcmp(fromAddr, stripe->server, 4) != 0 ||
+        (stripe->port ? fromPort != stripe->port : fromPort == stripe->previousPort)) {
+      netConsumePacket(socket);
+      continue;
+    }
+    bufferLen -= sizeof(head);
+
+    uint16_t opcode = (head[0] << 8) + head[1];
+    if (opcode == TFTP_OPCODE_OACK && stripe->port == 0) {
+      stripe->port = fromPort;
+      tftpStripeOACK(i, bufferLen, head);
+    } else if (opcode == TFTP_OPCODE_DATA && stripe->port) {
+      tftpStripeData(i, (head[2] << 8) + head[3], bufferLen);
+    } else if (opcode == TFTP_OPCODE_DATA || opcode == TFTP_OPCODE_ERROR) {
+      // DATA without an OACK means the server ignored the range
+      stripesFailed = true;
+    }
+    netConsumePacket(socket);
+
+    if (stripesFailed) {
+      tftpStripesAbort();
+      return;
+    }
+  }
+}
+#endif
+
+#if TFTP_SELECT
+// Continue the transfer from the next candidate, at the byte the current
+// one got to. Returns false if there is nothing to fail over to.
+static bool tftpFailover(void) {
+  if (candidateCount < 2 || failovers >= 2 * candidateCount) {
+    return false;
+  }
+#if TFTP_ROWS
+  if (rowsPhase != ROWS_OFF) {
+    return false;
+  }
+#endif
+#if TFTP_MULTICAST
+  if (multicast) {
+    return false;
+  }
+#endif
+
+  uint32_t offset = failoverOffset;
+  if (offset == 0) {
+    offset = imageOffset + (uint32_t)(nextBlockNumber - 1) * blockSize;
+    failoverSize = transferSize;
+  }
+
+  failovers++;
+  currentCandidate = (currentCandidate + 1) % candidateCount;
+  memcpy(tftpServer, candidates[currentCandidate], 4);
+
+  // The backed off RTO was for the server that went away
+  rto = rttValid ? srtt + 4 * rttvar : TFTP_INITIAL_RTO;
+  if (rto < TFTP_MIN_RTO) {
+    rto = TFTP_MIN_RTO;
+  } else if (rto > TFTP_MAX_RTO) {
+    rto = TFTP_MAX_RTO;
+  }
+
+  LOG_STR("TFTP failover to ");
+  LOG_HEX_BYTE(tftpServer[0]);
+  LOG_HEX_BYTE(tftpServer[1]);
+  LOG_HEX_BYTE(tftpServer[2]);
+  LOG_HEX_BYTE(tftpServer[3]);
+  LOG_STR(" at ");
+  LOG_HEX(offset);
+  LOG_STR("\r\n");
+
+  // Nothing received yet means the request itself can just go elsewhere,
+  // otherwise the flash accumulator is waiting for byte offset
+  if (offset) {
+    failoverOffset = offset;
+    requestOffset = offset;
+    requestLength = 0;
+  }
+  tftpStartTransfer();
+  return true;
+}
+#endif
+
+// Nothing arrived in time: repeat the request, or the ACK of the last block
+// we have, which also makes the server restart its window from there
+static void tftpRetransmit(void) {
+  if (++retries > TFTP_MAX_RETRIES) {
+    LOG("TFTP: no response, giving up");
+    retransmitEnabled = false;
+    return;
+  }
+
+#if TFTP_SELECT
+  // A mirror that went quiet costs a few short timeouts, not the whole boot
+  if (retries > TFTP_FAILOVER_RETRIES && tftpFailover()) {
+    return;
+  }
+#endif
+
+  // Back off
+  rto = (rto * 2 > TFTP_MAX_RTO) ? TFTP_MAX_RTO : rto * 2;
+
+  if (serverPort == 0) {
+    tftpSendRequest(optionsRequested);
+  } else {
+    netBeginPacket(NET_SOCKET_TFTP, tftpServer, serverPort);
+    tftpSendACK(nextBlockNumber - 1);
+    netEndPacket(NET_SOCKET_TFTP);
+    ackedBlock = nextBlockNumber - 1;
+    blocksInWindow = 0;
+  }
+  tftpTimerStart(true);
 }
 
 bool tftpRun (void) {
-  uint8_t buffer[TFTP_MAX_PAYLOAD];
-  uint8_t* bufferPtr = buffer;
+  // Only the opcode and block number/error code are copied out, the payload
+  // goes straight from the W5500 into the flash row accumulator
+  uint8_t head[4];
 
   // Get the packet
   uint8_t fromAddr[4];
   uint16_t fromPort;
-  uint16_t bufferLen = netReceivePacketSocket3(buffer, fromAddr, &fromPort);
+#if TFTP_STRIPES
+  if (stripeCount) {
+    // Busy until the last stripe is in or tftpStripesAbort() falls back to
+    // the primary. The other stripes can finish while one is still retrying,
+    // and the bootloader mustn't time out and boot a half written image.
+    tftpStripesRun();
+    return true;
+  }
+#endif
+#if TFTP_SELECT
+  if (probing) {
+    return tftpProbeRun();
+  }
+#endif
+
+  rxSocket = NET_SOCKET_TFTP;
+  uint16_t bufferLen = netPeekPacket(rxSocket, head, sizeof(head), fromAddr, &fromPort);
+#if TFTP_MULTICAST
+  if (bufferLen == 0 && multicast) {
+    rxSocket = NET_SOCKET_TFTP_MCAST;
+    bufferLen = netPeekPacket(rxSocket, head, sizeof(head), fromAddr, &fromPort);
+  }
+#endif
   if (bufferLen == 0) {
+    if (retransmitEnabled && millis() - timerStart > rto) {
+      tftpRetransmit();
+    } else {
+      // Use the wait to erase rows ahead of the data
+      flash_idle();
+    }
     return false;
   }
 
+  if (bufferLen < sizeof(head)) {
+    // Too short to be anything we care about
+    netConsumePacket(rxSocket);
+    return true;
+  }
+
+#if TFTP_SELECT
+  if (memcmp(fromAddr, tftpServer, 4) != 0) {
+    // A late answer from a server we moved away from
+    netConsumePacket(rxSocket);
+    return true;
+  }
+#endif
+  bufferLen -= sizeof(head);
+
   // Get the opcode
-  uint16_t tftpOpcode = (bufferPtr[0] << 8) + bufferPtr[1];
-  bufferPtr+=2;
-  bufferLen-=2;
+  uint16_t tftpOpcode = (head[0] << 8) + head[1];
 
   switch (tftpOpcode)
   {
     case TFTP_OPCODE_DATA:
       {
-        uint16_t tftpBlockNumber = (bufferPtr[0] << 8) + bufferPtr[1];
-        bufferPtr += 2;
-        bufferLen -= 2;
+        uint16_t tftpBlockNumber = (head[2] << 8) + head[3];
 
-        if (tftpBlockNumber < nextBlockNumber) {
-          // ACK the prior data block since this appears to be a retransmit
-          netBeginPacketSocket3(tftpServer, fromPort);
+#if TFTP_MULTICAST
+        if (multicast) {
+          tftpMulticastData(tftpBlockNumber, bufferLen);
+          netConsumePacket(rxSocket);
+          return true;
+        }
+#endif
+
+#if TFTP_ROWS
+        if (rowsPhase != ROWS_OFF && fromPort == rowsStalePort) {
+          // The previous transfer lost our final ACK, repeat it
+          netConsumePacket(rxSocket);
+          netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
           tftpSendACK(tftpBlockNumber);
-          netEndPacketSocket3();
-          break;
-        } else if (tftpBlockNumber > nextBlockNumber) {
-          // Ignore newer packets
-          // TODO: should they be NACKed or ERRed?
+          netEndPacket(NET_SOCKET_TFTP);
+          return true;
+        }
+        if (rowsPhase == ROWS_RANGES && serverPort == 0) {
+          // No OACK, so the server ignored the range and is sending the
+          // whole file
+          netConsumePacket(rxSocket);
+          netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
+          tftpSendERROR(TFTP_ERROR_OPTIONS);
+          netEndPacket(NET_SOCKET_TFTP);
+          tftpRequestImage();
+          return true;
+        }
+#endif
+
+#if TFTP_SELECT
+        if (failoverOffset && serverPort == 0) {
+          // No OACK, so this server is sending the image from the start
+          netConsumePacket(rxSocket);
+          netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
+          tftpSendERROR(TFTP_ERROR_OPTIONS);
+          netEndPacket(NET_SOCKET_TFTP);
+          tftpRequestImage();
+          return true;
+        }
+#endif
+
+        if (tftpBlockNumber != nextBlockNumber) {
+          // Blocks a little ahead are kept until the gap is filled, which
+          // is usually just reordering
+          if (tftpBlockNumber > nextBlockNumber && tftpPoolStore(tftpBlockNumber, bufferLen)) {
+            netConsumePacket(rxSocket);
+            return true;
+          }
+
+          netConsumePacket(rxSocket);
+          // A block we already ACKed is the server going back for an ACK it
+          // already acted on, or one that got lost. Answering it would make
+          // the server go back again, a window behind every time. It still
+          // shows the server is busy sending to us, so the retransmission
+          // timer, which repeats a lost ACK anyway, starts over. Only while
+          // the blocks go up: the server coming round again has timed out
+          // itself, and at our RTO it could give up before hearing from us.
+          if (tftpBlockNumber <= ackedBlock) {
+            if (tftpBlockNumber > timerPostponed) {
+              timerPostponed = tftpBlockNumber;
+              timerStart = millis();
+            }
+            return true;
+          }
+          // Any other retransmit is of blocks we took from the pool without
+          // an ACK, a later block we can't keep means part of the window got
+          // lost. Either way the server has to restart from the last block
+          // we have, so tell it once until things are back in order.
+          if (!gapAcked) {
+            gapAcked = true;
+            netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
+            tftpSendACK(nextBlockNumber - 1);
+            netEndPacket(NET_SOCKET_TFTP);
+            ackedBlock = nextBlockNumber - 1;
+            tftpTimerStart(false);
+          }
+          blocksInWindow = 0;
+          return true;
+        }
+        serverPort = fromPort;
+
+        tftpDeliver(tftpBlockNumber, bufferLen, NULL);
+        netConsumePacket(rxSocket);
+
+        // Release whatever the block completed
+        uint8_t* pooled;
+        uint16_t pooledLen;
+        while (retransmitEnabled && (pooled = tftpPoolTake(nextBlockNumber, &pooledLen)) != NULL) {
+          retransmitsAvoided++;
+          tftpDeliver(nextBlockNumber, pooledLen, pooled);
+        }
+        return true;
+      }
+
+    case TFTP_OPCODE_OACK:
+      {
+#if TFTP_MULTICAST
+        if (nextBlockNumber != 1 && !multicast) {
+#else
+        if (nextBlockNumber != 1) {
+#endif
+          // Only valid in answer to the request
           break;
         }
-        nextBlockNumber = tftpBlockNumber + 1;
 
-        LOG_STR("TFTP DATA: ");
-        LOG_HEX(tftpBlockNumber);
-        LOG_STR(" ");
-        LOG_HEX(bufferLen);
+        // The options start in the block number field of head
+        char options[TFTP_MAX_OACK];
+        uint16_t optionsLen = bufferLen + 2;
+        if (optionsLen >= sizeof(options)) {
+          // Longer than anything we asked for. Parsing a truncated copy
+          // could cut a value short, so refuse the options instead.
+          netConsumePacket(rxSocket);
+          netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
+          tftpSendERROR(TFTP_ERROR_OPTIONS);
+          netEndPacket(NET_SOCKET_TFTP);
+          retransmitEnabled = false;
+          return true;
+        }
+        memcpy(options, head + 2, 2);
+        netReadPacket(rxSocket, (uint8_t*) options + 2, optionsLen - 2);
+        options[optionsLen] = 0;
+        netConsumePacket(rxSocket);
+
+        serverPort = fromPort;
+        tftpTimerProgress();
+
+        tftpParseOptions(options, optionsLen);
+
+#if TFTP_MULTICAST
+        if (multicast) {
+          // Later OACKs only say whether we're the master client now, and a
+          // new master picks up from the first block it's missing
+          retransmitEnabled = masterClient;
+          if (masterClient) {
+            tftpMulticastACK();
+          }
+          return true;
+        }
+
+        if (multicastOffered && !tftpMulticastStart()) {
+          // Can't use the offer, so decline it and ask for a unicast transfer
+          netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
+          tftpSendERROR(TFTP_ERROR_OPTIONS);
+          netEndPacket(NET_SOCKET_TFTP);
+          multicastAllowed = false;
+          serverPort = 0;
+          tftpSendRequest(true);
+          tftpTimerStart(false);
+          return true;
+        }
+#endif
+
+        // Slots follow the block size
+        tftpPoolInit();
+
+        LOG_STR("TFTP OACK: blksize ");
+        LOG_HEX(blockSize);
+        LOG_STR(" windowsize ");
+        LOG_HEX(windowSize);
+        LOG_STR(" tsize ");
+        LOG_HEX(transferSize);
         LOG_STR("\r\n");
 
-        // Setup for sending to the tftp server
-        netBeginPacketSocket3(tftpServer, fromPort);
+#if TFTP_ROWS
+        if (rowsPhase == ROWS_RANGES && (imageOffset != requestOffset || imageLength != requestLength)) {
+          // The server can't send ranges, fetch the whole image instead
+          netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
+          tftpSendERROR(TFTP_ERROR_OPTIONS);
+          netEndPacket(NET_SOCKET_TFTP);
+          tftpRequestImage();
+          return true;
+        }
+#endif
 
-        // Write to flash
-        if (flash_tftp_buffer(bufferPtr, bufferLen)) {
-          // ACK the data block
-          tftpSendACK(tftpBlockNumber);
-        } else {
-          // Write failed, so let's call that 'disk full'
+#if TFTP_SELECT
+        if (failoverOffset && (imageOffset != failoverOffset || (failoverSize && transferSize != failoverSize))) {
+          // This server can't carry on where the last one stopped
+          netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
+          tftpSendERROR(TFTP_ERROR_OPTIONS);
+          netEndPacket(NET_SOCKET_TFTP);
+          tftpRequestImage();
+          return true;
+        }
+#endif
+
+        if (transferSize && !flash_plan(transferSize)) {
+          // Refuse the image before anything has been written
+          netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
           tftpSendERROR(TFTP_ERROR_DISK_FULL);
+          netEndPacket(NET_SOCKET_TFTP);
+          retransmitEnabled = false;
+          return true;
+        }
+
+#if TFTP_STRIPES
+        if (tftpStripesStart()) {
+          // This request was only needed for the size
+          netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
+          tftpSendERROR(TFTP_ERROR_OPTIONS);
+          netEndPacket(NET_SOCKET_TFTP);
+          return true;
         }
+#endif
 
-        netEndPacketSocket3();
+#if FLASH_JOURNAL
+        if (!tftpJournalStart()) {
+          // Not the image we started, so start over from block 1. The
+          // resume point went out as the offset option, and a restart that
+          // kept it would ask for the tail again.
+          netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
+          tftpSendERROR(TFTP_ERROR_OPTIONS);
+          netEndPacket(NET_SOCKET_TFTP);
+          resumeOffset = 0;
+          requestOffset = 0;
+          serverPort = 0;
+          tftpSendRequest(true);
+          tftpTimerStart(false);
+          return true;
+        }
+#endif
 
-        // A smaller than max payload means we're done with the transfer
-        if (bufferLen < TFTP_MAX_PAYLOAD) {
-          LOG("TFTP DONE");
-          startApplication();
+#if TFTP_MULTICAST
+        if (multicast && !masterClient) {
+          // Only the master client ACKs, the others just listen
+          retransmitEnabled = false;
+          return true;
         }
-        break;
+#endif
+
+#if TFTP_SELECT
+        // Any failover is confirmed, block 1 is the byte the flash expects
+        failoverOffset = 0;
+#endif
+
+        // Block 0 acknowledges the OACK and starts the transfer
+        netBeginPacket(NET_SOCKET_TFTP, tftpServer, fromPort);
+        tftpSendACK(0);
+        netEndPacket(NET_SOCKET_TFTP);
+        tftpTimerStart(false);
+        return true;
       }
 
-#if DEBUG
     case TFTP_OPCODE_ERROR:
       {
-        uint16_t tftpErrorCode = (bufferPtr[0] << 8) + bufferPtr[1];
-        bufferPtr += 2;
-        bufferLen -= 2;
+        uint16_t tftpErrorCode = (head[2] << 8) + head[3];
         LOG_STR("ERROR: ");
         LOG_HEX(tftpErrorCode);
         LOG_STR("\r\n");
+
+#if TFTP_ROWS
+        if (rowsPhase != ROWS_OFF) {
+          // No manifest, or no ranges, so fetch the whole image instead
+          netConsumePacket(rxSocket);
+          tftpRequestImage();
+          return true;
+        }
+#endif
+
+#if TFTP_SELECT
+        if (failoverOffset) {
+          // The server we failed over to can't help, try the next one
+          netConsumePacket(rxSocket);
+          if (!tftpFailover()) {
+            tftpRequestImage();
+          }
+          return true;
+        }
+#endif
+
+        if (tftpErrorCode == TFTP_ERROR_OPTIONS && optionsRequested && nextBlockNumber == 1) {
+          // The server refused our options, ask again without them
+          netConsumePacket(rxSocket);
+          tftpSendRequest(false);
+          tftpTimerStart(false);
+          return true;
+        }
+
+        // The transfer is over, don't keep asking
+        retransmitEnabled = false;
         break;
       }
-#endif
   }
 
+  netConsumePacket(rxSocket);
   return true;
 }
-
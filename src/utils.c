@@ -19,6 +19,8 @@
 //  Developed by Claudio Indellicati <bitron.it@gmail.com>
 //  (implementation of 'startApplication()' moved here from 'main.c')
 
+#include <string.h>
+
 #include "utils.h"
 #include "board_definitions.h"
 #include "log.h"
@@ -31,6 +33,20 @@ uint64_t millis (void) {
   return tickCount;
 }
 
+// CPU cycles since the SysTick was started
+uint64_t cycles (void) {
+  uint64_t ticks;
+  uint32_t value;
+
+  // Retry if the SysTick interrupt fired between the two reads
+  do {
+    ticks = tickCount;
+    value = SysTick->VAL;
+  } while (ticks != tickCount);
+
+  return ticks * SYSTICK_CYCLES + (SYSTICK_CYCLES - 1 - value);
+}
+
 void delay (uint32_t delayInMilliseconds) {
   uint64_t endCount = tickCount + (delayInMilliseconds * (CPU_FREQUENCY / 1000000UL));
 
@@ -85,3 +101,58 @@ uint32_t getDeviceSerialNumber32() {
   return words[0] ^ words[1] ^ words[2] ^ words[3];
 }
 
+uint16_t crc16(const void* data, uint32_t len, uint16_t crc) {
+  const uint8_t* ptr = data;
+
+  while (len--) {
+    crc ^= (uint16_t)*(ptr++) << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+uint32_t crc32(const void* data, uint32_t len, uint32_t crc) {
+  // A nibble at a time, a full table costs 1KB of flash
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+  const uint8_t* ptr = data;
+
+  crc = ~crc;
+  while (len--) {
+    crc ^= *(ptr++);
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+  }
+  return ~crc;
+}
+
+uint8_t* appendText(uint8_t* ptr, const char* str) {
+  size_t len = strlen(str);
+  memcpy(ptr, str, len);
+  return ptr + len;
+}
+
+uint8_t* appendDecimal(uint8_t* ptr, uint32_t val) {
+  char digits[11];
+  char* d = digits + sizeof(digits) - 1;
+
+  *d = 0;
+  do {
+    *(--d) = '0' + (val % 10);
+    val /= 10;
+  } while (val);
+
+  return appendText(ptr, d);
+}
+
+uint32_t parseNumber(const char* str) {
+  uint32_t val = 0;
+  while (*str >= '0' && *str <= '9') {
+    val = val * 10 + (*(str++) - '0');
+  }
+  return val;
+}
@@ -28,7 +28,11 @@ extern uint32_t __sketch_vectors_ptr;
 
 extern volatile uint64_t tickCount;
 
+// CPU cycles per SysTick interrupt
+#define SYSTICK_CYCLES (1000U)
+
 uint64_t millis (void);
+uint64_t cycles (void);
 void delay (uint32_t delayInMilliseconds);
 
 void startApplication (void);
@@ -37,4 +41,17 @@ void jumpToApplication (void);
 void getDeviceSerialNumber(uint32_t words[4]);
 uint32_t getDeviceSerialNumber32();
 
+// CRC-16/CCITT, pass 0xFFFF to start and the previous result to continue
+uint16_t crc16(const void* data, uint32_t len, uint16_t crc);
+// CRC-32 as used by zlib and Ethernet, pass 0 to start and the previous
+// result to continue
+uint32_t crc32(const void* data, uint32_t len, uint32_t crc);
+
+// Text for network protocols. The append functions copy without a NUL and
+// return the end of what they wrote. parseNumber() stops at the first
+// character that isn't a decimal digit.
+uint8_t* appendText(uint8_t* ptr, const char* str);
+uint8_t* appendDecimal(uint8_t* ptr, uint32_t val);
+uint32_t parseNumber(const char* str);
+
 #endif   // __DELAY_H__
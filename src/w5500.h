@@ -31,11 +31,17 @@
 #define REG_IR          0x0015
 //Interrupt Mask
 #define REG_IMR         0x0016
+//Socket Interrupt
+#define REG_SIR         0x0017
+//Socket Interrupt Mask
+#define REG_SIMR        0x0018
 //Retry Time
 #define REG_RTR0        0x0019
 #define REG_RTR1        0x001A
 //Retry Count
 #define REG_RCR         0x001B
+//PHY Configuration
+#define REG_PHYCFGR     0x002E
 //RX Memory Size
 //#define REG_RMSR        0x01A
 //TX Memory Size
@@ -55,6 +61,9 @@
 //Unreachable Port
 #define REG_UPORT0      0x02E
 #define REG_UPORT1      0x02F
+//Chip Version
+#define REG_VERSIONR    0x0039
+#define W5500_VERSION     0x04
 /**
  * Socket 0 addresses */
 //Mode
@@ -207,6 +216,31 @@
 #define REG_S3_RX_RSR1  0x0027
 #define REG_S3_RX_RD0   0x0028
 #define REG_S3_RX_RD1   0x0029
+/**
+ * Socket n addresses (use with the SOCK_*_CB(n) control bytes) */
+#define REG_SN_MR       0x0000
+#define REG_SN_CR       0x0001
+#define REG_SN_IR       0x0002
+#define REG_SN_SR       0x0003
+#define REG_SN_PORT0    0x0004
+#define REG_SN_PORT1    0x0005
+#define REG_SN_DHAR0    0x0006
+#define REG_SN_DIPR0    0x000C
+#define REG_SN_DPORT0   0x0010
+#define REG_SN_DPORT1   0x0011
+#define REG_SN_MSSR0    0x0012
+#define REG_SN_MSSR1    0x0013
+#define REG_SN_TX_FSR0  0x0020
+#define REG_SN_TX_FSR1  0x0021
+#define REG_SN_TX_RD0   0x0022
+#define REG_SN_TX_RD1   0x0023
+#define REG_SN_TX_WR0   0x0024
+#define REG_SN_TX_WR1   0x0025
+#define REG_SN_RX_RSR0  0x0026
+#define REG_SN_RX_RSR1  0x0027
+#define REG_SN_RX_RD0   0x0028
+#define REG_SN_RX_RD1   0x0029
+#define REG_SN_IMR      0x002C
 
 #define S0_TX_START 0x0000
 #define S0_TX_END   0x0800
@@ -225,12 +259,30 @@
 #define S3_RX_START 0x2800
 #define S3_RX_END   0x3000
 
+/**
+ * PHYCFGR (PHY Configuration Register) [R/W] [0x002E] [0b10111XXX]
+ * RST resets the PHY while it is 0, OPMD selects the mode from OPMDC rather
+ * than the hardware pins. LNK, SPD and DPX report the negotiated link. */
+#define PHYCFGR_RST            0x80
+#define PHYCFGR_OPMD           0x40
+#define PHYCFGR_OPMDC_10HD     0x00
+#define PHYCFGR_OPMDC_10FD     0x08
+#define PHYCFGR_OPMDC_100HD    0x10
+#define PHYCFGR_OPMDC_100FD    0x18
+#define PHYCFGR_OPMDC_100HD_AN 0x20
+#define PHYCFGR_OPMDC_ALLAN    0x38
+#define PHYCFGR_DPX            0x04
+#define PHYCFGR_SPD            0x02
+#define PHYCFGR_LNK            0x01
+
 #define MR_CLOSED         0x00
 #define MR_TCP            0x01
 #define MR_UDP            0x02
 #define MR_IPRAW          0x03
 #define MR_MACRAW         0x04
 #define MR_PPPOE          0x05
+#define MR_MULTI          0x80  // UDP multicast
+#define MR_MFEN           0x80  // MACRAW MAC filter, only our unicast and broadcast
 /**
  * Sn_CR (Socket n Command Register)[R/W] [0x0401,0x0501,0x0601,0x0701] [0x00]
  * This register is utilized for socket n initialization, close, connection
@@ -296,5 +348,10 @@
 //Socket TXbuf BSB:
 #define S2_TXBUF_CB 0x54
 #define S3_TXBUF_CB 0x74
+//Socket n BSB: registers 4n+1, TX buffer 4n+2, RX buffer 4n+3
+#define SOCK_R_CB(n)     ((uint8_t)((((n) << 2) | 0x01) << 3))
+#define SOCK_W_CB(n)     ((uint8_t)(SOCK_R_CB(n) | 0x04))
+#define SOCK_TXBUF_CB(n) ((uint8_t)(((((n) << 2) | 0x02) << 3) | 0x04))
+#define SOCK_RXBUF_CB(n) ((uint8_t)((((n) << 2) | 0x03) << 3))
 
 #endif   // __W5500_H__
@@ -28,6 +28,8 @@
 //
 //  Wiznet W5500 differentiation code adapted from https://github.com/jbkim/Differentiate-WIznet-Chip
 
+#include <stddef.h>
+#include <string.h>
 #include "w5x00.h"
 #include "spi.h"
 
@@ -40,7 +42,7 @@
 #define W5X00_IP_ADDR_POS  15
 
 #define W5X00_REGISTER_BLOCK_SIZE 28
-uint8_t registerBuffer[W5X00_REGISTER_BLOCK_SIZE] =
+static const uint8_t registerBuffer[W5X00_REGISTER_BLOCK_SIZE] =
 {
   0x80,   // MR Mode - reset device
 
@@ -54,15 +56,82 @@ uint8_t registerBuffer[W5X00_REGISTER_BLOCK_SIZE] =
   0,            // IMR Interrupt Mask Register (0x0016)
   0,            // Socket Interrupt (SIR) (0x0017)
   0,            // Socket Interrupt Mask (SIMR) (0x0018)
-  0x07, 0xD0,   // RTR Retry Time-value Register ((RTR0),(RTR0)) (0x0019,0x001A)
-  0x08          // RCR Retry Count Register (0x001B)
+  W5X00_RETRY_TIME >> 8, W5X00_RETRY_TIME & 0xFF,  // RTR Retry Time-value Register ((RTR0),(RTR0)) (0x0019,0x001A)
+  W5X00_RETRY_COUNT                                 // RCR Retry Count Register (0x001B)
 };
 
+// Frame header: 16 bit address followed by the control byte, folds to a constant for fixed registers
+#define W5X00_HEADER(address, cb) (((uint32_t)(address) << 8) | (cb))
+#define W5X00_HEADER_SIZE         (3U)
+
 #define W5X00_INIT_CS     PORT->Group[W5X00_CS_PORT].DIRSET.reg=(1<<W5X00_CS_PIN)
 #define W5X00_END_CS      PORT->Group[W5X00_CS_PORT].DIRCLR.reg=(1<<W5X00_CS_PIN)
 #define W5X00_ASSERT_CS   PORT->Group[W5X00_CS_PORT].OUTCLR.reg=(1<<W5X00_CS_PIN)
 #define W5X00_DEASSERT_CS PORT->Group[W5X00_CS_PORT].OUTSET.reg=(1<<W5X00_CS_PIN)
 
+// Shadow of the common register block and the register block of every
+// socket. Only registers that the W5500 never changes on its own (addresses,
+// ports, modes, TX_WR, RX_RD, ...) may be staged or read through the shadow,
+// command/status/interrupt registers always go to the chip.
+#define W5X00_SHADOW_SIZE   (0x30)
+#define W5X00_SHADOW_BLOCKS (1 + 8)
+
+typedef struct {
+  uint8_t value[W5X00_SHADOW_SIZE];
+  uint64_t valid;
+  uint64_t dirty;
+} w5x00Shadow_t;
+
+static w5x00Shadow_t shadow[W5X00_SHADOW_BLOCKS];
+
+// Sockets with a command that hasn't been confirmed complete yet (CR != 0)
+static uint8_t commandPending;
+
+// Block select bits of the control byte
+#define W5X00_BSB(cb)            ((cb) >> 3)
+#define W5X00_BSB_IS_SOCKET(bsb) (((bsb) & 0x03) == 0x01)
+#define W5X00_BSB_SOCKET(bsb)    ((bsb) >> 2)
+
+// Returns the shadow for the block selected by cb, or NULL for buffer blocks
+static w5x00Shadow_t* w5x00ShadowFor(uint16_t address, uint8_t cb) {
+  uint8_t bsb = W5X00_BSB(cb);
+
+  if (address >= W5X00_SHADOW_SIZE) {
+    return NULL;
+  } else if (bsb == 0) {
+    return &shadow[0];
+  } else if (W5X00_BSB_IS_SOCKET(bsb)) {
+    return &shadow[1 + W5X00_BSB_SOCKET(bsb)];
+  }
+  return NULL;
+}
+
+static void w5x00ShadowStore(uint16_t address, uint8_t cb, const uint8_t* buf, uint16_t len) {
+  w5x00Shadow_t* sh = w5x00ShadowFor(address, cb);
+  if (!sh) {
+    return;
+  }
+
+  for (uint16_t i = 0; i < len && address + i < W5X00_SHADOW_SIZE; i++) {
+    sh->value[address + i] = buf[i];
+    sh->valid |= 1ULL << (address + i);
+  }
+}
+
+// Before touching a socket's registers, make sure its last command is done
+static void w5x00WaitCommand(uint8_t cb) {
+  uint8_t bsb = W5X00_BSB(cb);
+  if (!W5X00_BSB_IS_SOCKET(bsb)) {
+    return;
+  }
+
+  uint8_t socketBit = 1 << W5X00_BSB_SOCKET(bsb);
+  if (commandPending & socketBit) {
+    commandPending &= ~socketBit;
+    while (w5x00ReadReg(REG_SN_CR, SOCK_R_CB(W5X00_BSB_SOCKET(bsb))));
+  }
+}
+
 
 bool w5x00Init() {
   W5X00_INIT_CS;
@@ -71,9 +140,9 @@ bool w5x00Init() {
 
   // Adapted form https://github.com/jbkim/Differentiate-WIznet-Chip
   spiTransfer(0x00);
-  spiTransfer(0x39);
-  spiTransfer(0x00);
-  bool chipAvailable = (spiTransfer(0x00) == 0x04);
+  spiTransfer(REG_VERSIONR);
+  spiTransfer(GP_R_CB);
+  bool chipAvailable = (spiTransfer(0x00) == W5500_VERSION);
 
   W5X00_DEASSERT_CS;
 
@@ -87,9 +156,88 @@ bool w5x00Init() {
   // Wait for reset to complete
   while (w5x00ReadReg(REG_MR, GP_R_CB) && REG_MR_RESET);
 
+  // Everything is back to the reset values, forget what we knew
+  memset(shadow, 0, sizeof(shadow));
+  commandPending = 0;
+
+  // ARP/send retry timing
+  w5x00StageBuffer(REG_RTR0, GP_W_CB, &registerBuffer[REG_RTR0], 3);
+  w5x00Flush();
+
+#ifdef W5X00_PHY_MODE
+  // Select the PHY mode from the board definition rather than the strapping
+  // pins, and restart the PHY so it takes effect
+  w5x00WriteReg(REG_PHYCFGR, GP_W_CB, PHYCFGR_OPMD | W5X00_PHY_MODE);
+  w5x00WriteReg(REG_PHYCFGR, GP_W_CB, PHYCFGR_RST | PHYCFGR_OPMD | W5X00_PHY_MODE);
+#endif
+
   return true;
 }
 
+// PHYCFGR is updated by the PHY, so this always reads the chip
+uint8_t w5x00LinkStatus(void) {
+  return w5x00ReadReg(REG_PHYCFGR, GP_R_CB) & (PHYCFGR_LNK | PHYCFGR_SPD | PHYCFGR_DPX);
+}
+
+#ifdef W5X00_INT_PIN
+// Route INTn to the EIC with falling edge detection. The edge latches the
+// EXTINT flag whether or not the interrupt is enabled, so no handler (and no
+// SPI traffic) is needed to find out whether the W5500 has something for us.
+void w5x00InitInterrupt(void) {
+  // INTn as an input on peripheral function A (EIC)
+  PORT->Group[W5X00_INT_PORT].PINCFG[W5X00_INT_PIN].reg = PORT_PINCFG_PMUXEN | PORT_PINCFG_INEN;
+  PORT->Group[W5X00_INT_PORT].PMUX[W5X00_INT_PIN / 2].reg &= ~(0xF << (4 * (W5X00_INT_PIN & 0x01u)));
+
+  PM->APBAMASK.reg |= PM_APBAMASK_EIC;
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(GCLK_CLKCTRL_ID_EIC_Val) |
+    GCLK_CLKCTRL_GEN_GCLK0 |
+    GCLK_CLKCTRL_CLKEN;
+  while (GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY);
+
+  EIC->CONFIG[W5X00_INT_EXTINT / 8].reg |= EIC_CONFIG_SENSE0_FALL_Val << (4 * (W5X00_INT_EXTINT % 8));
+  EIC->INTFLAG.reg = 1 << W5X00_INT_EXTINT;
+  EIC->CTRL.reg = EIC_CTRL_ENABLE;
+  while (EIC->STATUS.reg & EIC_STATUS_SYNCBUSY);
+}
+
+// Returns (and clears) whether INTn fell since the last call
+bool w5x00InterruptPending(void) {
+  if (EIC->INTFLAG.reg & (1 << W5X00_INT_EXTINT)) {
+    EIC->INTFLAG.reg = 1 << W5X00_INT_EXTINT;
+    return true;
+  }
+  return false;
+}
+#endif
+
+// Write a test pattern to a scratch register block and read it back. The
+// destination IP/port registers of socket 7 are only used when sending, so
+// they are free until the socket is opened.
+bool w5x00CheckSpi (void) {
+  static const uint8_t pattern[] = { 0x55, 0xAA, 0x00, 0xFF, 0xA5, 0x5A };
+  uint8_t readBack[sizeof(pattern)];
+  bool ok = true;
+
+  for (uint8_t round = 0; ok && round < W5X00_SPI_CHECK_ROUNDS; round++) {
+    uint8_t expected[sizeof(pattern)];
+    for (uint8_t i = 0; i < sizeof(pattern); i++) {
+      expected[i] = pattern[i] ^ (round * 0x11);
+    }
+
+    w5x00WriteBuffer(REG_SN_DIPR0, SOCK_W_CB(7), expected, sizeof(expected));
+    w5x00ReadBuffer(REG_SN_DIPR0, SOCK_R_CB(7), readBack, sizeof(readBack));
+
+    ok = (memcmp(expected, readBack, sizeof(expected)) == 0) &&
+         (w5x00ReadReg(REG_VERSIONR, GP_R_CB) == W5500_VERSION);
+  }
+
+  // Leave the scratch registers as they were after reset
+  memset(readBack, 0, sizeof(readBack));
+  w5x00WriteBuffer(REG_SN_DIPR0, SOCK_W_CB(7), readBack, sizeof(readBack));
+
+  return ok;
+}
+
 void w5x00End (void) {
   W5X00_END_CS;
 }
@@ -97,13 +245,11 @@ void w5x00End (void) {
 uint8_t w5x00ReadReg (uint16_t address, uint8_t cb) {
   uint8_t receivedByte;
 
-  W5X00_ASSERT_CS;
-
-  spiTransfer16(address);
+  w5x00WaitCommand(cb);
 
-  spiTransfer(cb);
+  W5X00_ASSERT_CS;
 
-  receivedByte = spiTransfer(0U);
+  spiTransferFrame(W5X00_HEADER(address, cb), W5X00_HEADER_SIZE, NULL, &receivedByte, 1);
 
   W5X00_DEASSERT_CS;
 
@@ -111,29 +257,209 @@ uint8_t w5x00ReadReg (uint16_t address, uint8_t cb) {
 }
 
 uint16_t w5x00ReadWord (uint16_t address, uint8_t cb) {
-  return ((uint16_t)(w5x00ReadReg(address, cb)) << 8) | (uint16_t)(w5x00ReadReg(address + 1, cb));
+  uint8_t buf[2];
+
+  w5x00ReadBuffer(address, cb, buf, sizeof(buf));
+
+  return ((uint16_t)buf[0] << 8) | (uint16_t)buf[1];
 }
 
-void w5x00WriteReg (uint16_t address, uint8_t cb, uint8_t value) {
+// Read len bytes starting at address in a single variable length data mode
+// frame. The W5500 auto increments the address for every byte clocked out.
+void w5x00ReadBuffer (uint16_t address, uint8_t cb, uint8_t* buf, uint16_t len) {
+  w5x00WaitCommand(cb);
+
+#ifdef SPI_DMAC_TX_TRIGGER
+  if (len >= SPI_DMA_MIN_SIZE) {
+    w5x00ReadBufferBegin(address, cb, buf, len);
+    w5x00TransferEnd();
+    return;
+  }
+#endif
+
   W5X00_ASSERT_CS;
 
-  spiTransfer16(address);
+  spiTransferFrame(W5X00_HEADER(address, cb), W5X00_HEADER_SIZE, NULL, buf, len);
+
+  W5X00_DEASSERT_CS;
+}
+
+void w5x00WriteReg (uint16_t address, uint8_t cb, uint8_t value) {
+  w5x00Flush();
+  w5x00WaitCommand(cb);
+  w5x00ShadowStore(address, cb, &value, 1);
 
-  spiTransfer(cb);
+  W5X00_ASSERT_CS;
 
-  spiTransfer(value);
+  spiTransferFrame(W5X00_HEADER(address, cb), W5X00_HEADER_SIZE, &value, NULL, 1);
 
   W5X00_DEASSERT_CS;
 }
 
 void w5x00WriteWord (uint16_t address, uint8_t cb, uint16_t value) {
-  w5x00WriteReg(address, cb, (uint8_t)(value >> 8));
-  w5x00WriteReg(++address, cb, (uint8_t)(value & 0xff));
+  uint8_t buf[2] = { (uint8_t)(value >> 8), (uint8_t)(value & 0xff) };
+
+  w5x00WriteBuffer(address, cb, buf, sizeof(buf));
 }
 
-void w5x00WriteBuffer(uint16_t address, uint8_t cb, const uint8_t* buf, uint8_t len) {
-  for (uint8_t i=0; i<len; i++) {
-    w5x00WriteReg(address + i, cb, buf[i]);
+// Write len bytes starting at address in a single variable length data mode frame
+void w5x00WriteBuffer(uint16_t address, uint8_t cb, const uint8_t* buf, uint16_t len) {
+  w5x00Flush();
+  w5x00WaitCommand(cb);
+  w5x00ShadowStore(address, cb, buf, len);
+
+#ifdef SPI_DMAC_TX_TRIGGER
+  if (len >= SPI_DMA_MIN_SIZE) {
+    w5x00WriteBufferBegin(address, cb, buf, len);
+    w5x00TransferEnd();
+    return;
+  }
+#endif
+
+  W5X00_ASSERT_CS;
+
+  spiTransferFrame(W5X00_HEADER(address, cb), W5X00_HEADER_SIZE, buf, NULL, len);
+
+  W5X00_DEASSERT_CS;
+}
+
+#ifdef SPI_DMAC_TX_TRIGGER
+// Send the frame header and hand the data phase of a burst to the DMAC.
+// The CPU is free until w5x00TransferEnd(), but the SPI bus (and the
+// W5500) must not be touched in the meantime.
+void w5x00ReadBufferBegin(uint16_t address, uint8_t cb, uint8_t* buf, uint16_t len) {
+  w5x00WaitCommand(cb);
+
+  W5X00_ASSERT_CS;
+
+  spiTransferFrame(W5X00_HEADER(address, cb), W5X00_HEADER_SIZE, NULL, NULL, 0);
+
+  spiDmaStart(NULL, buf, len);
+}
+
+void w5x00WriteBufferBegin(uint16_t address, uint8_t cb, const uint8_t* buf, uint16_t len) {
+  w5x00Flush();
+  w5x00WaitCommand(cb);
+  w5x00ShadowStore(address, cb, buf, len);
+
+  W5X00_ASSERT_CS;
+
+  spiTransferFrame(W5X00_HEADER(address, cb), W5X00_HEADER_SIZE, NULL, NULL, 0);
+
+  spiDmaStart(buf, NULL, len);
+}
+
+bool w5x00TransferBusy(void) {
+  return spiDmaBusy();
+}
+
+// Wait for the DMA data phase to complete and close the frame
+void w5x00TransferEnd(void) {
+  spiDmaWait();
+
+  W5X00_DEASSERT_CS;
+}
+#endif
+
+// Stage a write of host owned registers. Bytes that already hold the value
+// are skipped, the rest is written by the next w5x00Flush() (or before any
+// direct write, so ordering with commands is kept).
+void w5x00StageBuffer(uint16_t address, uint8_t cb, const uint8_t* buf, uint16_t len) {
+  w5x00Shadow_t* sh = w5x00ShadowFor(address, cb);
+  if (!sh || address + len > W5X00_SHADOW_SIZE) {
+    w5x00WriteBuffer(address, cb, buf, len);
+    return;
+  }
+
+  for (uint16_t i = 0; i < len; i++) {
+    uint64_t bit = 1ULL << (address + i);
+    if ((sh->valid & bit) && sh->value[address + i] == buf[i]) {
+      continue;
+    }
+    sh->value[address + i] = buf[i];
+    sh->valid |= bit;
+    sh->dirty |= bit;
+  }
+}
+
+void w5x00StageReg(uint16_t address, uint8_t cb, uint8_t value) {
+  w5x00StageBuffer(address, cb, &value, 1);
+}
+
+void w5x00StageWord(uint16_t address, uint8_t cb, uint16_t value) {
+  uint8_t buf[2] = { (uint8_t)(value >> 8), (uint8_t)(value & 0xff) };
+
+  w5x00StageBuffer(address, cb, buf, sizeof(buf));
+}
+
+// Write all staged registers, merging adjacent ones into a single burst
+void w5x00Flush(void) {
+  for (uint8_t block = 0; block < W5X00_SHADOW_BLOCKS; block++) {
+    w5x00Shadow_t* sh = &shadow[block];
+    if (!sh->dirty) {
+      continue;
+    }
+
+    uint8_t cb = (block == 0) ? GP_W_CB : SOCK_W_CB(block - 1);
+    uint8_t address = 0;
+    while (sh->dirty) {
+      // Find the start and length of the next run of dirty registers
+      while (!(sh->dirty & (1ULL << address))) {
+        address++;
+      }
+      uint8_t len = 0;
+      while (address + len < W5X00_SHADOW_SIZE && (sh->dirty & (1ULL << (address + len)))) {
+        sh->dirty &= ~(1ULL << (address + len));
+        len++;
+      }
+
+      w5x00WaitCommand(cb);
+
+      W5X00_ASSERT_CS;
+      spiTransferFrame(W5X00_HEADER(address, cb), W5X00_HEADER_SIZE, &sh->value[address], NULL, len);
+      W5X00_DEASSERT_CS;
+
+      address += len;
+    }
+  }
+}
+
+// Read host owned registers through the shadow, only going to the chip the first time
+void w5x00CachedReadBuffer(uint16_t address, uint8_t cb, uint8_t* buf, uint16_t len) {
+  w5x00Shadow_t* sh = w5x00ShadowFor(address, cb);
+  if (!sh || address + len > W5X00_SHADOW_SIZE) {
+    w5x00ReadBuffer(address, cb, buf, len);
+    return;
+  }
+
+  uint64_t mask = ((1ULL << len) - 1) << address;
+  if ((sh->valid & mask) != mask) {
+    w5x00Flush();
+    w5x00ReadBuffer(address, cb, &sh->value[address], len);
+    sh->valid |= mask;
+  }
+  memcpy(buf, &sh->value[address], len);
+}
+
+uint16_t w5x00CachedReadWord(uint16_t address, uint8_t cb) {
+  uint8_t buf[2];
+
+  w5x00CachedReadBuffer(address, cb, buf, sizeof(buf));
+
+  return ((uint16_t)buf[0] << 8) | (uint16_t)buf[1];
+}
+
+// Issue a socket command. Completion (CR back to 0) is only waited for
+// before the socket's registers are accessed again. OPEN and CLOSE reset
+// the socket's TX_WR and RX_RD pointers, so their shadow is dropped.
+void w5x00Command(uint8_t cb, uint8_t command) {
+  w5x00WriteReg(REG_SN_CR, cb, command);
+
+  uint8_t bsb = W5X00_BSB(cb);
+  commandPending |= 1 << W5X00_BSB_SOCKET(bsb);
+
+  if (command == CR_OPEN || command == CR_CLOSE) {
+    shadow[1 + W5X00_BSB_SOCKET(bsb)].valid &= ~((3ULL << REG_SN_TX_WR0) | (3ULL << REG_SN_RX_RD0));
   }
 }
 
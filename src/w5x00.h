@@ -38,17 +38,48 @@
 #include "w5500.h"
 #include "log.h"
 
+// Number of pattern write/read rounds a bitrate must pass
+#define W5X00_SPI_CHECK_ROUNDS 16
+
 bool w5x00Init();
+bool w5x00CheckSpi(void);
 void w5x00Reset(void);
 void w5x00End(void);
 void w5x00Dump(uint8_t cb);
 
+// PHYCFGR LNK/SPD/DPX bits
+uint8_t w5x00LinkStatus(void);
+
 uint8_t w5x00ReadReg(uint16_t address, uint8_t cb);
 uint16_t w5x00ReadWord(uint16_t address, uint8_t cb);
+void w5x00ReadBuffer(uint16_t address, uint8_t cb, uint8_t* buf, uint16_t len);
 
 void w5x00WriteReg(uint16_t address, uint8_t cb, uint8_t value);
 void w5x00WriteWord(uint16_t address, uint8_t cb, uint16_t value);
-void w5x00WriteBuffer(uint16_t address, uint8_t cb, const uint8_t* buf, uint8_t len);
+void w5x00WriteBuffer(uint16_t address, uint8_t cb, const uint8_t* buf, uint16_t len);
+
+// Register shadow: staged (write-combined) writes and cached reads of host owned registers
+void w5x00StageReg(uint16_t address, uint8_t cb, uint8_t value);
+void w5x00StageWord(uint16_t address, uint8_t cb, uint16_t value);
+void w5x00StageBuffer(uint16_t address, uint8_t cb, const uint8_t* buf, uint16_t len);
+void w5x00Flush(void);
+void w5x00CachedReadBuffer(uint16_t address, uint8_t cb, uint8_t* buf, uint16_t len);
+uint16_t w5x00CachedReadWord(uint16_t address, uint8_t cb);
+
+void w5x00Command(uint8_t cb, uint8_t command);
+
+#ifdef W5X00_INT_PIN
+void w5x00InitInterrupt(void);
+bool w5x00InterruptPending(void);
+#endif
+
+#ifdef SPI_DMAC_TX_TRIGGER
+// Asynchronous (DMA) bursts
+void w5x00ReadBufferBegin(uint16_t address, uint8_t cb, uint8_t* buf, uint16_t len);
+void w5x00WriteBufferBegin(uint16_t address, uint8_t cb, const uint8_t* buf, uint16_t len);
+bool w5x00TransferBusy(void);
+void w5x00TransferEnd(void);
+#endif
 
 
 #endif   // __W5X00_H__
@@ -0,0 +1,394 @@
+// Host models of the SAMD21 and the W5500: memory map, register access
+// traps, simulated time and the device context
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <sam.h>
+#include "host.h"
+#include "utils.h"
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error The host models single step register accesses, which is only implemented for x86-64 Linux
+#endif
+
+// Linker symbols of the device image: the start of the application, and the
+// RAM the TFTP block pool may use. The first 8KB of SRAM stand for the
+// bootloader's own statics.
+__asm__(".globl __sketch_vectors_ptr\n .set __sketch_vectors_ptr, 0x00010000\n"
+        ".globl __end__\n .set __end__, 0x20002000\n"
+        ".globl __StackTop\n .set __StackTop, 0x20007FF0\n");
+
+// Host stack frames are larger than Cortex-M0 ones, so the device stack is
+// kept out of the modelled SRAM
+#define HOST_STACK_START   (0x30000000UL)
+#define HOST_STACK_SIZE    (0x40000UL)
+
+#define HOST_PAGE_SIZE     (0x1000UL)
+#define HOST_PAGE(address) ((address) & ~(HOST_PAGE_SIZE - 1))
+
+// CPU cycles charged per peripheral access, a rough figure for the code
+// between two accesses on the M0+
+#define HOST_ACCESS_CYCLES (8U)
+
+// Longest jump of the clock while the code keeps polling the same register
+// without anything changing. Short enough for millis() based timers.
+#define HOST_IDLE_CYCLES   (SYSTICK_CYCLES)
+
+// Wall clock limit for a test, in case device code spins without touching
+// a peripheral
+#define HOST_WALL_LIMIT    (600U)
+
+// Pages with registers, every access traps
+static const uintptr_t trappedPages[] = {
+  0x40001000UL,   // EIC
+  0x41004000UL,   // NVMCTRL, PORT, DMAC
+  0x42001000UL,   // SERCOM3, SERCOM4
+  0xE000E000UL,   // SysTick, SCB
+};
+
+// Plain memory: PM and GCLK, whose registers need no model, and the serial
+// number words
+static const uintptr_t plainPages[] = {
+  0x40000000UL,
+  0x0080A000UL,
+};
+
+#define HOST_MAX_PERIPHERALS (8)
+static const hostPeripheral_t* peripherals[HOST_MAX_PERIPHERALS];
+static uint8_t peripheralCount;
+
+typedef struct hostEventEntry {
+  uint64_t when;
+  hostEvent_t fn;
+  void* arg;
+  struct hostEventEntry* next;
+} hostEventEntry_t;
+
+static hostEventEntry_t* events;
+static uint64_t now;
+// Bumped whenever a model changes state or an event runs
+static uint64_t version;
+
+// The access being single stepped
+static struct {
+  bool active;
+  uintptr_t address;
+  uintptr_t page;
+  const hostPeripheral_t* peripheral;
+  bool write;
+  uint32_t before;
+  greg_t rip;
+} step;
+
+// The last read that changed nothing, to spot polling loops
+static struct {
+  greg_t rip;
+  uintptr_t address;
+  uint64_t version;
+} lastRead;
+
+static ucontext_t hostContext;
+static ucontext_t deviceContext;
+static void (*deviceMain)(void);
+static hostExit_t exitReason;
+static uint64_t runLimit;
+
+static uint8_t signalStack[256 * 1024];
+
+extern char __executable_start[];
+extern char _end[];
+
+void hostFail(const char* format, ...) {
+  va_list args;
+
+  fprintf(stderr, "host: %.6fs: ", hostSeconds(now));
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+uint64_t hostNow(void) {
+  return now;
+}
+
+double hostSeconds(uint64_t cycles) {
+  return (double) cycles / HOST_CPU_FREQUENCY;
+}
+
+void hostChanged(void) {
+  version++;
+}
+
+void hostSchedule(uint64_t when, hostEvent_t fn, void* arg) {
+  hostEventEntry_t* event = malloc(sizeof(*event));
+  if (!event) {
+    hostFail("out of memory");
+  }
+  event->when = when < now ? now : when;
+  event->fn = fn;
+  event->arg = arg;
+
+  hostEventEntry_t** pos = &events;
+  while (*pos && (*pos)->when <= event->when) {
+    pos = &(*pos)->next;
+  }
+  event->next = *pos;
+  *pos = event;
+}
+
+void hostAdvance(uint64_t when) {
+  while (events && events->when <= when) {
+    hostEventEntry_t* event = events;
+    events = event->next;
+    if (event->when > now) {
+      now = event->when;
+      tickCount = now / SYSTICK_CYCLES;
+    }
+    event->fn(event->arg);
+    free(event);
+    version++;
+  }
+  if (when > now) {
+    now = when;
+  }
+  tickCount = now / SYSTICK_CYCLES;
+}
+
+void hostAddPeripheral(const hostPeripheral_t* peripheral) {
+  if (peripheralCount == HOST_MAX_PERIPHERALS) {
+    hostFail("too many peripherals");
+  }
+  peripherals[peripheralCount++] = peripheral;
+}
+
+bool hostValidAddress(uint32_t address, uint32_t len) {
+  uint64_t start = address;
+  uint64_t end = start + len;
+
+  return (start >= HOST_FLASH_START && end <= HOST_FLASH_END) ||
+         (start >= HOST_SRAM_START && end <= HOST_SRAM_END) ||
+         (start >= HOST_STACK_START && end <= HOST_STACK_START + HOST_STACK_SIZE) ||
+         (start >= (uintptr_t) __executable_start && end <= (uintptr_t) _end);
+}
+
+static bool hostTrapped(uintptr_t page) {
+  for (size_t i = 0; i < sizeof(trappedPages) / sizeof(trappedPages[0]); i++) {
+    if (trappedPages[i] == page) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static const hostPeripheral_t* hostFindPeripheral(uintptr_t address) {
+  for (uint8_t i = 0; i < peripheralCount; i++) {
+    if (address >= peripherals[i]->base && address < peripherals[i]->base + peripherals[i]->size) {
+      return peripherals[i];
+    }
+  }
+  return NULL;
+}
+
+// A register access faulted. Bring the clock and the registers up to date,
+// then let the instruction run with the trap flag set.
+static void hostSegv(int sig, siginfo_t* info, void* context) {
+  ucontext_t* uc = context;
+  uintptr_t address = (uintptr_t) info->si_addr;
+  uintptr_t page = HOST_PAGE(address);
+
+  if (step.active || !hostTrapped(page)) {
+    fprintf(stderr, "host: device fault at %p\n", info->si_addr);
+    signal(sig, SIG_DFL);
+    return;
+  }
+
+  mprotect((void*) page, HOST_PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+  step.active = true;
+  step.address = address;
+  step.page = page;
+  step.peripheral = hostFindPeripheral(address);
+  step.write = (uc->uc_mcontext.gregs[REG_ERR] & 0x2) != 0;
+  step.rip = uc->uc_mcontext.gregs[REG_RIP];
+
+  if (!step.write && step.rip == lastRead.rip && address == lastRead.address && version == lastRead.version) {
+    // Polling: nothing changes before the next event
+    uint64_t until = now + HOST_IDLE_CYCLES;
+    if (events && events->when < until) {
+      until = events->when;
+    }
+    hostAdvance(until);
+  } else {
+    hostAdvance(now + HOST_ACCESS_CYCLES);
+  }
+
+  if (step.peripheral) {
+    step.peripheral->publish((volatile uint8_t*) step.peripheral->base);
+  }
+  step.before = *(volatile uint32_t*) (address & ~3UL);
+
+  uc->uc_mcontext.gregs[REG_EFL] |= 0x100;
+}
+
+// The instruction has run: hand the access to the model and protect the
+// page again
+static void hostStepDone(int sig, siginfo_t* info, void* context) {
+  ucontext_t* uc = context;
+  (void) sig;
+  (void) info;
+
+  if (!step.active) {
+    return;
+  }
+  uc->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+
+  bool changed = *(volatile uint32_t*) (step.address & ~3UL) != step.before;
+  bool write = step.write || changed;
+  uint64_t seen = version;
+  if (step.peripheral) {
+    step.peripheral->access((volatile uint8_t*) step.peripheral->base,
+                            step.address - step.peripheral->base, write);
+  }
+
+  // A write that changed nothing (selecting the same DMAC channel again, say)
+  // doesn't end a polling loop
+  if (version != seen) {
+    lastRead.rip = 0;
+  } else if (!write) {
+    lastRead.rip = step.rip;
+    lastRead.address = step.address;
+    lastRead.version = version;
+  }
+
+  mprotect((void*) step.page, HOST_PAGE_SIZE, PROT_NONE);
+  step.active = false;
+
+  if (runLimit && now >= runLimit) {
+    exitReason = HOST_EXIT_TIMEOUT;
+    setcontext(&hostContext);
+  }
+}
+
+// SysTick, for cycles()
+static void sysTickPublish(volatile uint8_t* regs) {
+  ((volatile SysTick_Type*) regs)->VAL = SYSTICK_CYCLES - 1 - (now % SYSTICK_CYCLES);
+}
+
+static void sysTickAccess(volatile uint8_t* regs, uint32_t offset, bool write) {
+  (void) regs;
+  (void) offset;
+  (void) write;
+}
+
+static const hostPeripheral_t sysTickModel = {
+  .base = (uintptr_t) SysTick,
+  .size = sizeof(SysTick_Type),
+  .publish = sysTickPublish,
+  .access = sysTickAccess,
+};
+
+static void hostMap(uintptr_t address, size_t size, int protection) {
+  void* mapped = mmap((void*) address, size, protection,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (mapped != (void*) address) {
+    hostFail("can't map %#lx", (unsigned long) address);
+  }
+}
+
+void hostInit(void) {
+  if ((uintptr_t) _end > UINT32_MAX) {
+    hostFail("device statics above 4GB, link with -no-pie");
+  }
+
+  hostMap(HOST_FLASH_START, HOST_FLASH_END - HOST_FLASH_START, PROT_READ | PROT_WRITE);
+  hostMap(HOST_SRAM_START, HOST_SRAM_END - HOST_SRAM_START, PROT_READ | PROT_WRITE);
+  hostMap(HOST_STACK_START, HOST_STACK_SIZE, PROT_READ | PROT_WRITE);
+  for (size_t i = 0; i < sizeof(plainPages) / sizeof(plainPages[0]); i++) {
+    hostMap(plainPages[i], HOST_PAGE_SIZE, PROT_READ | PROT_WRITE);
+  }
+  for (size_t i = 0; i < sizeof(trappedPages) / sizeof(trappedPages[0]); i++) {
+    hostMap(trappedPages[i], HOST_PAGE_SIZE, PROT_NONE);
+  }
+
+  // Serial number words, see getDeviceSerialNumber()
+  *(volatile uint32_t*) 0x0080A00CUL = 0x48535400;
+  *(volatile uint32_t*) 0x0080A040UL = 0x4D4F4445;
+  *(volatile uint32_t*) 0x0080A044UL = 0x4C000000;
+  *(volatile uint32_t*) 0x0080A048UL = 0x00000001;
+
+  stack_t altStack = {
+    .ss_sp = signalStack,
+    .ss_size = sizeof(signalStack),
+  };
+  sigaltstack(&altStack, NULL);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  action.sa_sigaction = hostSegv;
+  sigaction(SIGSEGV, &action, NULL);
+  action.sa_sigaction = hostStepDone;
+  sigaction(SIGTRAP, &action, NULL);
+
+  alarm(HOST_WALL_LIMIT);
+
+  hostAddPeripheral(&sysTickModel);
+  portModelInit();
+  spiModelInit();
+  nvmModelInit();
+  w5500ModelInit();
+}
+
+static void hostDeviceEntry(void) {
+  deviceMain();
+  exitReason = HOST_EXIT_RETURN;
+}
+
+hostExit_t hostRun(void (*fn)(void), uint64_t limit) {
+  getcontext(&deviceContext);
+  deviceContext.uc_stack.ss_sp = (void*) HOST_STACK_START;
+  deviceContext.uc_stack.ss_size = HOST_STACK_SIZE;
+  deviceContext.uc_link = &hostContext;
+  makecontext(&deviceContext, hostDeviceEntry, 0);
+
+  deviceMain = fn;
+  exitReason = HOST_EXIT_RETURN;
+  runLimit = now + limit;
+  lastRead.rip = 0;
+
+  swapcontext(&hostContext, &deviceContext);
+
+  runLimit = 0;
+  return exitReason;
+}
+
+void hostSystemReset(void) {
+  exitReason = HOST_EXIT_RESET;
+  setcontext(&hostContext);
+  abort();
+}
@@ -0,0 +1,119 @@
+// Host models of the SAMD21 and the W5500
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  The bootloader sources run unchanged on the host, against models of the
+//  peripherals they program. Peripheral registers live at their real
+//  addresses in pages that are kept inaccessible: every access faults, the
+//  model brings the registers up to date, the instruction is single stepped
+//  and the model then sees what was written. Device code runs on its own
+//  stack, and everything it can hand to the DMAC (statics, that stack, the
+//  modelled SRAM) is below 4GB, so the 32 bit addresses the code stores in
+//  registers and descriptors still point at the right place.
+//
+//  Time is simulated in CPU cycles. It advances with every register access
+//  and jumps ahead when the code is polling for something, so flash
+//  programming, SPI and network timing come out the same on any machine.
+//  x86-64 Linux only.
+
+#ifndef __HOST_H__
+#define __HOST_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HOST_CPU_FREQUENCY (48000000ULL)
+#define HOST_US(us)        ((uint64_t)(us) * (HOST_CPU_FREQUENCY / 1000000ULL))
+#define HOST_MS(ms)        ((uint64_t)(ms) * (HOST_CPU_FREQUENCY / 1000ULL))
+
+// Modelled memory. The application starts where __sketch_vectors_ptr
+// points, the flash ends at NVMCTRL's page count times the page size.
+#define HOST_FLASH_START   (0x00010000UL)
+#define HOST_FLASH_END     (0x00040000UL)
+#define HOST_SRAM_START    (0x20000000UL)
+#define HOST_SRAM_END      (0x20008000UL)
+
+// Maps the memory and peripherals and resets all models. Call once.
+void hostInit(void);
+
+// Print the message and exit with an error, for anything a model finds
+// that the real hardware would get wrong
+void hostFail(const char* format, ...) __attribute__ ((noreturn, format (printf, 1, 2)));
+
+// Simulated time
+uint64_t hostNow(void);
+double hostSeconds(uint64_t cycles);
+
+// Call fn(arg) once the simulated time reaches when. Events at the same
+// time run in the order they were scheduled.
+typedef void (*hostEvent_t)(void* arg);
+void hostSchedule(uint64_t when, hostEvent_t fn, void* arg);
+// Run the events up to time when and move the clock there
+void hostAdvance(uint64_t when);
+
+// Run fn on the device side until it returns, resets (startApplication())
+// or the simulated time reaches now + limit
+typedef enum {
+  HOST_EXIT_RETURN,
+  HOST_EXIT_RESET,
+  HOST_EXIT_TIMEOUT,
+} hostExit_t;
+
+hostExit_t hostRun(void (*fn)(void), uint64_t limit);
+
+// For the models: note a state change that polling code may be waiting
+// for, so the clock doesn't skip past it
+void hostChanged(void);
+
+// A peripheral model. publish() writes the current register values to
+// regs, access() is called after the instruction touched offset, with
+// write set if it stored to it.
+typedef struct {
+  uintptr_t base;
+  uint32_t size;
+  void (*publish)(volatile uint8_t* regs);
+  void (*access)(volatile uint8_t* regs, uint32_t offset, bool write);
+} hostPeripheral_t;
+
+void hostAddPeripheral(const hostPeripheral_t* peripheral);
+
+// True if the device may read or write len bytes at address (flash, SRAM,
+// its stack and the statics of the program)
+bool hostValidAddress(uint32_t address, uint32_t len);
+
+// Peripheral models, see the individual files
+void portModelInit(void);
+void eicModelLine(uint8_t extint, bool level);
+void spiModelInit(void);
+// Bytes clocked on the SPI bus since hostInit()
+uint64_t spiModelBytes(void);
+void nvmModelInit(void);
+
+// Flash timing in cycles, the SAMD21 datasheet maxima by default
+void nvmModelTiming(uint64_t eraseRow, uint64_t writePage);
+// Flash contents at an offset into the application area
+const uint8_t* nvmModelApplication(void);
+uint32_t nvmModelCapacity(void);
+// Rows erased and pages written since hostInit()
+uint32_t nvmModelErases(void);
+uint32_t nvmModelWrites(void);
+
+// W5500 connection, for the SERCOM and PORT models
+void w5500ModelInit(void);
+void w5500ModelSelect(bool selected);
+uint8_t w5500ModelTransfer(uint8_t mosi);
+
+#endif   // __HOST_H__
@@ -0,0 +1,218 @@
+// Host model of the SAMD21 NVMCTRL and its flash
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  The modelled flash is plain memory, so writes to the page buffer land in
+//  it directly. A shadow copy holds what has really been programmed: WP
+//  compares the two, and the bytes that differ must sit in a single page and
+//  may only clear bits, as NOR flash can't set them without an erase. ER
+//  erases the row ADDR points at. Both keep READY low for their datasheet
+//  time, which is what makes the flash show up in the transfer timings.
+
+#include <stddef.h>
+#include <string.h>
+#include <sam.h>
+#include "host.h"
+
+_Static_assert(offsetof(Nvmctrl, INTFLAG) == 0x14, "NVMCTRL layout");
+_Static_assert(offsetof(Nvmctrl, ADDR) == 0x1C, "NVMCTRL layout");
+
+#define NVM_PAGE_SIZE   (64U)
+#define NVM_ROW_SIZE    (4U * NVM_PAGE_SIZE)
+#define NVM_PAGES       (HOST_FLASH_END / NVM_PAGE_SIZE)
+#define NVM_FLASH_SIZE  (HOST_FLASH_END - HOST_FLASH_START)
+
+static uint8_t shadow[NVM_FLASH_SIZE];
+
+static struct {
+  uint32_t ctrlb;
+  uint32_t addr;
+  bool busy;
+  uint64_t eraseRow;
+  uint64_t writePage;
+  uint32_t erases;
+  uint32_t writes;
+} nvm;
+
+static uint8_t* nvmFlash(void) {
+  return (uint8_t*) HOST_FLASH_START;
+}
+
+static void nvmReady(void* arg) {
+  (void) arg;
+  nvm.busy = false;
+  hostChanged();
+}
+
+static void nvmStart(uint64_t duration) {
+  nvm.busy = true;
+  hostSchedule(hostNow() + duration, nvmReady, NULL);
+}
+
+// First byte the page buffer changed, or NVM_FLASH_SIZE if none
+static uint32_t nvmPending(uint32_t from) {
+  const uint8_t* flash = nvmFlash();
+
+  for (uint32_t i = from; i < NVM_FLASH_SIZE; i++) {
+    if (flash[i] != shadow[i]) {
+      return i;
+    }
+  }
+  return NVM_FLASH_SIZE;
+}
+
+static void nvmWritePage(void) {
+  uint8_t* flash = nvmFlash();
+  uint32_t first = nvmPending(0);
+
+  if (first == NVM_FLASH_SIZE) {
+    // Nothing was loaded, the page is written unchanged
+    nvmStart(nvm.writePage);
+    nvm.writes++;
+    return;
+  }
+
+  uint32_t page = first - first % NVM_PAGE_SIZE;
+  if (nvmPending(page + NVM_PAGE_SIZE) != NVM_FLASH_SIZE) {
+    hostFail("flash page buffer holds data for more than one page (%#x)",
+             (unsigned) (HOST_FLASH_START + page));
+  }
+  for (uint32_t i = page; i < page + NVM_PAGE_SIZE; i++) {
+    if (flash[i] & ~shadow[i]) {
+      hostFail("flash write sets bits that aren't erased at %#x", (unsigned) (HOST_FLASH_START + i));
+    }
+    shadow[i] = flash[i];
+  }
+  nvmStart(nvm.writePage);
+  nvm.writes++;
+}
+
+static void nvmEraseRow(void) {
+  uint32_t address = nvm.addr * 2;
+
+  if (address < HOST_FLASH_START || address >= HOST_FLASH_END) {
+    hostFail("flash erase outside the application area at %#x", (unsigned) address);
+  }
+  if (nvmPending(0) != NVM_FLASH_SIZE) {
+    hostFail("flash erased with the page buffer loaded");
+  }
+
+  uint32_t row = address - HOST_FLASH_START;
+  row -= row % NVM_ROW_SIZE;
+  memset(nvmFlash() + row, 0xFF, NVM_ROW_SIZE);
+  memset(shadow + row, 0xFF, NVM_ROW_SIZE);
+  nvmStart(nvm.eraseRow);
+  nvm.erases++;
+}
+
+static void nvmCommand(uint16_t ctrla) {
+  if ((ctrla & 0xFF00) != NVMCTRL_CTRLA_CMDEX_KEY) {
+    hostFail("NVMCTRL command without the key: %#x", ctrla);
+  }
+  if (nvm.busy) {
+    hostFail("NVMCTRL command while busy: %#x", ctrla);
+  }
+
+  switch (ctrla & 0x7F) {
+    case NVMCTRL_CTRLA_CMD_ER:
+      nvmEraseRow();
+      break;
+    case NVMCTRL_CTRLA_CMD_WP:
+      nvmWritePage();
+      break;
+    case NVMCTRL_CTRLA_CMD_PBC:
+      if (nvmPending(0) != NVM_FLASH_SIZE) {
+        hostFail("flash page buffer cleared before it was written");
+      }
+      break;
+    default:
+      hostFail("NVMCTRL command %#x not modelled", ctrla & 0x7F);
+  }
+}
+
+static void nvmPublish(volatile uint8_t* regs) {
+  volatile Nvmctrl* n = (volatile Nvmctrl*) regs;
+
+  n->CTRLA.reg = 0;
+  n->CTRLB.reg = nvm.ctrlb;
+  n->PARAM.reg = 0;
+  n->PARAM.bit.NVMP = NVM_PAGES;
+  n->PARAM.bit.PSZ = 3;   // 64 byte pages
+  n->INTFLAG.reg = nvm.busy ? 0 : 0x1;
+  n->STATUS = 0;
+  n->ADDR.reg = nvm.addr;
+}
+
+static void nvmAccess(volatile uint8_t* regs, uint32_t offset, bool write) {
+  volatile Nvmctrl* n = (volatile Nvmctrl*) regs;
+
+  if (!write) {
+    return;
+  }
+  switch (offset & ~3U) {
+    case offsetof(Nvmctrl, CTRLA):
+      nvmCommand(n->CTRLA.reg);
+      break;
+    case offsetof(Nvmctrl, CTRLB):
+      nvm.ctrlb = n->CTRLB.reg;
+      break;
+    case offsetof(Nvmctrl, ADDR):
+      nvm.addr = n->ADDR.reg & 0x3FFFFF;
+      break;
+  }
+  hostChanged();
+}
+
+static const hostPeripheral_t nvmModel = {
+  .base = (uintptr_t) NVMCTRL,
+  .size = sizeof(Nvmctrl),
+  .publish = nvmPublish,
+  .access = nvmAccess,
+};
+
+void nvmModelTiming(uint64_t eraseRow, uint64_t writePage) {
+  nvm.eraseRow = eraseRow;
+  nvm.writePage = writePage;
+}
+
+const uint8_t* nvmModelApplication(void) {
+  return nvmFlash();
+}
+
+uint32_t nvmModelCapacity(void) {
+  return NVM_FLASH_SIZE;
+}
+
+uint32_t nvmModelErases(void) {
+  return nvm.erases;
+}
+
+uint32_t nvmModelWrites(void) {
+  return nvm.writes;
+}
+
+void nvmModelInit(void) {
+  memset(nvmFlash(), 0xFF, NVM_FLASH_SIZE);
+  memset(shadow, 0xFF, NVM_FLASH_SIZE);
+  nvm.ctrlb = 0;
+  nvm.addr = 0;
+  nvm.busy = false;
+  nvm.erases = 0;
+  nvm.writes = 0;
+  // Row erase and page write maxima from the SAMD21 datasheet
+  nvmModelTiming(HOST_US(6000), HOST_US(2500));
+  hostAddPeripheral(&nvmModel);
+}
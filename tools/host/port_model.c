@@ -0,0 +1,189 @@
+// Host model of the SAMD21 PORT and EIC, as far as the W5500's CS and
+// INTn pins go
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include <stddef.h>
+#include <sam.h>
+#include "host.h"
+#include "board_definitions.h"
+
+_Static_assert(offsetof(PortGroup, OUTSET) == 0x18, "PORT layout");
+_Static_assert(offsetof(PortGroup, PINCFG) == 0x40, "PORT layout");
+_Static_assert(sizeof(PortGroup) == 0x80, "PORT layout");
+_Static_assert(offsetof(Eic, INTFLAG) == 0x10, "EIC layout");
+_Static_assert(offsetof(Eic, CONFIG) == 0x18, "EIC layout");
+
+static struct {
+  uint32_t dir;
+  uint32_t out;
+} groups[2];
+
+// CS level last seen by the W5500
+static bool csHigh;
+
+static void portUpdatePins(void) {
+  uint32_t pin = 1UL << W5X00_CS_PIN;
+  const uint32_t dir = groups[W5X00_CS_PORT].dir;
+  const uint32_t out = groups[W5X00_CS_PORT].out;
+
+  // Not driven, the line idles high
+  bool high = !(dir & pin) || (out & pin);
+  if (high != csHigh) {
+    csHigh = high;
+    w5500ModelSelect(!high);
+    hostChanged();
+  }
+}
+
+static void portPublish(volatile uint8_t* regs) {
+  volatile Port* port = (volatile Port*) regs;
+
+  for (uint8_t i = 0; i < 2; i++) {
+    volatile PortGroup* group = &port->Group[i];
+    group->DIR.reg = groups[i].dir;
+    group->DIRCLR.reg = groups[i].dir;
+    group->DIRSET.reg = groups[i].dir;
+    group->DIRTGL.reg = groups[i].dir;
+    group->OUT.reg = groups[i].out;
+    group->OUTCLR.reg = groups[i].out;
+    group->OUTSET.reg = groups[i].out;
+    group->OUTTGL.reg = groups[i].out;
+    *(volatile uint32_t*) &group->IN.reg = groups[i].out & groups[i].dir;
+  }
+}
+
+static void portAccess(volatile uint8_t* regs, uint32_t offset, bool write) {
+  if (!write) {
+    return;
+  }
+
+  uint8_t i = offset / sizeof(PortGroup);
+  uint32_t reg = offset % sizeof(PortGroup);
+  if (i > 1 || reg >= offsetof(PortGroup, IN)) {
+    // Pin configuration and multiplexing are plain memory
+    return;
+  }
+
+  uint32_t value = *(volatile uint32_t*) (regs + offset - (offset & 3));
+  switch (reg & ~3U) {
+    case offsetof(PortGroup, DIR):    groups[i].dir = value; break;
+    case offsetof(PortGroup, DIRCLR): groups[i].dir &= ~value; break;
+    case offsetof(PortGroup, DIRSET): groups[i].dir |= value; break;
+    case offsetof(PortGroup, DIRTGL): groups[i].dir ^= value; break;
+    case offsetof(PortGroup, OUT):    groups[i].out = value; break;
+    case offsetof(PortGroup, OUTCLR): groups[i].out &= ~value; break;
+    case offsetof(PortGroup, OUTSET): groups[i].out |= value; break;
+    case offsetof(PortGroup, OUTTGL): groups[i].out ^= value; break;
+  }
+  portUpdatePins();
+}
+
+static const hostPeripheral_t portModel = {
+  .base = (uintptr_t) PORT,
+  .size = sizeof(Port),
+  .publish = portPublish,
+  .access = portAccess,
+};
+
+// EIC, edge detection only
+#define EIC_LINES (16)
+#define EIC_SENSE_RISE (1)
+#define EIC_SENSE_FALL (2)
+#define EIC_SENSE_BOTH (3)
+
+static struct {
+  uint8_t ctrl;
+  uint32_t intflag;
+  uint32_t config[2];
+  uint16_t levels;
+} eic;
+
+static void eicPublish(volatile uint8_t* regs) {
+  volatile Eic* e = (volatile Eic*) regs;
+
+  e->CTRL.reg = eic.ctrl;
+  e->STATUS.reg = 0;
+  e->INTFLAG.reg = eic.intflag;
+  e->CONFIG[0].reg = eic.config[0];
+  e->CONFIG[1].reg = eic.config[1];
+}
+
+static void eicAccess(volatile uint8_t* regs, uint32_t offset, bool write) {
+  volatile Eic* e = (volatile Eic*) regs;
+
+  if (!write) {
+    return;
+  }
+  switch (offset & ~3U) {
+    case offsetof(Eic, CTRL):
+      eic.ctrl = e->CTRL.reg & EIC_CTRL_ENABLE;
+      if (e->CTRL.reg & 0x1) {
+        eic.ctrl = 0;
+        eic.intflag = 0;
+        eic.config[0] = eic.config[1] = 0;
+      }
+      break;
+    case offsetof(Eic, INTFLAG):
+      eic.intflag &= ~e->INTFLAG.reg;
+      break;
+    case offsetof(Eic, CONFIG[0]):
+      eic.config[0] = e->CONFIG[0].reg;
+      break;
+    case offsetof(Eic, CONFIG[1]):
+      eic.config[1] = e->CONFIG[1].reg;
+      break;
+  }
+  hostChanged();
+}
+
+void eicModelLine(uint8_t extint, bool level) {
+  uint16_t bit = 1 << extint;
+  bool was = (eic.levels & bit) != 0;
+  if (level == was) {
+    return;
+  }
+  eic.levels ^= bit;
+
+  // The flag latches even with the interrupt disabled
+  uint8_t sense = (eic.config[extint / 8] >> (4 * (extint % 8))) & 0x7;
+  if ((eic.ctrl & EIC_CTRL_ENABLE) &&
+      ((sense == EIC_SENSE_FALL && !level) || (sense == EIC_SENSE_RISE && level) || sense == EIC_SENSE_BOTH)) {
+    eic.intflag |= bit;
+    hostChanged();
+  }
+}
+
+static const hostPeripheral_t eicModel = {
+  .base = (uintptr_t) EIC,
+  .size = sizeof(Eic),
+  .publish = eicPublish,
+  .access = eicAccess,
+};
+
+void portModelInit(void) {
+  groups[0].dir = groups[0].out = 0;
+  groups[1].dir = groups[1].out = 0;
+  csHigh = true;
+  hostAddPeripheral(&portModel);
+
+  eic.ctrl = 0;
+  eic.intflag = 0;
+  eic.config[0] = eic.config[1] = 0;
+  // Pulled up lines
+  eic.levels = 0xFFFF;
+  hostAddPeripheral(&eicModel);
+}
@@ -0,0 +1,402 @@
+// Host stand-in for the SAMD21 device header
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  Only what the network, SPI and flash code uses, with the SAMD21G18A
+//  register layout at the real addresses. host.c maps those addresses and
+//  hands every access to the peripheral models, so the bootloader sources
+//  build unchanged. Only the Feather M0 board definitions are covered.
+
+#ifndef __HOST_SAM_H__
+#define __HOST_SAM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define __I  volatile const
+#define __O  volatile
+#define __IO volatile
+
+// SERCOM in SPI master mode
+typedef union {
+  struct {
+    uint32_t SWRST:1;
+    uint32_t ENABLE:1;
+    uint32_t MODE:3;
+    uint32_t :2;
+    uint32_t RUNSTDBY:1;
+    uint32_t IBON:1;
+    uint32_t :7;
+    uint32_t DOPO:2;
+    uint32_t :2;
+    uint32_t DIPO:2;
+    uint32_t :2;
+    uint32_t FORM:4;
+    uint32_t CPHA:1;
+    uint32_t CPOL:1;
+    uint32_t DORD:1;
+    uint32_t :1;
+  } bit;
+  uint32_t reg;
+} SERCOM_SPI_CTRLA_Type;
+
+typedef union {
+  struct {
+    uint32_t CHSIZE:3;
+    uint32_t :3;
+    uint32_t PLOADEN:1;
+    uint32_t :2;
+    uint32_t SSDE:1;
+    uint32_t :3;
+    uint32_t MSSEN:1;
+    uint32_t AMODE:2;
+    uint32_t :1;
+    uint32_t RXEN:1;
+    uint32_t :14;
+  } bit;
+  uint32_t reg;
+} SERCOM_SPI_CTRLB_Type;
+
+typedef union {
+  struct {
+    uint8_t DRE:1;
+    uint8_t TXC:1;
+    uint8_t RXC:1;
+    uint8_t SSL:1;
+    uint8_t :3;
+    uint8_t ERROR:1;
+  } bit;
+  uint8_t reg;
+} SERCOM_SPI_INTFLAG_Type;
+
+typedef union {
+  struct {
+    uint16_t :2;
+    uint16_t BUFOVF:1;
+    uint16_t :13;
+  } bit;
+  uint16_t reg;
+} SERCOM_SPI_STATUS_Type;
+
+typedef union {
+  struct {
+    uint32_t SWRST:1;
+    uint32_t ENABLE:1;
+    uint32_t CTRLB:1;
+    uint32_t :29;
+  } bit;
+  uint32_t reg;
+} SERCOM_SPI_SYNCBUSY_Type;
+
+typedef union {
+  struct {
+    uint32_t DATA:9;
+    uint32_t :23;
+  } bit;
+  uint32_t reg;
+} SERCOM_SPI_DATA_Type;
+
+typedef union {
+  uint8_t reg;
+} SERCOM_SPI_BAUD_Type;
+
+typedef struct {
+  __IO SERCOM_SPI_CTRLA_Type    CTRLA;     // 0x00
+  __IO SERCOM_SPI_CTRLB_Type    CTRLB;     // 0x04
+  uint8_t                       Reserved1[4];
+  __IO SERCOM_SPI_BAUD_Type     BAUD;      // 0x0C
+  uint8_t                       Reserved2[7];
+  __IO uint8_t                  INTENCLR;  // 0x14
+  uint8_t                       Reserved3[1];
+  __IO uint8_t                  INTENSET;  // 0x16
+  uint8_t                       Reserved4[1];
+  __IO SERCOM_SPI_INTFLAG_Type  INTFLAG;   // 0x18
+  uint8_t                       Reserved5[1];
+  __IO SERCOM_SPI_STATUS_Type   STATUS;    // 0x1A
+  __I  SERCOM_SPI_SYNCBUSY_Type SYNCBUSY;  // 0x1C
+  uint8_t                       Reserved6[4];
+  __IO uint32_t                 ADDR;      // 0x24
+  __IO SERCOM_SPI_DATA_Type     DATA;      // 0x28
+} SercomSpi;
+
+typedef union {
+  SercomSpi SPI;
+} Sercom;
+
+#define SERCOM_SPI_CTRLA_MODE_SPI_MASTER (0x3u << 2)
+#define SERCOM_SPI_CTRLA_DOPO(value)     ((uint32_t)(value) << 16)
+#define SERCOM_SPI_CTRLA_DIPO(value)     ((uint32_t)(value) << 20)
+#define SERCOM_SPI_CTRLB_RXEN            (0x1u << 17)
+#define SERCOM_SPI_INTFLAG_DRE           (0x1u << 0)
+#define SERCOM_SPI_INTFLAG_TXC           (0x1u << 1)
+#define SERCOM_SPI_INTFLAG_RXC           (0x1u << 2)
+
+// PORT
+typedef union {
+  struct {
+    uint8_t PMUXEN:1;
+    uint8_t INEN:1;
+    uint8_t PULLEN:1;
+    uint8_t :3;
+    uint8_t DRVSTR:1;
+    uint8_t :1;
+  } bit;
+  uint8_t reg;
+} PORT_PINCFG_Type;
+
+typedef union {
+  uint8_t reg;
+} PORT_PMUX_Type;
+
+typedef union {
+  uint32_t reg;
+} PORT_REG_Type;
+
+typedef struct {
+  __IO PORT_REG_Type    DIR;         // 0x00
+  __IO PORT_REG_Type    DIRCLR;      // 0x04
+  __IO PORT_REG_Type    DIRSET;      // 0x08
+  __IO PORT_REG_Type    DIRTGL;      // 0x0C
+  __IO PORT_REG_Type    OUT;         // 0x10
+  __IO PORT_REG_Type    OUTCLR;      // 0x14
+  __IO PORT_REG_Type    OUTSET;      // 0x18
+  __IO PORT_REG_Type    OUTTGL;      // 0x1C
+  __I  PORT_REG_Type    IN;          // 0x20
+  __IO PORT_REG_Type    CTRL;        // 0x24
+  __O  PORT_REG_Type    WRCONFIG;    // 0x28
+  uint8_t               Reserved1[4];
+  __IO PORT_PMUX_Type   PMUX[16];    // 0x30
+  __IO PORT_PINCFG_Type PINCFG[32];  // 0x40
+  uint8_t               Reserved2[32];
+} PortGroup;
+
+typedef struct {
+  PortGroup Group[2];
+} Port;
+
+#define PORT_PINCFG_PMUXEN (0x1u << 0)
+#define PORT_PINCFG_INEN   (0x1u << 1)
+
+// PM, only the clock masks
+typedef struct {
+  uint8_t                 Reserved1[0x14];
+  __IO union { uint32_t reg; } AHBMASK;   // 0x14
+  __IO union { uint32_t reg; } APBAMASK;  // 0x18
+  __IO union { uint32_t reg; } APBBMASK;  // 0x1C
+  __IO union { uint32_t reg; } APBCMASK;  // 0x20
+} Pm;
+
+#define PM_AHBMASK_DMAC     (0x1u << 5)
+#define PM_APBAMASK_EIC     (0x1u << 6)
+#define PM_APBBMASK_DMAC    (0x1u << 4)
+#define PM_APBCMASK_SERCOM3 (0x1u << 5)
+#define PM_APBCMASK_SERCOM4 (0x1u << 6)
+
+// GCLK
+typedef struct {
+  __IO union { uint8_t reg; }  CTRL;     // 0x0
+  __IO union { uint8_t reg; }  STATUS;   // 0x1
+  __IO union { uint16_t reg; } CLKCTRL;  // 0x2
+  __IO union { uint32_t reg; } GENCTRL;  // 0x4
+  __IO union { uint32_t reg; } GENDIV;   // 0x8
+} Gclk;
+
+#define GCLK_CLKCTRL_ID(value)           ((uint16_t)(value) & 0x3F)
+#define GCLK_CLKCTRL_GEN_GCLK0           (0x0u << 8)
+#define GCLK_CLKCTRL_CLKEN               (0x1u << 14)
+#define GCLK_STATUS_SYNCBUSY             (0x1u << 7)
+#define GCLK_CLKCTRL_ID_EIC_Val          0x5
+#define GCLK_CLKCTRL_ID_SERCOM3_CORE_Val 0x17
+#define GCLK_CLKCTRL_ID_SERCOM4_CORE_Val 0x18
+
+// EIC
+typedef struct {
+  __IO union { uint8_t reg; } CTRL;        // 0x00
+  __IO union { uint8_t reg; } STATUS;      // 0x01
+  uint8_t                Reserved1[0x0E];
+  __IO union { uint32_t reg; } INTFLAG;    // 0x10
+  uint8_t                Reserved2[4];
+  __IO union { uint32_t reg; } CONFIG[2];  // 0x18
+} Eic;
+
+#define EIC_CTRL_ENABLE            (0x1u << 1)
+#define EIC_STATUS_SYNCBUSY        (0x1u << 7)
+#define EIC_CONFIG_SENSE0_FALL_Val 0x2
+
+// NVMCTRL
+typedef union {
+  struct {
+    uint16_t CMD:7;
+    uint16_t :1;
+    uint16_t CMDEX:8;
+  } bit;
+  uint16_t reg;
+} NVMCTRL_CTRLA_Type;
+
+typedef union {
+  struct {
+    uint32_t :1;
+    uint32_t RWS:4;
+    uint32_t :2;
+    uint32_t MANW:1;
+    uint32_t SLEEPPRM:2;
+    uint32_t :6;
+    uint32_t READMODE:2;
+    uint32_t CACHEDIS:1;
+    uint32_t :13;
+  } bit;
+  uint32_t reg;
+} NVMCTRL_CTRLB_Type;
+
+typedef union {
+  struct {
+    uint32_t NVMP:16;
+    uint32_t PSZ:3;
+    uint32_t :13;
+  } bit;
+  uint32_t reg;
+} NVMCTRL_PARAM_Type;
+
+typedef union {
+  struct {
+    uint8_t READY:1;
+    uint8_t ERROR:1;
+    uint8_t :6;
+  } bit;
+  uint8_t reg;
+} NVMCTRL_INTFLAG_Type;
+
+typedef struct {
+  __IO NVMCTRL_CTRLA_Type   CTRLA;     // 0x00
+  uint8_t                   Reserved1[2];
+  __IO NVMCTRL_CTRLB_Type   CTRLB;     // 0x04
+  __IO NVMCTRL_PARAM_Type   PARAM;     // 0x08
+  __IO uint8_t              INTENCLR;  // 0x0C
+  uint8_t                   Reserved2[3];
+  __IO uint8_t              INTENSET;  // 0x10
+  uint8_t                   Reserved3[3];
+  __IO NVMCTRL_INTFLAG_Type INTFLAG;   // 0x14
+  uint8_t                   Reserved4[3];
+  __IO uint16_t             STATUS;    // 0x18
+  uint8_t                   Reserved5[2];
+  __IO union { uint32_t reg; }   ADDR;      // 0x1C
+} Nvmctrl;
+
+#define NVMCTRL_CTRLA_CMDEX_KEY (0xA5u << 8)
+#define NVMCTRL_CTRLA_CMD_ER    (0x02u)
+#define NVMCTRL_CTRLA_CMD_WP    (0x04u)
+#define NVMCTRL_CTRLA_CMD_PBC   (0x44u)
+
+// DMAC
+typedef struct {
+  __IO union { uint16_t reg; } CTRL;        // 0x00
+  uint8_t                 Reserved1[0x32];
+  __IO union { uint32_t reg; } BASEADDR;    // 0x34
+  __IO union { uint32_t reg; } WRBADDR;     // 0x38
+  uint8_t                 Reserved2[3];
+  __IO union { uint8_t reg; }  CHID;        // 0x3F
+  __IO union { uint8_t reg; }  CHCTRLA;     // 0x40
+  uint8_t                 Reserved3[3];
+  __IO union { uint32_t reg; } CHCTRLB;     // 0x44
+  uint8_t                 Reserved4[4];
+  __IO union { uint8_t reg; }  CHINTENCLR;  // 0x4C
+  __IO union { uint8_t reg; }  CHINTENSET;  // 0x4D
+  __IO union { uint8_t reg; }  CHINTFLAG;   // 0x4E
+  __IO union { uint8_t reg; }  CHSTATUS;    // 0x4F
+} Dmac;
+
+typedef struct {
+  __IO union { uint16_t reg; } BTCTRL;    // 0x00
+  __IO union { uint16_t reg; } BTCNT;     // 0x02
+  __IO union { uint32_t reg; } SRCADDR;   // 0x04
+  __IO union { uint32_t reg; } DSTADDR;   // 0x08
+  __IO union { uint32_t reg; } DESCADDR;  // 0x0C
+} DmacDescriptor;
+
+#define DMAC_CTRL_SWRST            (0x1u << 0)
+#define DMAC_CTRL_DMAENABLE        (0x1u << 1)
+#define DMAC_CTRL_LVLEN(value)     ((uint16_t)((value) & 0xF) << 8)
+#define DMAC_CHID_ID(value)        ((uint8_t)(value) & 0xF)
+#define DMAC_CHCTRLA_SWRST         (0x1u << 0)
+#define DMAC_CHCTRLA_ENABLE        (0x1u << 1)
+#define DMAC_CHCTRLB_LVL(value)    ((uint32_t)((value) & 0x3) << 5)
+#define DMAC_CHCTRLB_TRIGSRC(value) ((uint32_t)((value) & 0x3F) << 8)
+#define DMAC_CHCTRLB_TRIGACT_BEAT  (0x2u << 22)
+#define DMAC_CHINTFLAG_TERR        (0x1u << 0)
+#define DMAC_CHINTFLAG_TCMPL       (0x1u << 1)
+#define DMAC_CHINTFLAG_SUSP        (0x1u << 2)
+#define DMAC_BTCTRL_VALID          (0x1u << 0)
+#define DMAC_BTCTRL_BEATSIZE_BYTE  (0x0u << 8)
+#define DMAC_BTCTRL_SRCINC         (0x1u << 10)
+#define DMAC_BTCTRL_DSTINC         (0x1u << 11)
+
+// DMAC trigger sources
+#define SERCOM4_DMAC_ID_RX 0x09
+#define SERCOM4_DMAC_ID_TX 0x0A
+
+// Core
+typedef struct {
+  __IO uint32_t CTRL;
+  __IO uint32_t LOAD;
+  __IO uint32_t VAL;
+  __I  uint32_t CALIB;
+} SysTick_Type;
+
+typedef struct {
+  __I  uint32_t CPUID;
+  __IO uint32_t ICSR;
+  __IO uint32_t VTOR;
+  __IO uint32_t AIRCR;
+} SCB_Type;
+
+#define SCB_VTOR_TBLOFF_Msk (0xFFFFFF80u)
+
+// Pin multiplexing of the Feather M0 SPI and I2C pins
+#define PINMUX_PA12D_SERCOM4_PAD0 ((12u << 16) | 0x3)
+#define PINMUX_PB10D_SERCOM4_PAD2 ((42u << 16) | 0x3)
+#define PINMUX_PB11D_SERCOM4_PAD3 ((43u << 16) | 0x3)
+#define PINMUX_PA22C_SERCOM3_PAD0 ((22u << 16) | 0x2)
+#define PINMUX_PA23C_SERCOM3_PAD1 ((23u << 16) | 0x2)
+
+// Peripheral addresses
+#define PM       ((Pm *) 0x40000400UL)
+#define GCLK     ((Gclk *) 0x40000C00UL)
+#define EIC      ((Eic *) 0x40001800UL)
+#define NVMCTRL  ((Nvmctrl *) 0x41004000UL)
+#define PORT     ((Port *) 0x41004400UL)
+#define DMAC     ((Dmac *) 0x41004800UL)
+#define SERCOM3  ((Sercom *) 0x42001400UL)
+#define SERCOM4  ((Sercom *) 0x42001800UL)
+#define SysTick  ((SysTick_Type *) 0xE000E010UL)
+#define SCB      ((SCB_Type *) 0xE000ED00UL)
+
+// A reset ends the run, see hostRun()
+void hostSystemReset(void) __attribute__ ((noreturn));
+
+static inline void NVIC_SystemReset(void) {
+  hostSystemReset();
+}
+
+static inline void __set_MSP(uint32_t topOfMainStack) {
+  (void) topOfMainStack;
+}
+
+// jumpToApplication() branches with inline Thumb assembly. The host never
+// gets there (startApplication() resets instead), it only has to build.
+#define asm(...) ((void) 0)
+
+#endif   // __HOST_SAM_H__
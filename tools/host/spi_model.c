@@ -0,0 +1,464 @@
+// Host model of the SAMD21 SERCOM in SPI master mode and of the DMAC
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  The SERCOM has a holding register in front of the shifter and a two
+//  byte receive buffer, and takes 16 * (BAUD + 1) cycles per byte. Every
+//  byte shifted is exchanged with the W5500 model. The DMAC runs beat
+//  transfers triggered by the SERCOM, with the descriptor semantics of the
+//  datasheet: incrementing addresses point at the end of the block, the
+//  channel disables itself and sets TCMPL when BTCNT beats are done. Anything
+//  the real parts would silently get wrong (a receive overflow, DATA written
+//  while DRE is clear, a misaligned descriptor table) fails the test.
+
+#include <stddef.h>
+#include <sam.h>
+#include "host.h"
+#include "board_definitions.h"
+
+_Static_assert(offsetof(SercomSpi, INTFLAG) == 0x18, "SERCOM layout");
+_Static_assert(offsetof(SercomSpi, DATA) == 0x28, "SERCOM layout");
+_Static_assert(offsetof(Dmac, CHCTRLB) == 0x44, "DMAC layout");
+_Static_assert(offsetof(Dmac, CHSTATUS) == 0x4F, "DMAC layout");
+_Static_assert(sizeof(DmacDescriptor) == 16, "DMAC layout");
+
+#define SPI_RX_BUFFER   (2U)
+#define SPI_DATA_ADDR   ((uint32_t) (uintptr_t) &SPI_SERCOM->SPI.DATA.reg)
+
+#define DMAC_CHANNELS   (12U)
+#define DMAC_TRIGACT_MASK (0x3u << 22)
+
+static struct {
+  uint32_t ctrla;
+  uint32_t ctrlb;
+  uint8_t baud;
+  uint8_t txc;
+  uint16_t status;
+
+  // Transmit side: the holding register (DATA) and the shifter
+  bool holdingFull;
+  uint8_t holding;
+  bool shifting;
+  uint8_t shifter;
+
+  uint8_t rx[SPI_RX_BUFFER];
+  uint8_t rxCount;
+
+  // Bumped on reset and disable, so byte events already scheduled are dropped
+  uint32_t generation;
+
+  uint64_t bytes;
+} spi;
+
+typedef struct {
+  bool enabled;
+  uint32_t chctrlb;
+  uint8_t flags;
+  DmacDescriptor descriptor;
+  uint16_t beats;
+} dmacChannel_t;
+
+static struct {
+  uint16_t ctrl;
+  uint32_t baseaddr;
+  uint32_t wrbaddr;
+  uint8_t chid;
+  dmacChannel_t channels[DMAC_CHANNELS];
+} dmac;
+
+static void dmacService(void);
+
+static bool spiEnabled(void) {
+  return (spi.ctrla & 0x2) != 0;
+}
+
+static void spiByteDone(void* arg);
+
+static void spiShift(uint8_t value) {
+  spi.shifter = value;
+  spi.shifting = true;
+  spi.txc = 0;
+  hostSchedule(hostNow() + 16ULL * (spi.baud + 1U), spiByteDone,
+               (void*) (uintptr_t) spi.generation);
+}
+
+static void spiByteDone(void* arg) {
+  if ((uint32_t) (uintptr_t) arg != spi.generation) {
+    return;
+  }
+
+  uint8_t miso = w5500ModelTransfer(spi.shifter);
+  spi.bytes++;
+  if (spi.ctrlb & SERCOM_SPI_CTRLB_RXEN) {
+    if (spi.rxCount == SPI_RX_BUFFER) {
+      hostFail("SERCOM receive buffer overflow");
+    }
+    spi.rx[spi.rxCount++] = miso;
+  }
+
+  spi.shifting = false;
+  if (spi.holdingFull) {
+    spi.holdingFull = false;
+    spiShift(spi.holding);
+  } else {
+    spi.txc = 1;
+  }
+  hostChanged();
+  dmacService();
+}
+
+static void spiWriteData(uint8_t value) {
+  if (!spiEnabled()) {
+    hostFail("SERCOM DATA written while disabled");
+  }
+  if (spi.holdingFull) {
+    hostFail("SERCOM DATA written while DRE is clear");
+  }
+  if (spi.shifting) {
+    spi.holding = value;
+    spi.holdingFull = true;
+  } else {
+    spiShift(value);
+  }
+  hostChanged();
+}
+
+static uint8_t spiReadData(void) {
+  uint8_t value = spi.rx[0];
+
+  if (spi.rxCount) {
+    spi.rx[0] = spi.rx[1];
+    spi.rxCount--;
+    hostChanged();
+  }
+  return value;
+}
+
+static void spiStop(void) {
+  spi.generation++;
+  spi.holdingFull = false;
+  spi.shifting = false;
+  spi.rxCount = 0;
+  spi.txc = 0;
+}
+
+static void spiPublish(volatile uint8_t* regs) {
+  volatile SercomSpi* s = &((volatile Sercom*) regs)->SPI;
+
+  s->CTRLA.reg = spi.ctrla;
+  s->CTRLB.reg = spi.ctrlb;
+  s->BAUD.reg = spi.baud;
+  s->INTFLAG.reg = (spiEnabled() && !spi.holdingFull ? SERCOM_SPI_INTFLAG_DRE : 0) |
+                   (spi.txc ? SERCOM_SPI_INTFLAG_TXC : 0) |
+                   (spi.rxCount ? SERCOM_SPI_INTFLAG_RXC : 0);
+  s->STATUS.reg = spi.status;
+  *(volatile uint32_t*) &s->SYNCBUSY.reg = 0;
+  s->DATA.reg = spi.rx[0];
+}
+
+static void spiAccess(volatile uint8_t* regs, uint32_t offset, bool write) {
+  volatile SercomSpi* s = &((volatile Sercom*) regs)->SPI;
+
+  if (offset >= offsetof(SercomSpi, DATA) && offset < offsetof(SercomSpi, DATA) + 4) {
+    if (write) {
+      spiWriteData(s->DATA.reg);
+    } else {
+      spiReadData();
+    }
+    dmacService();
+    return;
+  }
+  if (!write) {
+    return;
+  }
+
+  switch (offset) {
+    case offsetof(SercomSpi, CTRLA):
+    case offsetof(SercomSpi, CTRLA) + 1:
+    case offsetof(SercomSpi, CTRLA) + 2:
+    case offsetof(SercomSpi, CTRLA) + 3:
+      if (s->CTRLA.bit.SWRST) {
+        spiStop();
+        spi.ctrla = spi.ctrlb = 0;
+        spi.baud = 0;
+        spi.status = 0;
+      } else {
+        bool wasEnabled = spiEnabled();
+        spi.ctrla = s->CTRLA.reg;
+        if (wasEnabled && !spiEnabled()) {
+          spiStop();
+        }
+      }
+      break;
+    case offsetof(SercomSpi, CTRLB):
+    case offsetof(SercomSpi, CTRLB) + 2:
+      spi.ctrlb = s->CTRLB.reg;
+      break;
+    case offsetof(SercomSpi, BAUD):
+      // Enable protected, the write is ignored
+      if (!spiEnabled()) {
+        spi.baud = s->BAUD.reg;
+      }
+      break;
+    case offsetof(SercomSpi, INTFLAG):
+      if (s->INTFLAG.reg & SERCOM_SPI_INTFLAG_TXC) {
+        spi.txc = 0;
+      }
+      break;
+    case offsetof(SercomSpi, STATUS):
+      spi.status &= ~s->STATUS.reg;
+      break;
+  }
+  hostChanged();
+  dmacService();
+}
+
+static const hostPeripheral_t spiModel = {
+  .base = (uintptr_t) SPI_SERCOM,
+  .size = sizeof(SercomSpi),
+  .publish = spiPublish,
+  .access = spiAccess,
+};
+
+uint64_t spiModelBytes(void) {
+  return spi.bytes;
+}
+
+// DMAC
+static void dmacError(dmacChannel_t* channel) {
+  channel->flags |= DMAC_CHINTFLAG_TERR;
+  channel->enabled = false;
+}
+
+static void dmacWriteback(uint8_t ch) {
+  uint32_t address = dmac.wrbaddr + ch * sizeof(DmacDescriptor);
+
+  if (!hostValidAddress(address, sizeof(DmacDescriptor))) {
+    hostFail("DMAC write-back section at %#x", address);
+  }
+  DmacDescriptor* writeback = (DmacDescriptor*) (uintptr_t) address;
+  *writeback = dmac.channels[ch].descriptor;
+  writeback->BTCNT.reg = dmac.channels[ch].descriptor.BTCNT.reg - dmac.channels[ch].beats;
+}
+
+static void dmacEnable(uint8_t ch) {
+  dmacChannel_t* channel = &dmac.channels[ch];
+  uint32_t address = dmac.baseaddr + ch * sizeof(DmacDescriptor);
+
+  if ((channel->chctrlb & DMAC_TRIGACT_MASK) != DMAC_CHCTRLB_TRIGACT_BEAT) {
+    hostFail("DMAC channel %u: only beat triggers are modelled", ch);
+  }
+  if (!hostValidAddress(address, sizeof(DmacDescriptor))) {
+    hostFail("DMAC descriptor section at %#x", address);
+  }
+  channel->descriptor = *(DmacDescriptor*) (uintptr_t) address;
+  channel->beats = 0;
+  channel->enabled = true;
+
+  if (!(channel->descriptor.BTCTRL.reg & DMAC_BTCTRL_VALID)) {
+    dmacError(channel);
+  } else if ((channel->descriptor.BTCTRL.reg & (0x3u << 8)) != DMAC_BTCTRL_BEATSIZE_BYTE) {
+    hostFail("DMAC channel %u: only byte beats are modelled", ch);
+  } else if (channel->descriptor.DESCADDR.reg) {
+    hostFail("DMAC channel %u: linked descriptors are not modelled", ch);
+  }
+  dmacWriteback(ch);
+}
+
+// Address of the current beat. Incrementing addresses are the end of the block.
+static uint32_t dmacBeatAddress(dmacChannel_t* channel, uint32_t address, bool increment) {
+  if (!increment) {
+    return address;
+  }
+  return address - channel->descriptor.BTCNT.reg + channel->beats;
+}
+
+static bool dmacRead(uint32_t address, uint8_t* value) {
+  if (address == SPI_DATA_ADDR) {
+    *value = spiReadData();
+  } else if (hostValidAddress(address, 1)) {
+    *value = *(volatile uint8_t*) (uintptr_t) address;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool dmacWrite(uint32_t address, uint8_t value) {
+  if (address == SPI_DATA_ADDR) {
+    spiWriteData(value);
+  } else if (hostValidAddress(address, 1)) {
+    *(volatile uint8_t*) (uintptr_t) address = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void dmacBeat(uint8_t ch) {
+  dmacChannel_t* channel = &dmac.channels[ch];
+  uint16_t btctrl = channel->descriptor.BTCTRL.reg;
+  uint32_t src = dmacBeatAddress(channel, channel->descriptor.SRCADDR.reg, btctrl & DMAC_BTCTRL_SRCINC);
+  uint32_t dst = dmacBeatAddress(channel, channel->descriptor.DSTADDR.reg, btctrl & DMAC_BTCTRL_DSTINC);
+  uint8_t value;
+
+  if (!dmacRead(src, &value) || !dmacWrite(dst, value)) {
+    dmacError(channel);
+    dmacWriteback(ch);
+    hostChanged();
+    return;
+  }
+
+  if (++channel->beats == channel->descriptor.BTCNT.reg) {
+    channel->flags |= DMAC_CHINTFLAG_TCMPL;
+    channel->enabled = false;
+    dmacWriteback(ch);
+  }
+  hostChanged();
+}
+
+// Run every beat the SERCOM has a trigger pending for, lowest channel first
+static void dmacService(void) {
+  bool progress = true;
+
+  while (progress && (dmac.ctrl & DMAC_CTRL_DMAENABLE)) {
+    progress = false;
+    for (uint8_t ch = 0; ch < DMAC_CHANNELS && !progress; ch++) {
+      dmacChannel_t* channel = &dmac.channels[ch];
+      if (!channel->enabled) {
+        continue;
+      }
+
+      uint8_t trigger = (channel->chctrlb >> 8) & 0x3F;
+      if ((trigger == SPI_DMAC_RX_TRIGGER && spi.rxCount) ||
+          (trigger == SPI_DMAC_TX_TRIGGER && spiEnabled() && !spi.holdingFull)) {
+        dmacBeat(ch);
+        progress = true;
+      }
+    }
+  }
+}
+
+static void dmacReset(void) {
+  for (uint8_t ch = 0; ch < DMAC_CHANNELS; ch++) {
+    dmacChannel_t empty = { 0 };
+    dmac.channels[ch] = empty;
+  }
+  dmac.ctrl = 0;
+  dmac.baseaddr = dmac.wrbaddr = 0;
+  dmac.chid = 0;
+}
+
+static void dmacPublish(volatile uint8_t* regs) {
+  volatile Dmac* d = (volatile Dmac*) regs;
+  dmacChannel_t* channel = &dmac.channels[dmac.chid];
+
+  d->CTRL.reg = dmac.ctrl;
+  d->BASEADDR.reg = dmac.baseaddr;
+  d->WRBADDR.reg = dmac.wrbaddr;
+  d->CHID.reg = dmac.chid;
+  d->CHCTRLA.reg = channel->enabled ? DMAC_CHCTRLA_ENABLE : 0;
+  d->CHCTRLB.reg = channel->chctrlb;
+  d->CHINTFLAG.reg = channel->flags;
+  // BUSY while a block is in progress
+  d->CHSTATUS.reg = channel->enabled ? 0x2 : 0;
+}
+
+static void dmacAccess(volatile uint8_t* regs, uint32_t offset, bool write) {
+  volatile Dmac* d = (volatile Dmac*) regs;
+  dmacChannel_t* channel = &dmac.channels[dmac.chid];
+
+  if (!write) {
+    return;
+  }
+
+  switch (offset) {
+    case offsetof(Dmac, CTRL):
+    case offsetof(Dmac, CTRL) + 1:
+      if (d->CTRL.reg & DMAC_CTRL_SWRST) {
+        if (dmac.ctrl & DMAC_CTRL_DMAENABLE) {
+          hostFail("DMAC reset while enabled");
+        }
+        dmacReset();
+      } else {
+        dmac.ctrl = d->CTRL.reg;
+      }
+      break;
+    case offsetof(Dmac, BASEADDR):
+    case offsetof(Dmac, WRBADDR):
+      if (dmac.ctrl & DMAC_CTRL_DMAENABLE) {
+        hostFail("DMAC descriptor addresses written while enabled");
+      }
+      if ((offset == offsetof(Dmac, BASEADDR) ? d->BASEADDR.reg : d->WRBADDR.reg) & 0xF) {
+        hostFail("DMAC descriptor section not 128 bit aligned");
+      }
+      dmac.baseaddr = d->BASEADDR.reg;
+      dmac.wrbaddr = d->WRBADDR.reg;
+      break;
+    case offsetof(Dmac, CHID):
+      // Selecting the same channel again changes nothing a poll could see
+      if (d->CHID.reg % DMAC_CHANNELS == dmac.chid) {
+        return;
+      }
+      dmac.chid = d->CHID.reg % DMAC_CHANNELS;
+      break;
+    case offsetof(Dmac, CHCTRLA):
+      if (d->CHCTRLA.reg & DMAC_CHCTRLA_SWRST) {
+        // Only takes effect on a disabled channel
+        if (!channel->enabled) {
+          channel->chctrlb = 0;
+          channel->flags = 0;
+        }
+      } else if (d->CHCTRLA.reg & DMAC_CHCTRLA_ENABLE) {
+        if (!channel->enabled) {
+          dmacEnable(dmac.chid);
+        }
+      } else {
+        channel->enabled = false;
+      }
+      break;
+    case offsetof(Dmac, CHCTRLB):
+      if (channel->enabled) {
+        hostFail("DMAC CHCTRLB written while the channel is enabled");
+      }
+      channel->chctrlb = d->CHCTRLB.reg;
+      break;
+    case offsetof(Dmac, CHINTFLAG):
+      channel->flags &= ~d->CHINTFLAG.reg;
+      break;
+  }
+  hostChanged();
+  dmacService();
+}
+
+static const hostPeripheral_t dmacModel = {
+  .base = (uintptr_t) DMAC,
+  .size = sizeof(Dmac),
+  .publish = dmacPublish,
+  .access = dmacAccess,
+};
+
+void spiModelInit(void) {
+  spiStop();
+  spi.ctrla = spi.ctrlb = 0;
+  spi.baud = 0;
+  spi.status = 0;
+  spi.bytes = 0;
+  hostAddPeripheral(&spiModel);
+
+  dmacReset();
+  hostAddPeripheral(&dmacModel);
+}
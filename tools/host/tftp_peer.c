@@ -0,0 +1,416 @@
+// Stand-in TFTP servers for the host tests
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  Every RRQ opens a session with its own TID. A window is sent back to
+//  back on the peer's link, and any ACK restarts it from the block after the
+//  one acknowledged. Packets in flight and timers are host events; they
+//  carry the epoch they were made in, so a tftpPeerInit() for the next run
+//  makes the stale ones harmless.
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "host.h"
+#include "w5500_model.h"
+#include "tftp_peer.h"
+#include "utils.h"
+#include "w5500.h"
+
+#define TFTP_PEER_SESSIONS    (8)
+#define TFTP_PEER_FIRST_TID   (1024U)
+#define TFTP_PEER_MAX_RETRIES (5)
+#define TFTP_PEER_MAX_BLKSIZE (1468U)
+#define TFTP_PEER_MAX_OACK    (128)
+
+#define OPCODE_RRQ        (1)
+#define OPCODE_DATA       (3)
+#define OPCODE_ACK        (4)
+#define OPCODE_ERROR      (5)
+#define OPCODE_OACK       (6)
+
+typedef struct {
+  bool active;
+  uint16_t tid;
+  uint16_t clientPort;
+  // The range of the image served
+  uint32_t offset;
+  uint32_t length;
+  uint16_t blockSize;
+  uint16_t window;
+  uint32_t blocks;
+  // First block not acknowledged yet, 0 while the OACK is
+  uint32_t next;
+  uint8_t oack[TFTP_PEER_MAX_OACK];
+  uint16_t oackLen;
+  uint8_t retries;
+  uint64_t due;
+} tftpSession_t;
+
+typedef struct {
+  tftpPeerConfig_t config;
+  tftpPeerStats_t stats;
+  tftpSession_t sessions[TFTP_PEER_SESSIONS];
+  uint16_t nextTid;
+  // When the peer's link is free again
+  uint64_t linkFree;
+} tftpPeer_t;
+
+static struct {
+  uint32_t epoch;
+  uint8_t client[4];
+  const uint8_t* image;
+  uint32_t size;
+  tftpPeer_t peers[TFTP_PEER_MAX];
+  uint8_t count;
+  uint16_t lossPerMille;
+  uint32_t random;
+} net;
+
+typedef struct {
+  uint32_t epoch;
+  tftpPeer_t* peer;
+  // Source and destination port, and whether it goes to the device
+  uint16_t from;
+  uint16_t to;
+  bool toClient;
+  uint16_t len;
+  uint8_t data[];
+} tftpPacket_t;
+
+typedef struct {
+  uint32_t epoch;
+  tftpPeer_t* peer;
+  tftpSession_t* session;
+} tftpTimer_t;
+
+static void tftpPeerReceive(tftpPeer_t* peer, uint16_t from, uint16_t to, const uint8_t* data, uint16_t len);
+
+static uint16_t get16(const uint8_t* p) {
+  return (p[0] << 8) | p[1];
+}
+
+static void put16(uint8_t* p, uint16_t value) {
+  p[0] = value >> 8;
+  p[1] = value & 0xFF;
+}
+
+// xorshift32, the same sequence of losses for the same seed
+static bool tftpPeerLost(tftpPeer_t* peer) {
+  if (net.lossPerMille == 0) {
+    return false;
+  }
+  net.random ^= net.random << 13;
+  net.random ^= net.random >> 17;
+  net.random ^= net.random << 5;
+  if (net.random % 1000U < net.lossPerMille) {
+    peer->stats.lost++;
+    return true;
+  }
+  return false;
+}
+
+static void tftpPeerArrive(void* arg) {
+  tftpPacket_t* packet = arg;
+
+  if (packet->epoch == net.epoch) {
+    if (packet->toClient) {
+      w5500ModelDeliverUdp(packet->peer->config.address, packet->from, net.client, packet->to,
+                           packet->data, packet->len);
+    } else {
+      tftpPeerReceive(packet->peer, packet->from, packet->to, packet->data, packet->len);
+    }
+  }
+  free(packet);
+}
+
+static void tftpPeerQueue(tftpPeer_t* peer, uint64_t when, uint16_t from, uint16_t to, bool toClient,
+                          const uint8_t* data, uint16_t len) {
+  tftpPacket_t* packet = malloc(sizeof(*packet) + len);
+  if (!packet) {
+    hostFail("out of memory");
+  }
+  packet->epoch = net.epoch;
+  packet->peer = peer;
+  packet->from = from;
+  packet->to = to;
+  packet->toClient = toClient;
+  packet->len = len;
+  memcpy(packet->data, data, len);
+  hostSchedule(when, tftpPeerArrive, packet);
+}
+
+// Packets leave one after the other on the peer's link, no faster than its rate
+static void tftpPeerSend(tftpPeer_t* peer, tftpSession_t* session, const uint8_t* data, uint16_t len) {
+  uint64_t start = peer->linkFree > hostNow() ? peer->linkFree : hostNow();
+  uint64_t time = w5500ModelWireTime(len, true);
+  if (peer->config.rate && (uint64_t) len * HOST_CPU_FREQUENCY / peer->config.rate > time) {
+    time = (uint64_t) len * HOST_CPU_FREQUENCY / peer->config.rate;
+  }
+  peer->linkFree = start + time;
+  if (!tftpPeerLost(peer)) {
+    tftpPeerQueue(peer, peer->linkFree + peer->config.latency, session->tid, session->clientPort, true, data, len);
+  }
+}
+
+static void tftpPeerError(tftpPeer_t* peer, uint16_t tid, uint16_t clientPort, uint16_t code) {
+  tftpSession_t session = { .tid = tid, .clientPort = clientPort };
+  uint8_t packet[5];
+
+  put16(packet, OPCODE_ERROR);
+  put16(packet + 2, code);
+  packet[4] = 0;
+  tftpPeerSend(peer, &session, packet, sizeof(packet));
+}
+
+static void tftpPeerTimeout(void* arg);
+
+static void tftpPeerArm(tftpPeer_t* peer, tftpSession_t* session) {
+  tftpTimer_t* timer = malloc(sizeof(*timer));
+  if (!timer) {
+    hostFail("out of memory");
+  }
+  timer->epoch = net.epoch;
+  timer->peer = peer;
+  timer->session = session;
+  session->due = hostNow() + peer->config.timeout;
+  hostSchedule(session->due, tftpPeerTimeout, timer);
+}
+
+static void tftpPeerSendWindow(tftpPeer_t* peer, tftpSession_t* session) {
+  uint8_t packet[4 + TFTP_PEER_MAX_BLKSIZE];
+
+  if (session->next == 0) {
+    tftpPeerSend(peer, session, session->oack, session->oackLen);
+  }
+  for (uint32_t block = session->next; block && block < session->next + session->window &&
+       block <= session->blocks; block++) {
+    uint32_t offset = (block - 1) * session->blockSize;
+    uint32_t len = session->length - offset;
+    if (len > session->blockSize) {
+      len = session->blockSize;
+    }
+    put16(packet, OPCODE_DATA);
+    put16(packet + 2, block);
+    memcpy(packet + 4, net.image + session->offset + offset, len);
+    tftpPeerSend(peer, session, packet, 4 + len);
+    peer->stats.data++;
+  }
+  tftpPeerArm(peer, session);
+}
+
+static void tftpPeerTimeout(void* arg) {
+  tftpTimer_t* timer = arg;
+  tftpSession_t* session = timer->session;
+
+  if (timer->epoch == net.epoch && session->active && hostNow() >= session->due) {
+    if (++session->retries > TFTP_PEER_MAX_RETRIES) {
+      session->active = false;
+    } else {
+      timer->peer->stats.timeouts++;
+      tftpPeerSendWindow(timer->peer, session);
+    }
+  }
+  free(timer);
+}
+
+static uint8_t* appendOption(uint8_t* ptr, const char* name, uint32_t value) {
+  ptr = appendText(ptr, name);
+  *(ptr++) = 0;
+  ptr = appendDecimal(ptr, value);
+  *(ptr++) = 0;
+  return ptr;
+}
+
+static void tftpPeerRequest(tftpPeer_t* peer, uint16_t clientPort, const uint8_t* data, uint16_t len) {
+  const char* end = (const char*) data + len;
+  const char* name = (const char*) data + 2;
+  const char* mode = memchr(name, 0, end - name);
+  if (!mode++ || !memchr(mode, 0, end - mode)) {
+    return;
+  }
+  peer->stats.requests++;
+
+  tftpSession_t* session = NULL;
+  for (uint8_t i = 0; i < TFTP_PEER_SESSIONS && !session; i++) {
+    if (!peer->sessions[i].active) {
+      session = &peer->sessions[i];
+    }
+  }
+  uint16_t tid = peer->nextTid++;
+  if (!session) {
+    tftpPeerError(peer, tid, clientPort, 0);
+    return;
+  }
+
+  memset(session, 0, sizeof(*session));
+  session->active = true;
+  session->tid = tid;
+  session->clientPort = clientPort;
+  session->blockSize = 512;
+  session->window = 1;
+
+  // Options, anything not understood is left out of the OACK. The range is
+  // echoed clamped to the image, after the others.
+  bool haveOffset = false, haveLength = false;
+  uint32_t offset = 0, length = 0;
+  uint8_t* oack = session->oack;
+  put16(oack, OPCODE_OACK);
+  oack += 2;
+  const char* option = mode + strlen(mode) + 1;
+  while (option < end) {
+    const char* value = memchr(option, 0, end - option);
+    if (!value++ || !memchr(value, 0, end - value)) {
+      break;
+    }
+    uint32_t number = parseNumber(value);
+    if (strcasecmp(option, "blksize") == 0 && number >= 8) {
+      session->blockSize = number > TFTP_PEER_MAX_BLKSIZE ? TFTP_PEER_MAX_BLKSIZE : number;
+      oack = appendOption(oack, "blksize", session->blockSize);
+    } else if (strcasecmp(option, "windowsize") == 0 && number >= 1) {
+      session->window = number;
+      oack = appendOption(oack, "windowsize", session->window);
+    } else if (strcasecmp(option, "tsize") == 0) {
+      oack = appendOption(oack, "tsize", net.size);
+    } else if (strcasecmp(option, "offset") == 0) {
+      offset = number;
+      haveOffset = true;
+    } else if (strcasecmp(option, "length") == 0) {
+      length = number;
+      haveLength = true;
+    }
+    option = value + strlen(value) + 1;
+  }
+  if (offset > net.size) {
+    offset = net.size;
+  }
+  if (!haveLength || length > net.size - offset) {
+    length = net.size - offset;
+  }
+  session->offset = offset;
+  session->length = length;
+  if (haveOffset) {
+    peer->stats.ranges++;
+    oack = appendOption(oack, "offset", offset);
+  }
+  if (haveLength) {
+    oack = appendOption(oack, "length", length);
+  }
+  session->oackLen = oack - session->oack;
+  // The short block that ends a transfer may be empty
+  session->blocks = session->length / session->blockSize + 1;
+
+  // Plain RFC 1350 starts with block 1 right away
+  session->next = (session->oackLen > 2) ? 0 : 1;
+  tftpPeerSendWindow(peer, session);
+}
+
+static void tftpPeerAck(tftpPeer_t* peer, tftpSession_t* session, uint16_t block) {
+  peer->stats.acks++;
+
+  // Block numbers wrap, the ACK is for the block at most 64K behind the
+  // one after the last sent
+  uint32_t sent = session->next ? session->next + session->window - 1 : 0;
+  uint32_t acked = sent - (uint16_t) (sent - block);
+  if (acked + 1 < session->next || acked > sent) {
+    return;
+  }
+  if (acked >= session->blocks) {
+    session->active = false;
+    peer->stats.transfers++;
+    return;
+  }
+  session->next = acked + 1;
+  session->retries = 0;
+  tftpPeerSendWindow(peer, session);
+}
+
+static void tftpPeerReceive(tftpPeer_t* peer, uint16_t from, uint16_t to, const uint8_t* data, uint16_t len) {
+  if (len < 4) {
+    return;
+  }
+  uint16_t opcode = get16(data);
+
+  if (to == 69) {
+    if (opcode == OPCODE_RRQ) {
+      tftpPeerRequest(peer, from, data, len);
+    }
+    return;
+  }
+
+  for (uint8_t i = 0; i < TFTP_PEER_SESSIONS; i++) {
+    tftpSession_t* session = &peer->sessions[i];
+    if (!session->active || session->tid != to) {
+      continue;
+    }
+    if (session->clientPort != from) {
+      tftpPeerError(peer, to, from, 5);
+    } else if (opcode == OPCODE_ACK) {
+      tftpPeerAck(peer, session, get16(data + 2));
+    } else if (opcode == OPCODE_ERROR) {
+      session->active = false;
+    }
+    return;
+  }
+}
+
+static void tftpPeerOnSend(uint8_t socket, const uint8_t* data, uint16_t len,
+                           const uint8_t address[4], uint16_t port, void* context) {
+  (void) context;
+
+  for (uint8_t i = 0; i < net.count; i++) {
+    tftpPeer_t* peer = &net.peers[i];
+    if (memcmp(address, peer->config.address, 4) != 0) {
+      continue;
+    }
+    if (!peer->config.down && !tftpPeerLost(peer)) {
+      uint16_t from = (w5500ModelSocketRegister(socket, REG_SN_PORT0) << 8) |
+                      w5500ModelSocketRegister(socket, REG_SN_PORT1);
+      tftpPeerQueue(peer, hostNow() + peer->config.latency, from, port, false, data, len);
+    }
+    return;
+  }
+}
+
+void tftpPeerInit(const uint8_t client[4], const uint8_t* image, uint32_t size) {
+  net.epoch++;
+  memcpy(net.client, client, 4);
+  net.image = image;
+  net.size = size;
+  net.count = 0;
+  net.lossPerMille = 0;
+  w5500ModelOnSend(tftpPeerOnSend, NULL);
+}
+
+uint8_t tftpPeerAdd(const tftpPeerConfig_t* config) {
+  if (net.count == TFTP_PEER_MAX) {
+    hostFail("too many TFTP peers");
+  }
+  tftpPeer_t* peer = &net.peers[net.count];
+  memset(peer, 0, sizeof(*peer));
+  peer->config = *config;
+  peer->nextTid = TFTP_PEER_FIRST_TID + net.count * 256U;
+  return net.count++;
+}
+
+void tftpPeerLoss(uint16_t perMille, uint32_t seed) {
+  net.lossPerMille = perMille;
+  net.random = seed ? seed : 1;
+}
+
+const tftpPeerStats_t* tftpPeerStats(uint8_t peer) {
+  return &net.peers[peer].stats;
+}
@@ -0,0 +1,65 @@
+// Stand-in TFTP servers for the host tests
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  The peers sit on the network side of the W5500 model and answer what
+//  the device sends them, in simulated time. They serve one image under
+//  any file name with the blksize, windowsize (RFC 7440), tsize and the
+//  offset/length byte range options, like tools/tftp_server does. Each one
+//  has a one way delay, a rate its link sends at and its own retransmission
+//  timeout, which is the only thing that rescues a transfer from the server
+//  side. Packets can be dropped on purpose in both directions.
+
+#ifndef __TFTP_PEER_H__
+#define __TFTP_PEER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TFTP_PEER_MAX (4)
+
+typedef struct {
+  uint8_t address[4];
+  // One way delay and the server's retransmission timeout, in cycles
+  uint64_t latency;
+  uint64_t timeout;
+  // Payload bytes per second the server gets out, 0 for the wire speed
+  uint32_t rate;
+  // Never answers, like a mirror that is down
+  bool down;
+} tftpPeerConfig_t;
+
+typedef struct {
+  uint32_t requests;   // RRQs received
+  uint32_t ranges;     // RRQs for a byte range
+  uint32_t acks;       // ACKs received
+  uint32_t data;       // DATA packets sent, resends included
+  uint32_t timeouts;   // Resends after the server's own timeout
+  uint32_t lost;       // Packets dropped on purpose, either way
+  uint32_t transfers;  // Transfers whose last block was acknowledged
+} tftpPeerStats_t;
+
+// Forget all peers and sessions and serve image to the device at client.
+// Takes over the W5500 model's send hook.
+void tftpPeerInit(const uint8_t client[4], const uint8_t* image, uint32_t size);
+// Add a server, returns its index
+uint8_t tftpPeerAdd(const tftpPeerConfig_t* config);
+// Drop each packet with a probability of perMille/1000, from a fixed seed
+// so runs can be repeated
+void tftpPeerLoss(uint16_t perMille, uint32_t seed);
+const tftpPeerStats_t* tftpPeerStats(uint8_t peer);
+
+#endif   // __TFTP_PEER_H__
@@ -0,0 +1,528 @@
+// Host model of the W5500
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#include <stdlib.h>
+#include <string.h>
+#include "host.h"
+#include "w5500_model.h"
+#include "board_definitions.h"
+#include "w5500.h"
+
+#define W5500_SOCKETS       (8U)
+#define W5500_COMMON_SIZE   (0x40U)
+#define W5500_SOCKET_SIZE   (0x30U)
+#define W5500_MAX_BUFFER    (16U * 1024U)
+
+#define REG_SN_RXBUF_SIZE   (0x1E)
+#define REG_SN_TXBUF_SIZE   (0x1F)
+#define REG_SN_RX_WR0       (0x2A)
+
+// Bytes on the wire around an Ethernet frame: preamble and SFD, FCS and
+// the inter frame gap
+#define W5500_RAW_OVERHEAD  (8U + 4U + 12U)
+#define W5500_MIN_FRAME     (60U)
+
+typedef struct {
+  uint8_t regs[W5500_SOCKET_SIZE];
+  uint8_t ir;
+  uint8_t sr;
+  uint16_t txRd;
+  uint16_t rxWr;
+  // RX_RD as of the last RECV, what RX_RSR is counted from
+  uint16_t rxRd;
+  bool sending;
+  uint32_t generation;
+  uint8_t rx[W5500_MAX_BUFFER];
+  uint8_t tx[W5500_MAX_BUFFER];
+} w5500Socket_t;
+
+static struct {
+  uint8_t common[W5500_COMMON_SIZE];
+  w5500Socket_t sockets[W5500_SOCKETS];
+  bool intAsserted;
+
+  // Frame decoding
+  bool selected;
+  uint8_t headerBytes;
+  uint16_t address;
+  uint8_t control;
+
+  uint64_t wireRate;
+  w5500SendHook_t sendHook;
+  void* sendContext;
+  w5500ModelStats_t stats;
+} chip;
+
+typedef struct {
+  uint8_t socket;
+  uint32_t generation;
+  uint8_t address[4];
+  uint16_t port;
+  uint16_t len;
+  uint8_t data[];
+} w5500Send_t;
+
+static uint16_t w5500Get16(const uint8_t* p) {
+  return (p[0] << 8) | p[1];
+}
+
+static void w5500Put16(uint8_t* p, uint16_t value) {
+  p[0] = value >> 8;
+  p[1] = value & 0xFF;
+}
+
+static uint16_t w5500RxSize(const w5500Socket_t* s) {
+  return s->regs[REG_SN_RXBUF_SIZE] * 1024U;
+}
+
+static uint16_t w5500TxSize(const w5500Socket_t* s) {
+  return s->regs[REG_SN_TXBUF_SIZE] * 1024U;
+}
+
+static uint8_t w5500Sir(void) {
+  uint8_t sir = 0;
+
+  for (uint8_t n = 0; n < W5500_SOCKETS; n++) {
+    if (chip.sockets[n].ir & chip.sockets[n].regs[REG_SN_IMR]) {
+      sir |= 1 << n;
+    }
+  }
+  return sir;
+}
+
+// INTn is low while any socket enabled in SIMR has an interrupt pending
+static void w5500UpdateInt(void) {
+  bool asserted = (w5500Sir() & chip.common[REG_SIMR]) != 0;
+
+  if (asserted != chip.intAsserted) {
+    chip.intAsserted = asserted;
+#ifdef W5X00_INT_EXTINT
+    eicModelLine(W5X00_INT_EXTINT, !asserted);
+#endif
+  }
+  hostChanged();
+}
+
+static void w5500ResetSocket(w5500Socket_t* s) {
+  s->ir = 0;
+  s->txRd = 0;
+  s->rxWr = 0;
+  s->rxRd = 0;
+  s->sending = false;
+  s->generation++;
+  w5500Put16(&s->regs[REG_SN_TX_WR0], 0);
+  w5500Put16(&s->regs[REG_SN_RX_RD0], 0);
+}
+
+static void w5500Reset(void) {
+  memset(chip.common, 0, sizeof(chip.common));
+  w5500Put16(&chip.common[REG_RTR0], 2000);
+  chip.common[REG_RCR] = 8;
+  // Link up, 100Mbit full duplex, all capable auto-negotiation
+  chip.common[REG_PHYCFGR] = PHYCFGR_RST | PHYCFGR_OPMDC_ALLAN | PHYCFGR_DPX | PHYCFGR_SPD | PHYCFGR_LNK;
+  chip.common[REG_VERSIONR] = W5500_VERSION;
+
+  for (uint8_t n = 0; n < W5500_SOCKETS; n++) {
+    w5500Socket_t* s = &chip.sockets[n];
+    memset(s->regs, 0, sizeof(s->regs));
+    s->regs[REG_SN_RXBUF_SIZE] = 2;
+    s->regs[REG_SN_TXBUF_SIZE] = 2;
+    s->regs[REG_SN_IMR] = 0xFF;
+    s->sr = SOCK_CLOSED;
+    w5500ResetSocket(s);
+  }
+  w5500UpdateInt();
+}
+
+uint64_t w5500ModelWireTime(uint16_t len, bool udp) {
+  uint32_t bytes = len + (udp ? 8U + 20U + 14U : 14U);
+  if (bytes < W5500_MIN_FRAME) {
+    bytes = W5500_MIN_FRAME;
+  }
+  bytes += W5500_RAW_OVERHEAD;
+  return (uint64_t) bytes * 8U * HOST_CPU_FREQUENCY / chip.wireRate;
+}
+
+static void w5500SendDone(void* arg) {
+  w5500Send_t* send = arg;
+  w5500Socket_t* s = &chip.sockets[send->socket];
+
+  if (send->generation == s->generation) {
+    s->sending = false;
+    s->ir |= IR_SEND_OK;
+    chip.stats.sent++;
+    w5500UpdateInt();
+    if (chip.sendHook) {
+      chip.sendHook(send->socket, send->data, send->len, send->address, send->port, chip.sendContext);
+    }
+  }
+  free(send);
+}
+
+static void w5500Send(uint8_t n) {
+  w5500Socket_t* s = &chip.sockets[n];
+  uint16_t size = w5500TxSize(s);
+  uint16_t txWr = w5500Get16(&s->regs[REG_SN_TX_WR0]);
+  uint16_t len = txWr - s->txRd;
+
+  if (s->sr != SOCK_UDP && s->sr != SOCK_MACRAW) {
+    hostFail("W5500 SEND on socket %u in state %#x", n, s->sr);
+  }
+  if (s->sending) {
+    hostFail("W5500 SEND on socket %u before the last one completed", n);
+  }
+  if (len > size) {
+    hostFail("W5500 SEND of %u bytes from a %u byte buffer", len, size);
+  }
+
+  w5500Send_t* send = malloc(sizeof(*send) + len);
+  if (!send) {
+    hostFail("out of memory");
+  }
+  send->socket = n;
+  send->generation = s->generation;
+  memcpy(send->address, &s->regs[REG_SN_DIPR0], 4);
+  send->port = w5500Get16(&s->regs[REG_SN_DPORT0]);
+  send->len = len;
+  for (uint16_t i = 0; i < len; i++) {
+    send->data[i] = s->tx[(uint16_t) (s->txRd + i) & (size - 1)];
+  }
+  s->txRd = txWr;
+  s->sending = true;
+
+  hostSchedule(hostNow() + w5500ModelWireTime(len, s->sr == SOCK_UDP), w5500SendDone, send);
+}
+
+static void w5500Command(uint8_t n, uint8_t command) {
+  w5500Socket_t* s = &chip.sockets[n];
+  uint8_t mode = s->regs[REG_SN_MR] & 0x0F;
+
+  switch (command) {
+    case CR_OPEN:
+      w5500ResetSocket(s);
+      if (mode == MR_UDP) {
+        s->sr = SOCK_UDP;
+      } else if (mode == MR_MACRAW && n == 0) {
+        s->sr = SOCK_MACRAW;
+      } else if (mode == MR_TCP) {
+        s->sr = SOCK_INIT;
+      } else {
+        s->sr = SOCK_CLOSED;
+      }
+      break;
+    case CR_CLOSE:
+      w5500ResetSocket(s);
+      s->sr = SOCK_CLOSED;
+      break;
+    case CR_SEND:
+      w5500Send(n);
+      break;
+    case CR_RECV:
+      s->rxRd = w5500Get16(&s->regs[REG_SN_RX_RD0]);
+      if ((uint16_t) (s->rxWr - s->rxRd) > w5500RxSize(s)) {
+        hostFail("W5500 RX_RD on socket %u moved past the received data", n);
+      }
+      // Data still waiting raises RECV again
+      if (s->rxWr != s->rxRd) {
+        s->ir |= IR_RECV;
+      }
+      break;
+    default:
+      hostFail("W5500 command %#x on socket %u isn't modelled", command, n);
+  }
+  w5500UpdateInt();
+}
+
+static uint8_t w5500ReadCommon(uint16_t address) {
+  if (address >= W5500_COMMON_SIZE) {
+    return 0;
+  }
+  switch (address) {
+    case REG_SIR:
+      return w5500Sir();
+  }
+  return chip.common[address];
+}
+
+static void w5500WriteCommon(uint16_t address, uint8_t value) {
+  if (address >= W5500_COMMON_SIZE) {
+    return;
+  }
+  switch (address) {
+    case REG_MR:
+      if (value & REG_MR_RESET) {
+        w5500Reset();
+        return;
+      }
+      break;
+    case REG_IR:
+      chip.common[REG_IR] &= ~value;
+      return;
+    case REG_SIR:
+    case REG_VERSIONR:
+      return;
+    case REG_PHYCFGR:
+      // The status bits are the PHY's
+      chip.common[REG_PHYCFGR] = (value & 0xF8) | PHYCFGR_DPX | PHYCFGR_SPD | PHYCFGR_LNK;
+      return;
+  }
+  chip.common[address] = value;
+  if (address == REG_SIMR) {
+    w5500UpdateInt();
+  }
+}
+
+uint8_t w5500ModelSocketRegister(uint8_t n, uint16_t address) {
+  w5500Socket_t* s = &chip.sockets[n];
+
+  if (address >= W5500_SOCKET_SIZE) {
+    return 0;
+  }
+  switch (address) {
+    case REG_SN_CR:
+      // Commands complete at once
+      return 0;
+    case REG_SN_IR:
+      return s->ir;
+    case REG_SN_SR:
+      return s->sr;
+    case REG_SN_TX_FSR0:
+    case REG_SN_TX_FSR1: {
+      uint16_t free = w5500TxSize(s) - (uint16_t) (w5500Get16(&s->regs[REG_SN_TX_WR0]) - s->txRd);
+      return address == REG_SN_TX_FSR0 ? free >> 8 : free & 0xFF;
+    }
+    case REG_SN_TX_RD0:
+    case REG_SN_TX_RD1:
+      return address == REG_SN_TX_RD0 ? s->txRd >> 8 : s->txRd & 0xFF;
+    case REG_SN_RX_RSR0:
+    case REG_SN_RX_RSR1: {
+      uint16_t size = s->rxWr - s->rxRd;
+      return address == REG_SN_RX_RSR0 ? size >> 8 : size & 0xFF;
+    }
+    case REG_SN_RX_WR0:
+    case REG_SN_RX_WR0 + 1:
+      return address == REG_SN_RX_WR0 ? s->rxWr >> 8 : s->rxWr & 0xFF;
+  }
+  return s->regs[address];
+}
+
+static void w5500WriteSocket(uint8_t n, uint16_t address, uint8_t value) {
+  w5500Socket_t* s = &chip.sockets[n];
+
+  if (address >= W5500_SOCKET_SIZE) {
+    return;
+  }
+  switch (address) {
+    case REG_SN_CR:
+      w5500Command(n, value);
+      return;
+    case REG_SN_IR:
+      s->ir &= ~value;
+      w5500UpdateInt();
+      return;
+    case REG_SN_SR:
+    case REG_SN_TX_FSR0:
+    case REG_SN_TX_FSR1:
+    case REG_SN_TX_RD0:
+    case REG_SN_TX_RD1:
+    case REG_SN_RX_RSR0:
+    case REG_SN_RX_RSR1:
+    case REG_SN_RX_WR0:
+    case REG_SN_RX_WR0 + 1:
+      return;
+    case REG_SN_RXBUF_SIZE:
+    case REG_SN_TXBUF_SIZE:
+      if (value != 0 && value != 1 && value != 2 && value != 4 && value != 8 && value != 16) {
+        hostFail("W5500 socket %u buffer size %u", n, value);
+      }
+      break;
+  }
+  s->regs[address] = value;
+  if (address == REG_SN_IMR) {
+    w5500UpdateInt();
+  }
+}
+
+// One data byte of a frame, at the current address
+static uint8_t w5500Data(uint8_t mosi) {
+  uint8_t bsb = chip.control >> 3;
+  bool write = (chip.control & 0x04) != 0;
+  uint16_t address = chip.address++;
+  uint8_t n = bsb >> 2;
+  uint8_t miso = 0;
+
+  if (bsb == 0) {
+    if (write) {
+      w5500WriteCommon(address, mosi);
+    } else {
+      miso = w5500ReadCommon(address);
+    }
+  } else if ((bsb & 0x03) == 0x01) {
+    if (write) {
+      w5500WriteSocket(n, address, mosi);
+    } else {
+      miso = w5500ModelSocketRegister(n, address);
+    }
+  } else {
+    // Both buffers can be read and written, the address wraps at their size
+    w5500Socket_t* s = &chip.sockets[n];
+    bool tx = (bsb & 0x03) == 0x02;
+    uint16_t size = tx ? w5500TxSize(s) : w5500RxSize(s);
+    uint8_t* buffer = tx ? s->tx : s->rx;
+    if (!size) {
+      return 0;
+    }
+    if (write) {
+      buffer[address & (size - 1)] = mosi;
+    } else {
+      miso = buffer[address & (size - 1)];
+    }
+  }
+  return miso;
+}
+
+void w5500ModelSelect(bool selected) {
+  chip.selected = selected;
+  if (selected) {
+    chip.headerBytes = 0;
+    chip.stats.spiFrames++;
+  }
+}
+
+uint8_t w5500ModelTransfer(uint8_t mosi) {
+  if (!chip.selected) {
+    // MISO floats
+    return 0xFF;
+  }
+
+  switch (chip.headerBytes) {
+    case 0:
+      chip.address = mosi << 8;
+      chip.headerBytes++;
+      return 0x01;
+    case 1:
+      chip.address |= mosi;
+      chip.headerBytes++;
+      return 0x02;
+    case 2:
+      chip.control = mosi;
+      chip.headerBytes++;
+      if (chip.control & 0x03) {
+        hostFail("W5500 fixed length data mode isn't modelled");
+      }
+      return 0x03;
+  }
+  return w5500Data(mosi);
+}
+
+// Store len bytes at the socket's RX write pointer
+static void w5500Store(w5500Socket_t* s, const uint8_t* data, uint16_t len) {
+  uint16_t size = w5500RxSize(s);
+
+  for (uint16_t i = 0; i < len; i++) {
+    s->rx[s->rxWr++ & (size - 1)] = data[i];
+  }
+}
+
+static bool w5500Fits(w5500Socket_t* s, uint16_t len) {
+  return (uint32_t) (uint16_t) (s->rxWr - s->rxRd) + len <= w5500RxSize(s);
+}
+
+static void w5500Received(w5500Socket_t* s, uint16_t len) {
+  s->ir |= IR_RECV;
+  chip.stats.received++;
+  chip.stats.bytesReceived += len;
+  w5500UpdateInt();
+}
+
+bool w5500ModelDeliverUdp(const uint8_t address[4], uint16_t port,
+                          const uint8_t to[4], uint16_t toPort,
+                          const uint8_t* data, uint16_t len) {
+  static const uint8_t broadcast[4] = { 255, 255, 255, 255 };
+
+  for (uint8_t n = 0; n < W5500_SOCKETS; n++) {
+    w5500Socket_t* s = &chip.sockets[n];
+    if (s->sr != SOCK_UDP || w5500Get16(&s->regs[REG_SN_PORT0]) != toPort) {
+      continue;
+    }
+    if (s->regs[REG_SN_MR] & MR_MULTI) {
+      // Multicast sockets only take their group
+      if (memcmp(to, &s->regs[REG_SN_DIPR0], 4) != 0) {
+        continue;
+      }
+    } else if (memcmp(to, &chip.common[REG_SIPR0], 4) != 0 && memcmp(to, broadcast, 4) != 0) {
+      continue;
+    }
+
+    if (!w5500Fits(s, 8 + len)) {
+      break;
+    }
+    uint8_t head[8];
+    memcpy(head, address, 4);
+    w5500Put16(&head[4], port);
+    w5500Put16(&head[6], len);
+    w5500Store(s, head, sizeof(head));
+    w5500Store(s, data, len);
+    w5500Received(s, len);
+    return true;
+  }
+  chip.stats.dropped++;
+  return false;
+}
+
+bool w5500ModelDeliverFrame(const uint8_t* frame, uint16_t len) {
+  static const uint8_t broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+  w5500Socket_t* s = &chip.sockets[0];
+
+  if (s->sr != SOCK_MACRAW || len < 14 ||
+      ((s->regs[REG_SN_MR] & MR_MFEN) &&
+       memcmp(frame, &chip.common[REG_SHAR0], 6) != 0 && memcmp(frame, broadcast, 6) != 0) ||
+      !w5500Fits(s, 2 + len)) {
+    chip.stats.dropped++;
+    return false;
+  }
+
+  uint8_t head[2];
+  w5500Put16(head, len + 2);
+  w5500Store(s, head, sizeof(head));
+  w5500Store(s, frame, len);
+  w5500Received(s, len);
+  return true;
+}
+
+void w5500ModelOnSend(w5500SendHook_t hook, void* context) {
+  chip.sendHook = hook;
+  chip.sendContext = context;
+}
+
+void w5500ModelWireRate(uint64_t bitsPerSecond) {
+  chip.wireRate = bitsPerSecond;
+}
+
+const w5500ModelStats_t* w5500ModelStats(void) {
+  return &chip.stats;
+}
+
+void w5500ModelInit(void) {
+  chip.selected = false;
+  chip.intAsserted = false;
+  chip.sendHook = NULL;
+  chip.sendContext = NULL;
+  memset(&chip.stats, 0, sizeof(chip.stats));
+  w5500ModelWireRate(100000000ULL);
+  w5500Reset();
+}
@@ -0,0 +1,65 @@
+// Host model of the W5500, the network side for test harnesses
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  The model decodes SPI frames (address, control byte, data) and
+//  implements the common registers, the socket registers and buffers, and
+//  the OPEN, CLOSE, SEND and RECV commands for UDP and MACRAW sockets. TCP
+//  isn't modelled. Received packets are stored the way the chip stores
+//  them (an 8 byte header for UDP, a 2 byte length for MACRAW) and are
+//  dropped when they don't fit. A SEND completes after the frame's time on
+//  the wire, which is when the harness gets to see it.
+
+#ifndef __W5500_MODEL_H__
+#define __W5500_MODEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Called when a SEND completes. For UDP sockets data is the payload and
+// address/port the destination, for MACRAW the whole frame.
+typedef void (*w5500SendHook_t)(uint8_t socket, const uint8_t* data, uint16_t len,
+                                const uint8_t address[4], uint16_t port, void* context);
+void w5500ModelOnSend(w5500SendHook_t hook, void* context);
+
+// Hand the chip a UDP datagram from address:port for to:toPort. Returns
+// false if no socket takes it or its RX buffer is full.
+bool w5500ModelDeliverUdp(const uint8_t address[4], uint16_t port,
+                          const uint8_t to[4], uint16_t toPort,
+                          const uint8_t* data, uint16_t len);
+// Hand the MACRAW socket an Ethernet frame (without FCS)
+bool w5500ModelDeliverFrame(const uint8_t* frame, uint16_t len);
+
+// Ethernet bit rate, 100Mbit/s by default
+void w5500ModelWireRate(uint64_t bitsPerSecond);
+// Time a frame with len bytes of payload (after the Ethernet, IP and UDP
+// headers for UDP) takes on the wire, in CPU cycles
+uint64_t w5500ModelWireTime(uint16_t len, bool udp);
+
+// Contents of a socket register, as the chip would return it
+uint8_t w5500ModelSocketRegister(uint8_t socket, uint16_t address);
+
+typedef struct {
+  uint32_t spiFrames;      // CS assertions
+  uint32_t received;       // Packets stored in an RX buffer
+  uint32_t dropped;        // Packets no socket took or that didn't fit
+  uint32_t sent;           // Completed SENDs
+  uint64_t bytesReceived;  // Payload bytes of the stored packets
+} w5500ModelStats_t;
+
+const w5500ModelStats_t* w5500ModelStats(void);
+
+#endif   // __W5500_MODEL_H__
@@ -0,0 +1,312 @@
+// Raw Ethernet image sender for the L2BOOT transfer mode
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  Linux only, needs CAP_NET_RAW:
+//     l2boot_sender [-1] <interface> <image.bin>
+//
+//  Waits for devices to broadcast an L2BOOT REQUEST and sends them the
+//  image with a go-back-N window, one device at a time. With -1 it exits
+//  after the first complete transfer.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netpacket/packet.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "l2boot.h"
+
+#define ETH_HEADER_SIZE   14
+#define ETH_MIN_FRAME     60
+#define RETRY_MS          100
+#define MAX_RETRIES       50
+
+static int sock;
+static int ifindex;
+static uint8_t ourMac[6];
+
+static uint8_t* image;
+static size_t imageSize;
+
+static uint64_t nowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void openInterface(const char* name) {
+  sock = socket(AF_PACKET, SOCK_RAW, htons(L2BOOT_ETHERTYPE));
+  if (sock < 0) {
+    perror("socket");
+    exit(1);
+  }
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+  if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
+    perror("SIOCGIFINDEX");
+    exit(1);
+  }
+  ifindex = ifr.ifr_ifindex;
+
+  if (ioctl(sock, SIOCGIFHWADDR, &ifr) < 0) {
+    perror("SIOCGIFHWADDR");
+    exit(1);
+  }
+  memcpy(ourMac, ifr.ifr_hwaddr.sa_data, 6);
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(L2BOOT_ETHERTYPE);
+  addr.sll_ifindex = ifindex;
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+}
+
+static void loadImage(const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+
+  struct stat st;
+  fstat(fileno(f), &st);
+  imageSize = st.st_size;
+  image = malloc(imageSize ? imageSize : 1);
+  if (!image || fread(image, 1, imageSize, f) != imageSize) {
+    fprintf(stderr, "%s: read failed\n", path);
+    exit(1);
+  }
+  fclose(f);
+}
+
+static uint32_t frameCount(void) {
+  // An empty image, or one that is a multiple of the frame size, still needs
+  // a final frame to carry the LAST flag
+  return imageSize / L2BOOT_MAX_DATA + 1;
+}
+
+static void sendData(const uint8_t dest[6], uint32_t frame) {
+  uint8_t buf[ETH_HEADER_SIZE + L2BOOT_HEADER_SIZE + L2BOOT_MAX_DATA];
+  size_t offset = (size_t)frame * L2BOOT_MAX_DATA;
+  size_t len = imageSize - offset;
+  if (len > L2BOOT_MAX_DATA) {
+    len = L2BOOT_MAX_DATA;
+  }
+
+  memcpy(buf, dest, 6);
+  memcpy(buf + 6, ourMac, 6);
+  buf[12] = L2BOOT_ETHERTYPE >> 8;
+  buf[13] = L2BOOT_ETHERTYPE & 0xff;
+  buf[14] = L2BOOT_TYPE_DATA;
+  buf[15] = (frame == frameCount() - 1) ? L2BOOT_FLAG_LAST : 0;
+  buf[16] = (frame >> 8) & 0xff;
+  buf[17] = frame & 0xff;
+  buf[18] = len >> 8;
+  buf[19] = len & 0xff;
+  memcpy(buf + ETH_HEADER_SIZE + L2BOOT_HEADER_SIZE, image + offset, len);
+
+  size_t frameLen = ETH_HEADER_SIZE + L2BOOT_HEADER_SIZE + len;
+  if (frameLen < ETH_MIN_FRAME) {
+    memset(buf + frameLen, 0, ETH_MIN_FRAME - frameLen);
+    frameLen = ETH_MIN_FRAME;
+  }
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_ifindex = ifindex;
+  addr.sll_halen = 6;
+  memcpy(addr.sll_addr, dest, 6);
+  if (sendto(sock, buf, frameLen, 0, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("sendto");
+  }
+}
+
+// Receive one L2BOOT frame, returns its type or 0 on timeout
+static int receiveFrame(int timeoutMs, uint8_t src[6], uint16_t* seq, uint8_t* payload, uint16_t* payloadLen) {
+  struct pollfd pfd = { .fd = sock, .events = POLLIN };
+  if (poll(&pfd, 1, timeoutMs) <= 0) {
+    return 0;
+  }
+
+  uint8_t buf[1600];
+  ssize_t n = recv(sock, buf, sizeof(buf), 0);
+  if (n < ETH_HEADER_SIZE + L2BOOT_HEADER_SIZE) {
+    return 0;
+  }
+  if (((buf[12] << 8) | buf[13]) != L2BOOT_ETHERTYPE || memcmp(buf + 6, ourMac, 6) == 0) {
+    return 0;
+  }
+
+  uint16_t len = (buf[18] << 8) | buf[19];
+  if (len > n - ETH_HEADER_SIZE - L2BOOT_HEADER_SIZE) {
+    return 0;
+  }
+
+  memcpy(src, buf + 6, 6);
+  *seq = (buf[16] << 8) | buf[17];
+  memcpy(payload, buf + ETH_HEADER_SIZE + L2BOOT_HEADER_SIZE, len);
+  *payloadLen = len;
+  return buf[14];
+}
+
+static void printMac(const uint8_t mac[6]) {
+  printf("%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+// Go-back-N transfer to one device, returns 0 when the whole image was ACKed
+static int serve(const uint8_t client[6], uint8_t window) {
+  const uint32_t total = frameCount();
+  uint32_t base = 0;
+  uint32_t next = 0;
+  int retries = 0;
+  // Only go back once per advance of base, the device repeats its ACK for
+  // every out of order frame still in flight
+  int wentBack = 0;
+  uint64_t deadline = nowMs() + RETRY_MS;
+  uint64_t start = nowMs();
+  uint32_t resent = 0;
+
+  while (base < total) {
+    while (next < total && next < base + window) {
+      sendData(client, next++);
+    }
+
+    uint8_t src[6];
+    uint16_t seq;
+    uint8_t payload[L2BOOT_MAX_DATA];
+    uint16_t len;
+    int wait = (int)(deadline > nowMs() ? deadline - nowMs() : 0);
+    int type = receiveFrame(wait, src, &seq, payload, &len);
+
+    if (type == 0) {
+      if (nowMs() < deadline) {
+        continue;
+      }
+      if (++retries > MAX_RETRIES) {
+        fprintf(stderr, "device stopped responding at frame %u\n", base);
+        return -1;
+      }
+      resent += next - base;
+      next = base;
+      deadline = nowMs() + RETRY_MS;
+      continue;
+    }
+
+    if (memcmp(src, client, 6) != 0) {
+      continue;
+    }
+
+    if (type == L2BOOT_TYPE_REQUEST) {
+      // The device restarted, so start over
+      base = next = 0;
+      window = len > 0 && payload[0] ? payload[0] : 1;
+      deadline = nowMs() + RETRY_MS;
+      continue;
+    }
+
+    if (type == L2BOOT_TYPE_ERROR) {
+      fprintf(stderr, "device rejected the image at frame %u\n", base);
+      return -1;
+    }
+
+    if (type != L2BOOT_TYPE_ACK) {
+      continue;
+    }
+
+    // Sequence numbers are 16 bit on the wire
+    uint32_t acked = base + (uint16_t)(seq - (base & 0xffff));
+    if (acked > next) {
+      continue;
+    }
+    if (len > 0 && payload[0]) {
+      window = payload[0];
+    }
+
+    if (acked > base) {
+      base = acked;
+      retries = 0;
+      wentBack = 0;
+      deadline = nowMs() + RETRY_MS;
+    } else if (!wentBack && next > base) {
+      // Duplicate ACK, the device lost a frame
+      resent += next - base;
+      next = base;
+      wentBack = 1;
+    }
+  }
+
+  uint64_t elapsed = nowMs() - start;
+  printf("sent %zu bytes in %llu ms (%u frames resent)\n", imageSize,
+         (unsigned long long)elapsed, resent);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  int once = 0;
+  int arg = 1;
+  if (arg < argc && strcmp(argv[arg], "-1") == 0) {
+    once = 1;
+    arg++;
+  }
+  if (argc - arg != 2) {
+    fprintf(stderr, "usage: %s [-1] <interface> <image.bin>\n", argv[0]);
+    return 1;
+  }
+
+  openInterface(argv[arg]);
+  loadImage(argv[arg + 1]);
+  printf("serving %zu bytes on %s as ", imageSize, argv[arg]);
+  printMac(ourMac);
+  printf("\n");
+
+  while (1) {
+    uint8_t src[6];
+    uint16_t seq;
+    uint8_t payload[L2BOOT_MAX_DATA];
+    uint16_t len;
+    if (receiveFrame(-1, src, &seq, payload, &len) != L2BOOT_TYPE_REQUEST || len < 2) {
+      continue;
+    }
+
+    payload[len - 1] = 0;
+    uint8_t window = payload[0] ? payload[0] : 1;
+    printMac(src);
+    printf(" requested '%s', window %u\n", (const char*)payload + 1, window);
+
+    int rc = serve(src, window);
+    if (once && rc == 0) {
+      return 0;
+    }
+  }
+}
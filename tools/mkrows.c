@@ -0,0 +1,89 @@
+// Row manifest generator for the TFTP_ROWS differential transfer
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//     mkrows [-c chunk] <image.bin> [image.bin.rows]
+//
+//  Writes the manifest next to the image unless told otherwise. See rows.h
+//  for the format. tftp_server builds the same manifest on the fly for
+//  images that don't have one.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "rows.h"
+
+int main(int argc, char** argv) {
+  uint32_t chunkSize = ROWS_ROW_SIZE;
+  int arg = 1;
+  if (arg + 1 < argc && strcmp(argv[arg], "-c") == 0) {
+    chunkSize = strtoul(argv[arg + 1], NULL, 0);
+    arg += 2;
+  }
+  if (argc - arg < 1 || argc - arg > 2 || chunkSize == 0 || chunkSize % ROWS_ROW_SIZE) {
+    fprintf(stderr, "usage: %s [-c chunk] <image.bin> [image.bin.rows]\n", argv[0]);
+    fprintf(stderr, "chunk must be a multiple of %u\n", ROWS_ROW_SIZE);
+    return 1;
+  }
+
+  const char* imagePath = argv[arg];
+  FILE* in = fopen(imagePath, "rb");
+  if (!in) {
+    perror(imagePath);
+    return 1;
+  }
+
+  char defaultPath[4096];
+  const char* rowsPath = argv[arg + 1];
+  if (!rowsPath) {
+    snprintf(defaultPath, sizeof(defaultPath), "%s.rows", imagePath);
+    rowsPath = defaultPath;
+  }
+
+  struct stat st;
+  fstat(fileno(in), &st);
+  size_t imageSize = st.st_size;
+  uint8_t* image = malloc(imageSize ? imageSize : 1);
+  if (!image || fread(image, 1, imageSize, in) != imageSize) {
+    fprintf(stderr, "%s: read failed\n", imagePath);
+    return 1;
+  }
+  fclose(in);
+
+  uint8_t* manifest;
+  size_t len = rowsBuild(image, imageSize, chunkSize, &manifest);
+  if (len == 0) {
+    fprintf(stderr, "%s: empty, or more than %u chunks (use a larger chunk size)\n", imagePath, ROWS_MAX_CHUNKS);
+    return 1;
+  }
+
+  FILE* out = fopen(rowsPath, "wb");
+  if (!out) {
+    perror(rowsPath);
+    return 1;
+  }
+  fwrite(manifest, 1, len, out);
+  if (fclose(out) != 0) {
+    perror(rowsPath);
+    return 1;
+  }
+
+  printf("%s: %zu bytes, %zu chunks of %u\n", rowsPath, imageSize, len / 4 - 3, chunkSize);
+  return 0;
+}
@@ -0,0 +1,91 @@
+// Row manifest format, shared by mkrows and tftp_server
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  Little endian 32 bit words: "ROWS", the chunk size, the image size, then
+//  the CRC-32 of every chunk. The last chunk only covers the image rounded
+//  up to whole flash rows, padded with 0xFF the way the bootloader pads the
+//  final row. The chunk size has to be a multiple of the device's flash row
+//  size (256 bytes on the SAMD21). The device side is in src/tftp.c.
+
+#ifndef __ROWS_H__
+#define __ROWS_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROWS_MAGIC      0x53574F52UL  // "ROWS"
+#define ROWS_ROW_SIZE   256
+#define ROWS_MAX_CHUNKS 1024
+
+static uint32_t rowsCrc32(const uint8_t* data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (len--) {
+    crc ^= *(data++);
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+static void rowsPutWord(uint8_t* ptr, uint32_t word) {
+  ptr[0] = word & 0xff;
+  ptr[1] = (word >> 8) & 0xff;
+  ptr[2] = (word >> 16) & 0xff;
+  ptr[3] = word >> 24;
+}
+
+// Build the manifest of an image into a malloc'd buffer. Returns its size,
+// or 0 if the image is empty or needs more than ROWS_MAX_CHUNKS chunks.
+static size_t rowsBuild(const uint8_t* image, size_t size, uint32_t chunkSize, uint8_t** manifest) {
+  if (size == 0 || chunkSize == 0 || chunkSize % ROWS_ROW_SIZE) {
+    return 0;
+  }
+  size_t chunks = (size + chunkSize - 1) / chunkSize;
+  if (chunks > ROWS_MAX_CHUNKS) {
+    return 0;
+  }
+
+  size_t len = (3 + chunks) * 4;
+  uint8_t* out = malloc(len);
+  uint8_t* padded = malloc(chunkSize);
+  if (!out || !padded) {
+    free(out);
+    free(padded);
+    return 0;
+  }
+
+  rowsPutWord(out, ROWS_MAGIC);
+  rowsPutWord(out + 4, chunkSize);
+  rowsPutWord(out + 8, size);
+  for (size_t i = 0; i < chunks; i++) {
+    size_t offset = i * chunkSize;
+    size_t n = (size - offset < chunkSize) ? size - offset : chunkSize;
+    size_t rows = (n + ROWS_ROW_SIZE - 1) / ROWS_ROW_SIZE;
+
+    memset(padded, 0xFF, chunkSize);
+    memcpy(padded, image + offset, n);
+    rowsPutWord(out + (3 + i) * 4, rowsCrc32(padded, rows * ROWS_ROW_SIZE));
+  }
+
+  free(padded);
+  *manifest = out;
+  return len;
+}
+
+#endif   // __ROWS_H__
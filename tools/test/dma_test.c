@@ -0,0 +1,216 @@
+// The SPI driver's DMA transfers against the SERCOM and DMAC models
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  Checks that DMA bursts move the same bytes as CPU (PIO) transfers and
+//  nothing outside the buffer, that the channel reports completion only
+//  once the last byte is in, and that netReadPacketBegin() really lets a row
+//  be programmed while the DMAC reads the next one.
+
+#include <stdio.h>
+#include <string.h>
+#include "host.h"
+#include "w5500_model.h"
+#include "networking.h"
+#include "w5x00.h"
+#include "spi.h"
+#include "flash.h"
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+static int failures;
+
+#define BURST       (300U)
+#define GUARD       (16U)
+#define GUARD_BYTE  (0xA5)
+
+#define TEST_SOCKET (NET_SOCKET_TFTP)
+#define TEST_PORT   (4000U)
+// The TX buffer reads back, with the RWB bit of the control byte clear
+#define TX_WRITE_CB SOCK_TXBUF_CB(TEST_SOCKET)
+#define TX_READ_CB  ((uint8_t) (SOCK_TXBUF_CB(TEST_SOCKET) & ~0x04))
+
+static const uint8_t localIp[4] = { 192, 168, 1, 10 };
+static const uint8_t serverIp[4] = { 192, 168, 1, 1 };
+
+static bool initOk;
+
+static void deviceInit(void) {
+  initOk = netInit();
+  memcpy(netConfig.ipAddr, localIp, 4);
+  netCommitConfig();
+}
+
+static uint8_t pattern[BURST];
+static uint8_t viaPio[BURST];
+static uint8_t viaDma[GUARD + BURST + GUARD];
+
+// Write the pattern into a TX buffer with one DMA burst, read it back once
+// in PIO sized pieces and once as a single DMA burst
+static void deviceDmaMatchesPio(void) {
+  const uint8_t piece = SPI_DMA_MIN_SIZE - 1;
+
+  w5x00WriteBuffer(0, TX_WRITE_CB, pattern, BURST);
+
+  for (uint16_t done = 0; done < BURST; done += piece) {
+    uint16_t len = BURST - done < piece ? BURST - done : piece;
+    w5x00ReadBuffer(done, TX_READ_CB, viaPio + done, len);
+  }
+
+  memset(viaDma, GUARD_BYTE, sizeof(viaDma));
+  w5x00ReadBuffer(0, TX_READ_CB, viaDma + GUARD, BURST);
+}
+
+static void testDmaMatchesPio(void) {
+  for (uint16_t i = 0; i < BURST; i++) {
+    pattern[i] = i * 7 + (i >> 8);
+  }
+  CHECK(hostRun(deviceDmaMatchesPio, HOST_MS(100)) == HOST_EXIT_RETURN, "burst transfer didn't finish");
+
+  CHECK(memcmp(viaPio, pattern, BURST) == 0, "PIO read back differs from what DMA wrote");
+  CHECK(memcmp(viaDma + GUARD, pattern, BURST) == 0, "DMA read back differs from what DMA wrote");
+  for (uint16_t i = 0; i < GUARD; i++) {
+    CHECK(viaDma[i] == GUARD_BYTE, "DMA wrote %u bytes before the buffer", GUARD - i);
+    CHECK(viaDma[GUARD + BURST + i] == GUARD_BYTE, "DMA wrote past the end of the buffer");
+  }
+}
+
+static bool busyAfterStart;
+static bool busyAfterEnd;
+static uint64_t burstCycles;
+static uint64_t burstBytes;
+static uint8_t baud;
+
+// A read burst is busy until the last byte has been clocked in, and the
+// CPU gets control back right after starting it
+static void deviceCompletion(void) {
+  baud = spiGetBaud();
+
+  uint64_t bytes = spiModelBytes();
+  w5x00ReadBufferBegin(0, TX_READ_CB, viaDma + GUARD, BURST);
+  uint64_t start = hostNow();
+  busyAfterStart = w5x00TransferBusy();
+  w5x00TransferEnd();
+  burstCycles = hostNow() - start;
+  busyAfterEnd = w5x00TransferBusy();
+  burstBytes = spiModelBytes() - bytes;
+}
+
+static void testCompletion(void) {
+  CHECK(hostRun(deviceCompletion, HOST_MS(100)) == HOST_EXIT_RETURN, "burst didn't complete");
+
+  uint64_t byteCycles = 16ULL * (baud + 1U);
+  CHECK(busyAfterStart, "channel not busy right after the start");
+  CHECK(!busyAfterEnd, "channel still busy after w5x00TransferEnd()");
+  CHECK(burstBytes == 3 + BURST, "%llu bytes on the bus for a %u byte burst",
+        (unsigned long long) burstBytes, BURST);
+  // Back to back bytes, the DMAC keeps the holding register full
+  CHECK(burstCycles <= (BURST + 1) * byteCycles, "burst took %llu cycles, %llu per byte expected",
+        (unsigned long long) burstCycles, (unsigned long long) byteCycles);
+  CHECK(burstCycles >= (BURST - 1) * byteCycles, "burst done after %llu cycles, too early for %u bytes",
+        (unsigned long long) burstCycles, BURST);
+}
+
+// Three rows of payload in one datagram. The first row fills the flash
+// accumulator, the second is read while the first is programmed, the third
+// is read and only then the second programmed.
+#define ROW       (256U)
+#define ROWS      (3U)
+
+static uint8_t datagram[ROWS * ROW];
+static uint16_t peeked;
+static uint64_t overlapped;
+static uint64_t sequential;
+
+static void deviceOverlap(void) {
+  netOpenUdpSocket(TEST_SOCKET, TEST_PORT);
+  flash_init();
+
+  uint32_t space;
+  uint8_t* dest;
+  while ((peeked = netPeekPacket(TEST_SOCKET, NULL, 0, NULL, NULL)) == 0);
+
+  dest = flash_buffer_get(&space);
+  netReadPacket(TEST_SOCKET, dest, space);
+  flash_buffer_commit_deferred(space);
+
+  uint64_t start = hostNow();
+  dest = flash_buffer_get(&space);
+  netReadPacketBegin(TEST_SOCKET, dest, space);
+  flash_program_pending();
+  netReadPacketEnd();
+  overlapped = hostNow() - start;
+  flash_buffer_commit_deferred(space);
+
+  start = hostNow();
+  dest = flash_buffer_get(&space);
+  netReadPacket(TEST_SOCKET, dest, space);
+  flash_program_pending();
+  sequential = hostNow() - start;
+  flash_buffer_commit_deferred(space);
+
+  netConsumePacket(TEST_SOCKET);
+  flash_finish();
+}
+
+static void deliverDatagram(void* arg) {
+  (void) arg;
+  w5500ModelDeliverUdp(serverIp, 69, localIp, TEST_PORT, datagram, sizeof(datagram));
+}
+
+static void testOverlap(void) {
+  for (uint16_t i = 0; i < sizeof(datagram); i++) {
+    datagram[i] = (i * 13) ^ (i >> 8);
+  }
+  hostSchedule(hostNow() + HOST_MS(1), deliverDatagram, NULL);
+  CHECK(hostRun(deviceOverlap, HOST_MS(500)) == HOST_EXIT_RETURN, "overlapped read didn't finish");
+
+  CHECK(peeked == sizeof(datagram), "datagram of %u bytes, %u expected", peeked, (unsigned) sizeof(datagram));
+  CHECK(memcmp(nvmModelApplication(), datagram, sizeof(datagram)) == 0, "flash differs from the datagram");
+  CHECK(nvmModelWrites() == ROWS * 4, "%u pages written, %u expected", nvmModelWrites(), ROWS * 4);
+
+  // The overlapped read costs about the header, the sequential one the whole row
+  uint64_t saved = sequential > overlapped ? sequential - overlapped : 0;
+  uint64_t row = ROW * 16ULL * (baud + 1U);
+  CHECK(saved >= row * 9 / 10, "overlapping saved %llu cycles, a row takes %llu on the bus",
+        (unsigned long long) saved, (unsigned long long) row);
+  printf("row read + program: sequential %.1fus, overlapped %.1fus\n",
+         hostSeconds(sequential) * 1e6, hostSeconds(overlapped) * 1e6);
+}
+
+int main(void) {
+  hostInit();
+
+  CHECK(hostRun(deviceInit, HOST_MS(100)) == HOST_EXIT_RETURN, "netInit() didn't return");
+  CHECK(initOk, "netInit() failed");
+  if (failures) {
+    return 1;
+  }
+
+  testDmaMatchesPio();
+  testCompletion();
+  testOverlap();
+
+  printf("%s: %s\n", __FILE__, failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,271 @@
+// The L2BOOT receive state machine against a recorded session
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  l2boot_transfer.pcap was recorded on a veth pair: tools/l2boot_sender -1
+//  serving a 14000 byte image on one end, and on the other a stand-in
+//  device with the MAC of the host build (00:aa:bb:cc:de:02) that follows
+//  l2boot.c's rules (window 5, an ACK every third frame in order and for
+//  every frame out of order) and lost frame 3 the first time. It holds what
+//  that device sent and received, in order.
+//
+//  The replay hands the sender's frames to the MACRAW socket and, at every
+//  frame the recording has the device sending, waits for l2boot.c to send
+//  exactly that frame, well within its retry time so that a retry can't
+//  stand in for a missing answer. Cut short, the same recording covers a
+//  sender that stalls, and with nothing but the REQUEST, no sender at all.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host.h"
+#include "w5500_model.h"
+#include "networking.h"
+#include "l2boot.h"
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+static int failures;
+
+#define RECORDING       "test/l2boot_transfer.pcap"
+#define MAX_FRAMES      (64)
+#define MAX_FRAME_SIZE  (1514U)
+#define ETH_HEADER_SIZE (14U)
+// Three retry periods of l2boot.c without a frame from the sender, and how
+// soon an answer has to come to be one (a retry takes 200ms)
+#define QUIET_TIME      HOST_MS(700)
+#define ANSWER_TIME     HOST_MS(50)
+
+static const uint8_t deviceMac[6] = { 0x00, 0xAA, 0xBB, 0xCC, 0xDE, 0x02 };
+
+typedef struct {
+  uint16_t len;
+  bool fromDevice;
+  uint8_t data[MAX_FRAME_SIZE];
+} frame_t;
+
+static frame_t frames[MAX_FRAMES];
+static uint16_t frameCount;
+
+static uint8_t image[16 * 1024];
+static uint32_t imageSize;
+
+static uint16_t get16(const uint8_t* p) {
+  return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32le(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// A classic pcap file, microsecond timestamps and Ethernet link type
+static bool loadRecording(const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+
+  uint8_t header[24];
+  bool ok = fread(header, sizeof(header), 1, f) == 1 && get32le(header) == 0xA1B2C3D4 &&
+            get32le(header + 20) == 1;
+  uint8_t record[16];
+  while (ok && fread(record, sizeof(record), 1, f) == 1) {
+    uint32_t len = get32le(record + 8);
+    frame_t* frame = &frames[frameCount];
+    if (frameCount == MAX_FRAMES || len != get32le(record + 12) || len < ETH_HEADER_SIZE + L2BOOT_HEADER_SIZE ||
+        len > MAX_FRAME_SIZE || fread(frame->data, len, 1, f) != 1) {
+      ok = false;
+      break;
+    }
+    frame->len = len;
+    frame->fromDevice = memcmp(frame->data + 6, deviceMac, 6) == 0;
+    frameCount++;
+
+    // The image is what the DATA frames carry
+    const uint8_t* head = frame->data + ETH_HEADER_SIZE;
+    if (!frame->fromDevice && head[0] == L2BOOT_TYPE_DATA) {
+      uint32_t offset = get16(head + 2) * L2BOOT_MAX_DATA;
+      uint16_t dataLen = get16(head + 4);
+      if (offset + dataLen > sizeof(image)) {
+        ok = false;
+        break;
+      }
+      memcpy(image + offset, head + L2BOOT_HEADER_SIZE, dataLen);
+      if (head[1] & L2BOOT_FLAG_LAST) {
+        imageSize = offset + dataLen;
+      }
+    }
+  }
+  fclose(f);
+
+  if (!ok || frameCount == 0 || !frames[0].fromDevice) {
+    fprintf(stderr, "%s: not a recorded L2BOOT session\n", path);
+    return false;
+  }
+  return true;
+}
+
+// Replay state. Events of an earlier replay carry an old epoch and do nothing.
+static struct {
+  uintptr_t epoch;
+  // Next frame of the recording, and where this replay stops
+  uint16_t next;
+  uint16_t end;
+  bool mismatch;
+  // When the last frame went either way
+  uint64_t lastFrame;
+  // Frames the device sent once the replay was over, and the last of them
+  uint16_t extra;
+  frame_t last;
+} replay;
+
+static void replayDeliver(void* arg) {
+  if ((uintptr_t) arg != replay.epoch || replay.next == replay.end || frames[replay.next].fromDevice) {
+    return;
+  }
+
+  // The sender's frames arrive back to back, and wait while the RX buffer is full
+  frame_t* frame = &frames[replay.next];
+  if (w5500ModelDeliverFrame(frame->data, frame->len)) {
+    replay.next++;
+    replay.lastFrame = hostNow();
+  }
+  hostSchedule(hostNow() + w5500ModelWireTime(frame->len, false), replayDeliver, arg);
+}
+
+static void replaySent(uint8_t socket, const uint8_t* data, uint16_t len,
+                       const uint8_t address[4], uint16_t port, void* context) {
+  (void) address;
+  (void) port;
+  (void) context;
+
+  CHECK(socket == NET_SOCKET_MACRAW, "device sent on socket %u", socket);
+  if (replay.mismatch || replay.next == replay.end) {
+    replay.extra++;
+    replay.last.len = len;
+    memcpy(replay.last.data, data, len);
+    return;
+  }
+
+  frame_t* frame = &frames[replay.next];
+  if (!frame->fromDevice || len != frame->len || memcmp(data, frame->data, len) != 0) {
+    CHECK(false, "frame %u: device sent type %u seq %u, the recording has %s type %u seq %u",
+          replay.next, data[ETH_HEADER_SIZE], get16(data + ETH_HEADER_SIZE + 2),
+          frame->fromDevice ? "it sending" : "the sender sending", frame->data[ETH_HEADER_SIZE],
+          get16(frame->data + ETH_HEADER_SIZE + 2));
+    replay.mismatch = true;
+    return;
+  }
+  CHECK(hostNow() - replay.lastFrame <= ANSWER_TIME, "frame %u: sent after %.1fms, a retry rather than an answer",
+        replay.next, hostSeconds(hostNow() - replay.lastFrame) * 1e3);
+  replay.next++;
+  replay.lastFrame = hostNow();
+  replayDeliver((void*) replay.epoch);
+}
+
+static void deviceListen(void) {
+  netInit();
+  l2bootInit();
+  l2bootRequestFile("app.bin");
+  while (1) {
+    l2bootRun();
+  }
+}
+
+static hostExit_t replayRun(uint16_t end, uint64_t limit) {
+  replay.epoch++;
+  replay.next = 0;
+  replay.end = end;
+  replay.mismatch = false;
+  replay.extra = 0;
+  replay.lastFrame = hostNow();
+  w5500ModelOnSend(replaySent, NULL);
+
+  return hostRun(deviceListen, limit);
+}
+
+static void testTransfer(void) {
+  uint64_t start = hostNow();
+  hostExit_t exit = replayRun(frameCount, HOST_MS(10000));
+  double seconds = hostSeconds(hostNow() - start);
+
+  CHECK(exit == HOST_EXIT_RESET, "transfer didn't end in startApplication()");
+  CHECK(replay.next == frameCount, "replay stopped at frame %u of %u", replay.next, frameCount);
+  CHECK(replay.extra == 0, "device sent %u frames the recording doesn't have", replay.extra);
+  CHECK(l2bootActive(), "sender not locked after the transfer");
+  CHECK(memcmp(nvmModelApplication(), image, imageSize) == 0, "flash differs from the image");
+  printf("recorded transfer: %u frames, %lu bytes in %.3fs\n", frameCount, (unsigned long) imageSize, seconds);
+}
+
+// The sender answers the REQUEST, then goes quiet after the first ACK. The
+// device must keep repeating that ACK, and report the transfer as stalled.
+static void testStalled(void) {
+  uint16_t end = 1;
+  while (end < frameCount && (!frames[end].fromDevice || frames[end].data[ETH_HEADER_SIZE] != L2BOOT_TYPE_ACK)) {
+    end++;
+  }
+  CHECK(end < frameCount, "the recording has no ACK");
+  end++;
+
+  hostExit_t exit = replayRun(end, QUIET_TIME);
+  const uint8_t* head = replay.last.data + ETH_HEADER_SIZE;
+  CHECK(exit == HOST_EXIT_TIMEOUT, "stalled transfer ended");
+  CHECK(replay.next == end, "replay stopped at frame %u of %u", replay.next, end);
+  CHECK(l2bootActive(), "stalled transfer taken for a missing sender");
+  CHECK(replay.extra >= 3, "%u ACKs repeated while the sender was quiet", replay.extra);
+  CHECK(replay.extra == 0 || (replay.last.len == frames[end - 1].len &&
+        memcmp(replay.last.data, frames[end - 1].data, replay.last.len) == 0),
+        "device sent type %u seq %u instead of repeating its ACK", head[0], get16(head + 2));
+}
+
+// Nobody answers: the REQUEST is repeated and no sender is locked
+static void testNoSender(void) {
+  hostExit_t exit = replayRun(1, QUIET_TIME);
+
+  CHECK(exit == HOST_EXIT_TIMEOUT, "device without a sender exited");
+  CHECK(!replay.mismatch && replay.next == 1, "first frame isn't the recorded REQUEST");
+  CHECK(!l2bootActive(), "sender locked without any DATA");
+  CHECK(replay.extra >= 3, "%u REQUESTs repeated", replay.extra);
+  CHECK(replay.extra == 0 || (replay.last.len == frames[0].len &&
+        memcmp(replay.last.data, frames[0].data, frames[0].len) == 0),
+        "device sent something other than its REQUEST");
+}
+
+int main(int argc, char** argv) {
+  if (!loadRecording(argc > 1 ? argv[1] : RECORDING)) {
+    return 1;
+  }
+
+  hostInit();
+  // Programming the rows of a frame at the datasheet maxima takes about half
+  // the retry time. A hundred times faster flash keeps the answers prompt.
+  nvmModelTiming(HOST_US(60), HOST_US(25));
+
+  testTransfer();
+  testStalled();
+  testNoSender();
+
+  printf("%s: %s\n", __FILE__, failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
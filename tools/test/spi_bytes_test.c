@@ -0,0 +1,163 @@
+// SPI traffic per received byte, byte-at-a-time reads against bursts
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  legacyReceivePacket() is the receive path as it was before the burst
+//  reads: a w5x00ReadReg() frame (3 header bytes and 1 data byte) for every
+//  byte of RX_RSR, RX_RD, the UDP header and the payload. The same
+//  datagrams are received with it and with netReceivePacket(), counting the
+//  bytes clocked on the SPI bus and the CS frames.
+
+#include <stdio.h>
+#include <string.h>
+#include "host.h"
+#include "w5500_model.h"
+#include "networking.h"
+#include "w5x00.h"
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+static int failures;
+
+#define TEST_SOCKET (NET_SOCKET_TFTP)
+#define TEST_PORT   (4000U)
+#define MAX_PAYLOAD (1468U)
+
+static const uint8_t localIp[4] = { 192, 168, 1, 10 };
+static const uint8_t serverIp[4] = { 192, 168, 1, 1 };
+
+static uint16_t legacyReadWord(uint16_t address) {
+  return ((uint16_t) w5x00ReadReg(address, SOCK_R_CB(TEST_SOCKET)) << 8) |
+         w5x00ReadReg(address + 1, SOCK_R_CB(TEST_SOCKET));
+}
+
+static void legacyReadBuffer(uint16_t* readPointer, uint8_t* buffer, uint16_t len) {
+  for (uint16_t i = 0; i < len; i++) {
+    buffer[i] = w5x00ReadReg((*readPointer)++, SOCK_RXBUF_CB(TEST_SOCKET));
+  }
+}
+
+static uint16_t legacyReceivePacket(uint8_t* buffer) {
+  uint16_t val = 0, val1 = 0;
+  do {
+    val1 = legacyReadWord(REG_SN_RX_RSR0);
+    if (val1 != 0) {
+      val = legacyReadWord(REG_SN_RX_RSR0);
+    }
+  } while (val != val1);
+  if (val == 0) {
+    return 0;
+  }
+
+  uint16_t readPointer = legacyReadWord(REG_SN_RX_RD0);
+
+  uint8_t head[8];
+  legacyReadBuffer(&readPointer, head, sizeof(head));
+  uint16_t dataSize = (head[6] << 8) + head[7];
+  legacyReadBuffer(&readPointer, buffer, dataSize);
+
+  w5x00WriteReg(REG_SN_RX_RD0, SOCK_W_CB(TEST_SOCKET), readPointer >> 8);
+  w5x00WriteReg(REG_SN_RX_RD1, SOCK_W_CB(TEST_SOCKET), readPointer & 0xFF);
+  w5x00WriteReg(REG_SN_CR, SOCK_W_CB(TEST_SOCKET), CR_RECV);
+  while (w5x00ReadReg(REG_SN_CR, SOCK_R_CB(TEST_SOCKET)));
+
+  return dataSize;
+}
+
+static bool initOk;
+
+static void deviceInit(void) {
+  initOk = netInit();
+  memcpy(netConfig.ipAddr, localIp, 4);
+  netCommitConfig();
+  netOpenUdpSocket(TEST_SOCKET, TEST_PORT);
+}
+
+static uint8_t sent[MAX_PAYLOAD];
+static uint8_t received[MAX_PAYLOAD];
+static uint16_t receivedSize;
+
+static void deviceLegacy(void) {
+  receivedSize = legacyReceivePacket(received);
+}
+
+static void deviceBurst(void) {
+  receivedSize = netReceivePacket(TEST_SOCKET, received, NULL, NULL);
+  // The RX_RD write and RECV are staged until the next access
+  w5x00Flush();
+}
+
+typedef struct {
+  uint64_t bytes;
+  uint32_t frames;
+} traffic_t;
+
+static traffic_t receiveWith(void (*fn)(void), uint16_t len) {
+  w5500ModelDeliverUdp(serverIp, 69, localIp, TEST_PORT, sent, len);
+  memset(received, 0, sizeof(received));
+
+  uint64_t bytes = spiModelBytes();
+  uint32_t frames = w5500ModelStats()->spiFrames;
+  CHECK(hostRun(fn, HOST_MS(100)) == HOST_EXIT_RETURN, "receive didn't finish");
+  CHECK(receivedSize == len, "received %u bytes, %u sent", receivedSize, len);
+  CHECK(memcmp(received, sent, len) == 0, "received payload differs");
+
+  traffic_t traffic = { spiModelBytes() - bytes, w5500ModelStats()->spiFrames - frames };
+  return traffic;
+}
+
+int main(void) {
+  static const uint16_t sizes[] = { 8, 512, 1024, MAX_PAYLOAD };
+
+  hostInit();
+  CHECK(hostRun(deviceInit, HOST_MS(100)) == HOST_EXIT_RETURN, "netInit() didn't return");
+  CHECK(initOk, "netInit() failed");
+  if (failures) {
+    return 1;
+  }
+
+  for (uint16_t i = 0; i < sizeof(sent); i++) {
+    sent[i] = i ^ (i >> 8);
+  }
+
+  printf("payload  byte-at-a-time (SPI bytes/byte, frames)  burst (SPI bytes/byte, frames)\n");
+  for (uint8_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    uint16_t len = sizes[i];
+    traffic_t legacy = receiveWith(deviceLegacy, len);
+    traffic_t burst = receiveWith(deviceBurst, len);
+
+    printf("%7u  %14.2f %6u  %32.2f %6u\n", len,
+           (double) legacy.bytes / len, legacy.frames, (double) burst.bytes / len, burst.frames);
+
+    // A frame per byte costs 4 bytes on the bus. A burst costs the payload
+    // and the UDP header plus a fixed few frames for RX_RSR, RX_RD and RECV.
+    CHECK(legacy.bytes >= 4ULL * (len + 8), "byte-at-a-time receive of %u bytes took only %llu SPI bytes",
+          len, (unsigned long long) legacy.bytes);
+    CHECK(burst.bytes <= len + 8U + 32U, "burst receive of %u bytes took %llu SPI bytes",
+          len, (unsigned long long) burst.bytes);
+    CHECK(burst.frames <= 6, "burst receive of %u bytes took %u frames", len, burst.frames);
+  }
+
+  printf("%s: %s\n", __FILE__, failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,182 @@
+// Striped TFTP transfers against servers of different speeds
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  Boots a TFTP_STRIPES build from the request to startApplication()
+//  against one to four stand-in servers, each limited to its own rate like
+//  a loaded build box or a congested uplink, and reports the simulated end
+//  to end time of each set. Servers of the same speed should add up, and a
+//  fast server that is done takes over the rest of a slow one's stripe, so
+//  adding a slow server never costs time. With a server that is down, the
+//  transfer must still finish, and tftpRun() must not go quiet for long
+//  enough that the bootloader times out and boots a half written image.
+
+#include <stdio.h>
+#include <string.h>
+#include "host.h"
+#include "tftp_peer.h"
+#include "networking.h"
+#include "tftp.h"
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+static int failures;
+
+// 16 rows for each of four stripes at least
+#define IMAGE_SIZE      (65536U)
+#define SERVER_TIMEOUT  HOST_MS(1000)
+#define LATENCY         HOST_US(200)
+#define SLOW            (100U * 1024U)
+#define FAST            (1024U * 1024U)
+// main.c's BOOTLOADER_MAX_RUN_TIME
+#define MAX_IDLE        HOST_MS(5000)
+
+static const uint8_t localIp[4] = { 192, 168, 1, 10 };
+
+static uint8_t image[IMAGE_SIZE];
+
+typedef struct {
+  const char* name;
+  uint8_t count;
+  uint32_t rates[TFTP_PEER_MAX];
+  bool down[TFTP_PEER_MAX];
+  uint64_t time;
+  uint32_t requests;
+  uint32_t ranges;
+  // Longest stretch of tftpRun() calls that all returned false
+  uint64_t idle;
+} run_t;
+
+static run_t* current;
+
+static void deviceBoot(void) {
+  netInit();
+  memcpy(netConfig.ipAddr, localIp, 4);
+  netCommitConfig();
+  // As from DHCP option 150
+  for (uint8_t i = 0; i < current->count; i++) {
+    const uint8_t server[4] = { 192, 168, 1, 1 + i };
+    memcpy(netConfig.tftpServers[i], server, 4);
+  }
+  netConfig.tftpServerCount = current->count;
+
+  tftpInit();
+  tftpRequestFile(netConfig.tftpServers[0], "app.bin");
+  uint64_t busy = hostNow();
+  while (1) {
+    if (tftpRun()) {
+      busy = hostNow();
+    } else if (hostNow() - busy > current->idle) {
+      current->idle = hostNow() - busy;
+    }
+  }
+}
+
+static void transfer(run_t* run, uint8_t seed) {
+  // A new image every run, the flash skips rows that don't change
+  for (uint32_t i = 0; i < sizeof(image); i++) {
+    image[i] = (i * 31) ^ (i >> 9) ^ seed;
+  }
+  tftpPeerInit(localIp, image, sizeof(image));
+  for (uint8_t i = 0; i < run->count; i++) {
+    const tftpPeerConfig_t server = {
+      .address = { 192, 168, 1, 1 + i },
+      .latency = LATENCY,
+      .timeout = SERVER_TIMEOUT,
+      .rate = run->rates[i],
+      .down = run->down[i],
+    };
+    tftpPeerAdd(&server);
+  }
+
+  current = run;
+  run->idle = 0;
+  uint64_t start = hostNow();
+  hostExit_t exit = hostRun(deviceBoot, HOST_MS(60000));
+  run->time = hostNow() - start;
+  run->requests = 0;
+  run->ranges = 0;
+  for (uint8_t i = 0; i < run->count; i++) {
+    run->requests += tftpPeerStats(i)->requests;
+    run->ranges += tftpPeerStats(i)->ranges;
+  }
+
+  CHECK(exit == HOST_EXIT_RESET, "%s: transfer didn't finish", run->name);
+  CHECK(memcmp(nvmModelApplication(), image, sizeof(image)) == 0, "%s: flash differs from the image", run->name);
+}
+
+int main(void) {
+  static run_t runs[] = {
+    { .name = "1 slow", .count = 1, .rates = { SLOW } },
+    { .name = "2 slow", .count = 2, .rates = { SLOW, SLOW } },
+    { .name = "4 slow", .count = 4, .rates = { SLOW, SLOW, SLOW, SLOW } },
+    { .name = "1 fast", .count = 1, .rates = { FAST } },
+    { .name = "4 fast", .count = 4, .rates = { FAST, FAST, FAST, FAST } },
+    { .name = "fast + slow", .count = 2, .rates = { FAST, SLOW } },
+    { .name = "slow + fast", .count = 2, .rates = { SLOW, FAST } },
+    { .name = "fast + down", .count = 2, .rates = { FAST, FAST }, .down = { false, true } },
+  };
+  enum { ONE_SLOW, TWO_SLOW, FOUR_SLOW, ONE_FAST, FOUR_FAST, FAST_SLOW, SLOW_FAST, FAST_DOWN };
+
+  hostInit();
+  // Programming a row takes longer than receiving it from a fast server. A
+  // hundred times faster flash leaves the servers as the bottleneck.
+  nvmModelTiming(HOST_US(60), HOST_US(25));
+
+  printf("servers        time   KB/s  RRQs\n");
+  for (uint8_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+    run_t* run = &runs[i];
+    transfer(run, i);
+    printf("%-12s %6.3fs  %5.0f  %4u\n", run->name, hostSeconds(run->time),
+           IMAGE_SIZE / 1024.0 / hostSeconds(run->time), run->requests);
+  }
+
+  // Every RRQ but the one that learns the size asks for a range, one per
+  // stripe and one for each takeover
+  for (uint8_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+    CHECK(runs[i].count == 1 || runs[i].requests == runs[i].ranges + 1, "%s: striped transfer fell back",
+          runs[i].name);
+  }
+  // Equal stripes from servers of the same speed come in side by side
+  CHECK(runs[TWO_SLOW].time * 10 <= runs[ONE_SLOW].time * 6, "2 slow servers: %.3fs, 1 alone: %.3fs",
+        hostSeconds(runs[TWO_SLOW].time), hostSeconds(runs[ONE_SLOW].time));
+  CHECK(runs[FOUR_SLOW].time * 10 <= runs[ONE_SLOW].time * 4, "4 slow servers: %.3fs, 1 alone: %.3fs",
+        hostSeconds(runs[FOUR_SLOW].time), hostSeconds(runs[ONE_SLOW].time));
+  // Fast servers outrun the device, so striping doesn't help but mustn't hurt
+  CHECK(runs[FOUR_FAST].time <= runs[ONE_FAST].time, "4 fast servers: %.3fs, 1 alone: %.3fs",
+        hostSeconds(runs[FOUR_FAST].time), hostSeconds(runs[ONE_FAST].time));
+  // The fast server takes over most of the slow one's stripe, so adding a
+  // slow server costs nothing
+  CHECK(runs[FAST_SLOW].time <= runs[ONE_FAST].time, "fast + slow: %.3fs, fast alone: %.3fs",
+        hostSeconds(runs[FAST_SLOW].time), hostSeconds(runs[ONE_FAST].time));
+  // Behind the second socket's smaller buffer a fast server is slower, but
+  // still takes over
+  CHECK(runs[SLOW_FAST].time * 4 <= runs[ONE_SLOW].time, "slow + fast: %.3fs, slow alone: %.3fs",
+        hostSeconds(runs[SLOW_FAST].time), hostSeconds(runs[ONE_SLOW].time));
+  // A server that never answers is taken over long before its retries run out
+  CHECK(runs[FAST_DOWN].time <= runs[ONE_FAST].time * 2, "fast + down: %.3fs, fast alone: %.3fs",
+        hostSeconds(runs[FAST_DOWN].time), hostSeconds(runs[ONE_FAST].time));
+  // The bootloader gives up after MAX_IDLE without a busy tftpRun()
+  for (uint8_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+    CHECK(runs[i].idle < MAX_IDLE, "%s: tftpRun() idle for %.3fs", runs[i].name, hostSeconds(runs[i].idle));
+  }
+
+  printf("%s: %s\n", __FILE__, failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+// TFTP transfer time against packet loss
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  Boots the TFTP client from the request to startApplication() against a
+//  stand-in server that only retransmits after a second, like tftpd-hpa,
+//  while dropping a share of the packets both ways. Reports the simulated
+//  end to end time of each run and what every lost packet cost on average,
+//  which the client's own retransmission timer should keep far below the
+//  server's timeout. The flash programs at its datasheet speed, so blocks
+//  queue up in the socket while rows are written. Without loss, none may
+//  be dropped for lack of room.
+
+#include <stdio.h>
+#include <string.h>
+#include "host.h"
+#include "tftp_peer.h"
+#include "w5500_model.h"
+#include "networking.h"
+#include "tftp.h"
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+static int failures;
+
+#define IMAGE_SIZE      (40000U)
+#define SERVER_TIMEOUT  HOST_MS(1000)
+#define LATENCY         HOST_US(100)
+// Average cost of a lost packet that still counts as recovered by the client.
+// A window takes a few hundred ms to program, which the RTO follows.
+#define MAX_LOSS_COST   HOST_MS(500)
+
+static const uint8_t localIp[4] = { 192, 168, 1, 10 };
+static const uint8_t serverIp[4] = { 192, 168, 1, 1 };
+
+static uint8_t image[IMAGE_SIZE];
+
+static void deviceBoot(void) {
+  netInit();
+  memcpy(netConfig.ipAddr, localIp, 4);
+  netCommitConfig();
+
+  tftpInit();
+  tftpRequestFile(serverIp, "app.bin");
+  while (1) {
+    tftpRun();
+  }
+}
+
+typedef struct {
+  uint16_t lossPerMille;
+  uint64_t time;
+  uint32_t dropped;
+  tftpPeerStats_t stats;
+} run_t;
+
+static void transfer(run_t* run) {
+  const tftpPeerConfig_t server = {
+    .address = { 192, 168, 1, 1 },
+    .latency = LATENCY,
+    .timeout = SERVER_TIMEOUT,
+  };
+
+  // A new image every run, the flash skips rows that don't change
+  for (uint32_t i = 0; i < sizeof(image); i++) {
+    image[i] = (i * 31) ^ (i >> 9) ^ run->lossPerMille;
+  }
+  tftpPeerInit(localIp, image, sizeof(image));
+  uint8_t peer = tftpPeerAdd(&server);
+  tftpPeerLoss(run->lossPerMille, 0x2545F491);
+
+  uint64_t start = hostNow();
+  uint32_t dropped = w5500ModelStats()->dropped;
+  hostExit_t exit = hostRun(deviceBoot, HOST_MS(60000));
+  run->time = hostNow() - start;
+  run->dropped = w5500ModelStats()->dropped - dropped;
+  run->stats = *tftpPeerStats(peer);
+
+  CHECK(exit == HOST_EXIT_RESET, "%u/1000 loss: transfer didn't finish", run->lossPerMille);
+  CHECK(memcmp(nvmModelApplication(), image, sizeof(image)) == 0, "%u/1000 loss: flash differs from the image",
+        run->lossPerMille);
+  // Under loss the server goes back while the rest of a window is still on
+  // its way, and some of the repeated blocks find the socket full
+  CHECK(run->lossPerMille || run->dropped == 0, "%u packets didn't fit the socket", run->dropped);
+}
+
+int main(void) {
+  static run_t runs[] = {
+    { .lossPerMille = 0 },
+    { .lossPerMille = 20 },
+    { .lossPerMille = 50 },
+    { .lossPerMille = 100 },
+    { .lossPerMille = 200 },
+  };
+
+  hostInit();
+  printf("loss     time   lost  dropped  server timeouts  cost per lost packet\n");
+  for (uint8_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+    run_t* run = &runs[i];
+    transfer(run);
+
+    printf("%4.1f%%  %6.3fs  %5u  %7u  %15u", run->lossPerMille / 10.0, hostSeconds(run->time),
+           run->stats.lost, run->dropped, run->stats.timeouts);
+    if (run->stats.lost) {
+      uint64_t cost = run->time > runs[0].time ? (run->time - runs[0].time) / run->stats.lost : 0;
+      printf("  %17.1fms\n", hostSeconds(cost) * 1e3);
+      CHECK(cost <= MAX_LOSS_COST, "%u/1000 loss: %.1fms per lost packet", run->lossPerMille,
+            hostSeconds(cost) * 1e3);
+    } else {
+      printf("\n");
+    }
+  }
+
+  printf("%s: %s\n", __FILE__, failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
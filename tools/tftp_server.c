@@ -0,0 +1,1030 @@
+// TFTP server for the bootloader and its extensions
+// Copyright (c) 2018 Blokable, Inc All rights reserved
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//     tftp_server [-p port] [-a addr] [-m group:port] [-M] [-r KB/s] [-l loss%]
+//                 [-s stats.csv] <dir>
+//
+//  Read only, serves the files in <dir> from memory. Supports blksize,
+//  windowsize (RFC 7440), tsize, multicast (RFC 2090), the "offset" and
+//  "length" byte range options and "crc32" (the CRC-32 of the whole file,
+//  which the bootloader checks before resuming), and answers "<file>.rows" with a manifest
+//  built on the fly when there is no such file (see rows.h).
+//
+//  Files are loaded when the server starts and again when their size or
+//  modification time changes. Every session gets its own socket, and all of
+//  them are non-blocking and driven from one poll() loop. Each finished
+//  session prints its throughput, and -s also appends it to a CSV file.
+//
+//  -r limits the total rate of DATA packets and -l drops that percentage of
+//  them on purpose, so several servers can stand in for slow or lossy ones
+//  in benchmarks. -M turns multicast off.
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rows.h"
+
+#define DEFAULT_PORT      69
+#define MCAST_GROUP       "239.255.66.1"
+#define MCAST_PORT        1758  // tftp-mcast
+#define RETRY_MS          200
+#define MAX_RETRIES       10
+#define MIN_BLKSIZE       8
+#define MAX_BLKSIZE       65464
+#define MAX_WINDOWSIZE    65535
+#define MAX_IMAGES        64
+#define MAX_SESSIONS      64
+#define MAX_GROUPS        16
+#define MAX_NAME          256
+
+#define OPCODE_RRQ        1
+#define OPCODE_DATA       3
+#define OPCODE_ACK        4
+#define OPCODE_ERROR      5
+#define OPCODE_OACK       6
+
+#define ERROR_UNDEFINED   0
+#define ERROR_NOT_FOUND   1
+#define ERROR_ACCESS      2
+#define ERROR_ILLEGAL_OP  4
+#define ERROR_UNKNOWN_TID 5
+
+typedef struct {
+  char name[MAX_NAME];
+  // What the image was read or built from, to notice when it changes
+  struct timespec mtime;
+  off_t fileSize;
+  int derived;
+  uint8_t* data;
+  size_t size;
+  uint32_t crc;
+  // Sessions using it, and whether the cache still points at it
+  int refs;
+  int current;
+} image_t;
+
+// One go-back-N stream of DATA blocks. Blocks count from 1 and are 32 bit
+// here, only their low 16 bits go on the wire. base is 0 while waiting for
+// the ACK that starts the stream.
+typedef struct {
+  image_t* image;
+  uint32_t offset;
+  uint32_t length;
+  uint16_t blockSize;
+  uint16_t windowSize;
+  // The last block is short, empty if the length is a multiple of blockSize
+  uint32_t total;
+  uint32_t base;
+  uint32_t next;
+  int wentBack;
+  int retries;
+  uint64_t deadline;
+  uint32_t resent;
+  uint32_t dropped;
+} transfer_t;
+
+typedef struct group group_t;
+
+typedef struct {
+  int used;
+  int sock;
+  struct sockaddr_in peer;
+  char name[MAX_NAME];
+  transfer_t xfer;
+  // Options to resend until the client ACKs them
+  uint8_t oack[512];
+  size_t oackLen;
+  // Multicast sessions are driven by their group's transfer
+  group_t* group;
+  int master;
+  uint32_t joined;
+  uint64_t start;
+} session_t;
+
+// RFC 2090: one group per image and block size. Only the master client
+// ACKs, and when it has the whole image the next client takes over and
+// asks for the first block it's missing.
+struct group {
+  int used;
+  int sock;
+  struct sockaddr_in addr;
+  transfer_t xfer;
+  session_t* master;
+};
+
+static const char* rootDir;
+static struct in_addr bindAddr;
+static int mainSock;
+static int multicastEnabled = 1;
+static struct in_addr mcastAddr;
+static uint16_t mcastPort = MCAST_PORT;
+static FILE* statsFile;
+static int lossPercent;
+
+// Token bucket for -r, in bytes
+static uint64_t rateBytes;
+static double tokens;
+static uint64_t tokensTime;
+
+static image_t* images[MAX_IMAGES];
+static session_t sessions[MAX_SESSIONS];
+static group_t groups[MAX_GROUPS];
+static uint32_t joinCount;
+
+static uint8_t packet[4 + MAX_BLKSIZE];
+
+static uint64_t nowUs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t nowMs(void) {
+  return nowUs() / 1000;
+}
+
+static const char* peerName(const struct sockaddr_in* addr) {
+  static char buf[32];
+  snprintf(buf, sizeof(buf), "%s:%u", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+  return buf;
+}
+
+static int openSocket(uint16_t port) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr = bindAddr;
+  addr.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    close(sock);
+    return -1;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  return sock;
+}
+
+static void sendError(int sock, const struct sockaddr_in* to, uint16_t code, const char* message) {
+  uint8_t buf[128];
+  size_t len = strlen(message) + 1;
+  if (len > sizeof(buf) - 4) {
+    len = sizeof(buf) - 4;
+  }
+
+  buf[0] = 0;
+  buf[1] = OPCODE_ERROR;
+  buf[2] = code >> 8;
+  buf[3] = code & 0xff;
+  memcpy(buf + 4, message, len);
+  buf[3 + len] = 0;
+  sendto(sock, buf, 4 + len, 0, (const struct sockaddr*)to, sizeof(*to));
+}
+
+// Image cache
+
+static void imageFree(image_t* image) {
+  free(image->data);
+  free(image);
+}
+
+static void imageRelease(image_t* image) {
+  if (--image->refs == 0 && !image->current) {
+    imageFree(image);
+  }
+}
+
+static image_t* imageCached(const char* name) {
+  for (int i = 0; i < MAX_IMAGES; i++) {
+    if (images[i] && strcmp(images[i]->name, name) == 0) {
+      return images[i];
+    }
+  }
+  return NULL;
+}
+
+static int imageStampIs(const image_t* image, const struct timespec* mtime, off_t fileSize) {
+  return image->mtime.tv_sec == mtime->tv_sec && image->mtime.tv_nsec == mtime->tv_nsec &&
+         image->fileSize == fileSize;
+}
+
+// Replace the cached image of the same name. An image that is still being
+// served stays around until its last session is done with it.
+static void imageStore(image_t* image) {
+  int freeSlot = -1;
+  for (int i = 0; i < MAX_IMAGES; i++) {
+    if (images[i] && strcmp(images[i]->name, image->name) == 0) {
+      images[i]->current = 0;
+      if (images[i]->refs == 0) {
+        imageFree(images[i]);
+      }
+      images[i] = image;
+      image->current = 1;
+      return;
+    }
+    if (!images[i] && freeSlot < 0) {
+      freeSlot = i;
+    }
+  }
+
+  // With a full cache the image only lives as long as its sessions
+  if (freeSlot >= 0) {
+    images[freeSlot] = image;
+    image->current = 1;
+  }
+}
+
+static image_t* imageLoad(const char* path, const char* name, const struct stat* st) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+
+  image_t* image = calloc(1, sizeof(*image));
+  size_t size = st->st_size;
+  uint8_t* data = malloc(size ? size : 1);
+  if (!image || !data || fread(data, 1, size, f) != size) {
+    fprintf(stderr, "%s: read failed\n", path);
+    fclose(f);
+    free(image);
+    free(data);
+    return NULL;
+  }
+  fclose(f);
+
+  snprintf(image->name, sizeof(image->name), "%s", name);
+  image->mtime = st->st_mtim;
+  image->fileSize = st->st_size;
+  image->data = data;
+  image->size = size;
+  image->crc = rowsCrc32(data, size);
+  imageStore(image);
+  printf("loaded %s, %zu bytes\n", name, size);
+  return image;
+}
+
+// Manifest for an image without a .rows file next to it, with the smallest
+// chunk that keeps it within what the bootloader accepts
+static image_t* imageRows(const image_t* base, const char* name) {
+  uint32_t chunkSize = ROWS_ROW_SIZE;
+  while ((base->size + chunkSize - 1) / chunkSize > ROWS_MAX_CHUNKS) {
+    chunkSize += ROWS_ROW_SIZE;
+  }
+
+  image_t* image = calloc(1, sizeof(*image));
+  if (!image) {
+    return NULL;
+  }
+  image->size = rowsBuild(base->data, base->size, chunkSize, &image->data);
+  if (image->size == 0) {
+    free(image);
+    return NULL;
+  }
+
+  snprintf(image->name, sizeof(image->name), "%s", name);
+  image->mtime = base->mtime;
+  image->fileSize = base->fileSize;
+  image->derived = 1;
+  image->crc = rowsCrc32(image->data, image->size);
+  imageStore(image);
+  printf("built %s, %u byte chunks\n", name, chunkSize);
+  return image;
+}
+
+// Find a file, loading it if it's new or has changed. The caller takes a
+// reference if it keeps the image.
+static image_t* imageFind(const char* name) {
+  char path[4096];
+  struct stat st;
+  image_t* cached = imageCached(name);
+
+  snprintf(path, sizeof(path), "%s/%s", rootDir, name);
+  if (stat(path, &st) == 0) {
+    if (!S_ISREG(st.st_mode)) {
+      return NULL;
+    }
+    if (cached && !cached->derived && imageStampIs(cached, &st.st_mtim, st.st_size)) {
+      return cached;
+    }
+    return imageLoad(path, name, &st);
+  }
+
+  size_t len = strlen(name);
+  if (len <= 5 || strcmp(name + len - 5, ".rows") != 0) {
+    return NULL;
+  }
+
+  char baseName[MAX_NAME];
+  memcpy(baseName, name, len - 5);
+  baseName[len - 5] = 0;
+  image_t* base = imageFind(baseName);
+  if (!base) {
+    return NULL;
+  }
+
+  image_t* image = cached;
+  if (!cached || !cached->derived || !imageStampIs(cached, &base->mtime, base->fileSize)) {
+    image = imageRows(base, name);
+  }
+  if (!base->current && base->refs == 0) {
+    imageFree(base);
+  }
+  return image;
+}
+
+static void imagePreload(void) {
+  DIR* dir = opendir(rootDir);
+  if (!dir) {
+    perror(rootDir);
+    exit(1);
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.' && strlen(entry->d_name) < MAX_NAME) {
+      imageFind(entry->d_name);
+    }
+  }
+  closedir(dir);
+}
+
+// Rate limit and simulated loss
+
+static void tokensRefill(void) {
+  uint64_t now = nowUs();
+  tokens += (double)(now - tokensTime) * rateBytes / 1000000;
+  tokensTime = now;
+
+  // Allow a burst of 100ms, or at least one full size packet
+  double burst = rateBytes / 10.0;
+  if (burst < sizeof(packet)) {
+    burst = sizeof(packet);
+  }
+  if (tokens > burst) {
+    tokens = burst;
+  }
+}
+
+static int tokensTake(size_t len) {
+  if (!rateBytes) {
+    return 1;
+  }
+  tokensRefill();
+  if (tokens < len) {
+    return 0;
+  }
+  tokens -= len;
+  return 1;
+}
+
+// Transfers
+
+static void transferInit(transfer_t* t, image_t* image, uint32_t offset, uint32_t length,
+                         uint16_t blockSize, uint16_t windowSize) {
+  memset(t, 0, sizeof(*t));
+  t->image = image;
+  image->refs++;
+  t->offset = offset;
+  t->length = length;
+  t->blockSize = blockSize;
+  t->windowSize = windowSize;
+  t->total = length / blockSize + 1;
+  t->deadline = nowMs() + RETRY_MS;
+}
+
+// Returns 0 if the socket or the rate limit can't take the block yet
+static int transferSend(transfer_t* t, int sock, const struct sockaddr_in* to, uint32_t block) {
+  uint32_t start = (block - 1) * t->blockSize;
+  size_t len = t->length - start;
+  if (len > t->blockSize) {
+    len = t->blockSize;
+  }
+  if (!tokensTake(4 + len)) {
+    return 0;
+  }
+
+  if (lossPercent && random() % 100 < lossPercent) {
+    t->dropped++;
+    return 1;
+  }
+
+  packet[0] = 0;
+  packet[1] = OPCODE_DATA;
+  packet[2] = (block >> 8) & 0xff;
+  packet[3] = block & 0xff;
+  memcpy(packet + 4, t->image->data + t->offset + start, len);
+  if (sendto(sock, packet, 4 + len, 0, (const struct sockaddr*)to, sizeof(*to)) < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+      // Put the tokens back, this block goes again next time round
+      tokens += 4 + len;
+      return 0;
+    }
+    perror("sendto");
+  }
+  return 1;
+}
+
+// Fill the window, returns 1 if it was held back
+static int transferPump(transfer_t* t, int sock, const struct sockaddr_in* to) {
+  if (t->base == 0) {
+    return 0;
+  }
+  while (t->next <= t->total && t->next < t->base + t->windowSize) {
+    if (!transferSend(t, sock, to, t->next)) {
+      return 1;
+    }
+    t->next++;
+    t->deadline = nowMs() + RETRY_MS;
+  }
+  return 0;
+}
+
+// Returns 1 once the last block has been ACKed. A multicast client may ACK
+// past what we've sent it, as it heard those blocks before it was master.
+static int transferACK(transfer_t* t, uint16_t ack, int multicast) {
+  if (t->base == 0) {
+    // ACK of the OACK, or a new master client saying where it's at
+    t->base = t->next = (uint32_t)ack + 1;
+    t->retries = 0;
+    t->wentBack = 0;
+    t->deadline = nowMs() + RETRY_MS;
+    return t->base > t->total;
+  }
+
+  uint32_t acked = (t->base - 1) + (uint16_t)(ack - ((t->base - 1) & 0xffff));
+  if (acked >= t->next) {
+    if (!multicast || acked > t->total) {
+      return 0;
+    }
+    t->next = acked + 1;
+  }
+
+  if (acked >= t->base) {
+    t->base = acked + 1;
+    t->retries = 0;
+    t->wentBack = 0;
+    t->deadline = nowMs() + RETRY_MS;
+  } else if (!t->wentBack && t->next > t->base) {
+    // The client ACKed a gap, go back once until base moves on
+    t->resent += t->next - t->base;
+    t->next = t->base;
+    t->wentBack = 1;
+  }
+  return t->base > t->total;
+}
+
+// Multicast groups
+
+static group_t* groupFind(const image_t* image, uint16_t blockSize) {
+  for (int i = 0; i < MAX_GROUPS; i++) {
+    if (groups[i].used && groups[i].xfer.image == image && groups[i].xfer.blockSize == blockSize) {
+      return &groups[i];
+    }
+  }
+  return NULL;
+}
+
+static group_t* groupOpen(image_t* image, uint16_t blockSize, uint16_t windowSize) {
+  for (int i = 0; i < MAX_GROUPS; i++) {
+    group_t* g = &groups[i];
+    if (g->used) {
+      continue;
+    }
+
+    g->sock = openSocket(0);
+    if (g->sock < 0) {
+      return NULL;
+    }
+    uint8_t ttl = 1;
+    setsockopt(g->sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    if (bindAddr.s_addr != INADDR_ANY) {
+      setsockopt(g->sock, IPPROTO_IP, IP_MULTICAST_IF, &bindAddr, sizeof(bindAddr));
+    }
+
+    // Every group gets its own port, so clients only hear their image
+    memset(&g->addr, 0, sizeof(g->addr));
+    g->addr.sin_family = AF_INET;
+    g->addr.sin_addr = mcastAddr;
+    g->addr.sin_port = htons(mcastPort + i);
+    transferInit(&g->xfer, image, 0, image->size, blockSize, windowSize);
+    g->master = NULL;
+    g->used = 1;
+    return g;
+  }
+  return NULL;
+}
+
+static void groupClose(group_t* g) {
+  close(g->sock);
+  imageRelease(g->xfer.image);
+  g->used = 0;
+}
+
+static void sessionSendOACK(session_t* s) {
+  sendto(s->sock, s->oack, s->oackLen, 0, (struct sockaddr*)&s->peer, sizeof(s->peer));
+}
+
+static size_t appendOption(uint8_t* buf, size_t len, const char* name, const char* value) {
+  size_t nameLen = strlen(name) + 1;
+  size_t valueLen = strlen(value) + 1;
+  memcpy(buf + len, name, nameLen);
+  memcpy(buf + len + nameLen, value, valueLen);
+  return len + nameLen + valueLen;
+}
+
+// Hand the group to the client that has waited longest. It picks up from
+// the first block it's missing, which its ACK of the OACK tells us.
+static void groupPromote(group_t* g) {
+  session_t* next = NULL;
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    session_t* s = &sessions[i];
+    if (s->used && s->group == g && !s->master && (!next || s->joined < next->joined)) {
+      next = s;
+    }
+  }
+  if (!next) {
+    groupClose(g);
+    return;
+  }
+
+  next->master = 1;
+  g->master = next;
+  g->xfer.base = g->xfer.next = 0;
+  g->xfer.retries = 0;
+  g->xfer.windowSize = next->xfer.windowSize;
+  g->xfer.deadline = nowMs() + RETRY_MS;
+
+  next->oack[0] = 0;
+  next->oack[1] = OPCODE_OACK;
+  next->oackLen = appendOption(next->oack, 2, "multicast", ",,1");
+  sessionSendOACK(next);
+  printf("%s is now the master client for %s\n", peerName(&next->peer), next->name);
+}
+
+// Sessions
+
+static void sessionStats(session_t* s, const char* status) {
+  uint64_t us = nowUs() - s->start;
+  uint64_t ms = us / 1000;
+  double kBps = us ? (double)s->xfer.length / 1024 / us * 1000000 : 0;
+  const transfer_t* t = s->group ? &s->group->xfer : &s->xfer;
+  const char* mode = s->group ? "multicast" : "unicast";
+
+  if (strcmp(status, "ok") == 0) {
+    printf("%s %s: %u bytes in %llu ms, %.1f KB/s (%s, blksize %u, windowsize %u, %u resent, %u dropped)\n",
+           peerName(&s->peer), s->name, s->xfer.length, (unsigned long long)ms, kBps, mode,
+           t->blockSize, t->windowSize, t->resent, t->dropped);
+  } else {
+    printf("%s %s: %s after %llu ms\n", peerName(&s->peer), s->name, status, (unsigned long long)ms);
+  }
+
+  if (statsFile) {
+    fprintf(statsFile, "%lld,%s,%s,%s,%u,%u,%u,%u,%llu,%.1f,%u,%u,%s\n",
+            (long long)time(NULL), peerName(&s->peer), s->name, mode, s->xfer.offset, s->xfer.length,
+            t->blockSize, t->windowSize, (unsigned long long)ms, kBps, t->resent, t->dropped, status);
+    fflush(statsFile);
+  }
+}
+
+static void sessionEnd(session_t* s, const char* status) {
+  sessionStats(s, status);
+  close(s->sock);
+  imageRelease(s->xfer.image);
+  s->used = 0;
+
+  group_t* g = s->group;
+  if (g && g->master == s) {
+    g->master = NULL;
+    groupPromote(g);
+  }
+}
+
+static session_t* sessionFind(const struct sockaddr_in* peer) {
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    session_t* s = &sessions[i];
+    if (s->used && s->peer.sin_addr.s_addr == peer->sin_addr.s_addr && s->peer.sin_port == peer->sin_port) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static transfer_t* sessionTransfer(session_t* s) {
+  return s->group ? &s->group->xfer : &s->xfer;
+}
+
+static uint32_t parseNumber(const char* value) {
+  return strtoul(value, NULL, 10);
+}
+
+static void handleRequest(const uint8_t* buf, size_t len, const struct sockaddr_in* peer) {
+  if (len < 4 || buf[len - 1] != 0) {
+    return;
+  }
+  if (sessionFind(peer)) {
+    // Retransmitted request
+    return;
+  }
+  if (((buf[0] << 8) | buf[1]) != OPCODE_RRQ) {
+    sendError(mainSock, peer, ERROR_ILLEGAL_OP, "Only reads are supported");
+    return;
+  }
+
+  const char* end = (const char*)buf + len;
+  const char* name = (const char*)buf + 2;
+  const char* mode = name + strlen(name) + 1;
+  if (mode >= end || strcasecmp(mode, "octet") != 0) {
+    sendError(mainSock, peer, ERROR_UNDEFINED, "Only octet mode is supported");
+    return;
+  }
+  if (name[0] == '/' || strstr(name, "..") || strlen(name) >= MAX_NAME) {
+    sendError(mainSock, peer, ERROR_ACCESS, "Access violation");
+    return;
+  }
+
+  image_t* image = imageFind(name);
+  if (!image) {
+    sendError(mainSock, peer, ERROR_NOT_FOUND, "File not found");
+    return;
+  }
+
+  // Options, anything not understood is left out of the OACK
+  int haveOptions = 0;
+  int haveBlockSize = 0, haveWindowSize = 0, haveTsize = 0, haveCrc = 0, haveOffset = 0, haveLength = 0;
+  int wantMulticast = 0;
+  uint32_t blockSize = 512, windowSize = 1, offset = 0, length = 0;
+  const char* option = mode + strlen(mode) + 1;
+  while (option < end) {
+    const char* value = option + strlen(option) + 1;
+    if (value >= end) {
+      break;
+    }
+
+    uint32_t number = parseNumber(value);
+    if (strcasecmp(option, "blksize") == 0 && number >= MIN_BLKSIZE) {
+      blockSize = number > MAX_BLKSIZE ? MAX_BLKSIZE : number;
+      haveBlockSize = haveOptions = 1;
+    } else if (strcasecmp(option, "windowsize") == 0 && number >= 1) {
+      windowSize = number > MAX_WINDOWSIZE ? MAX_WINDOWSIZE : number;
+      haveWindowSize = haveOptions = 1;
+    } else if (strcasecmp(option, "tsize") == 0) {
+      haveTsize = haveOptions = 1;
+    } else if (strcasecmp(option, "crc32") == 0) {
+      haveCrc = haveOptions = 1;
+    } else if (strcasecmp(option, "offset") == 0) {
+      offset = number;
+      haveOffset = haveOptions = 1;
+    } else if (strcasecmp(option, "length") == 0) {
+      length = number;
+      haveLength = haveOptions = 1;
+    } else if (strcasecmp(option, "multicast") == 0) {
+      wantMulticast = 1;
+    }
+    option = value + strlen(value) + 1;
+  }
+
+  // Ranges are clamped to the file, the client checks what we echo
+  if (offset > image->size) {
+    offset = image->size;
+  }
+  if (!haveLength || length > image->size - offset) {
+    length = image->size - offset;
+  }
+
+  // Ranges are always unicast, and a client can only join a group that
+  // uses the block size it asked for
+  group_t* group = NULL;
+  if (wantMulticast && multicastEnabled && !haveOffset && !haveLength) {
+    group = groupFind(image, blockSize);
+    if (!group) {
+      group = groupOpen(image, blockSize, windowSize);
+    }
+  }
+  if (group) {
+    haveOptions = 1;
+  }
+
+  session_t* s = NULL;
+  for (int i = 0; i < MAX_SESSIONS && !s; i++) {
+    if (!sessions[i].used) {
+      s = &sessions[i];
+    }
+  }
+  int sock = s ? openSocket(0) : -1;
+  if (sock < 0) {
+    if (group && !group->master) {
+      groupClose(group);
+    }
+    if (!image->current && image->refs == 0) {
+      imageFree(image);
+    }
+    sendError(mainSock, peer, ERROR_UNDEFINED, "Server busy");
+    return;
+  }
+
+  memset(s, 0, sizeof(*s));
+  s->used = 1;
+  s->sock = sock;
+  s->peer = *peer;
+  s->start = nowUs();
+  snprintf(s->name, sizeof(s->name), "%s", name);
+  transferInit(&s->xfer, image, offset, length, blockSize, windowSize);
+
+  printf("%s requested %s", peerName(peer), name);
+  if (haveOffset || haveLength) {
+    printf(", offset %u length %u", offset, length);
+  }
+
+  if (!haveOptions) {
+    // Plain RFC 1350, start right away
+    s->xfer.base = s->xfer.next = 1;
+    printf("\n");
+    return;
+  }
+
+  char value[64];
+  s->oack[0] = 0;
+  s->oack[1] = OPCODE_OACK;
+  s->oackLen = 2;
+  if (haveBlockSize) {
+    snprintf(value, sizeof(value), "%u", blockSize);
+    s->oackLen = appendOption(s->oack, s->oackLen, "blksize", value);
+  }
+  if (haveWindowSize) {
+    snprintf(value, sizeof(value), "%u", windowSize);
+    s->oackLen = appendOption(s->oack, s->oackLen, "windowsize", value);
+  }
+  if (haveTsize) {
+    // Always the size of the whole file
+    snprintf(value, sizeof(value), "%zu", image->size);
+    s->oackLen = appendOption(s->oack, s->oackLen, "tsize", value);
+  }
+  if (haveCrc) {
+    // Also of the whole file, whatever the range
+    snprintf(value, sizeof(value), "%u", image->crc);
+    s->oackLen = appendOption(s->oack, s->oackLen, "crc32", value);
+  }
+  if (haveOffset) {
+    snprintf(value, sizeof(value), "%u", offset);
+    s->oackLen = appendOption(s->oack, s->oackLen, "offset", value);
+  }
+  if (haveLength) {
+    snprintf(value, sizeof(value), "%u", length);
+    s->oackLen = appendOption(s->oack, s->oackLen, "length", value);
+  }
+  if (group) {
+    s->group = group;
+    s->joined = ++joinCount;
+    s->master = !group->master;
+    if (s->master) {
+      group->master = s;
+    }
+    snprintf(value, sizeof(value), "%s,%u,%d", inet_ntoa(group->addr.sin_addr),
+             ntohs(group->addr.sin_port), s->master);
+    s->oackLen = appendOption(s->oack, s->oackLen, "multicast", value);
+    printf(", multicast %s", s->master ? "master" : "listener");
+  }
+  printf("\n");
+
+  sessionSendOACK(s);
+}
+
+static void handleSessionPacket(session_t* s, const uint8_t* buf, size_t len, const struct sockaddr_in* from) {
+  if (from->sin_addr.s_addr != s->peer.sin_addr.s_addr || from->sin_port != s->peer.sin_port) {
+    sendError(s->sock, from, ERROR_UNKNOWN_TID, "Unknown transfer ID");
+    return;
+  }
+  if (len < 4) {
+    return;
+  }
+
+  uint16_t opcode = (buf[0] << 8) | buf[1];
+  if (opcode == OPCODE_ERROR) {
+    char status[96];
+    snprintf(status, sizeof(status), "client error %u", (buf[2] << 8) | buf[3]);
+    sessionEnd(s, status);
+    return;
+  }
+  if (opcode != OPCODE_ACK || (s->group && !s->master)) {
+    return;
+  }
+
+  if (transferACK(sessionTransfer(s), (buf[2] << 8) | buf[3], s->group != NULL)) {
+    sessionEnd(s, "ok");
+  }
+}
+
+static void sessionTimer(session_t* s, uint64_t now) {
+  transfer_t* t = sessionTransfer(s);
+  if ((s->group && !s->master) || now < t->deadline) {
+    return;
+  }
+
+  if (++t->retries > MAX_RETRIES) {
+    sessionEnd(s, "timed out");
+    return;
+  }
+  t->deadline = now + RETRY_MS;
+
+  if (t->base == 0) {
+    sessionSendOACK(s);
+  } else {
+    t->resent += t->next - t->base;
+    t->next = t->base;
+  }
+}
+
+static void receiveAll(int sock, session_t* s) {
+  uint8_t buf[1500];
+  struct sockaddr_in from;
+  socklen_t fromLen = sizeof(from);
+  ssize_t n;
+
+  while ((n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromLen)) >= 0) {
+    if (!s) {
+      handleRequest(buf, n, &from);
+    } else {
+      handleSessionPacket(s, buf, n, &from);
+      if (!s->used) {
+        return;
+      }
+    }
+    fromLen = sizeof(from);
+  }
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "usage: %s [-p port] [-a addr] [-m group:port] [-M] [-r KB/s] [-l loss%%]\n"
+                  "       %*s [-s stats.csv] <dir>\n", name, (int)strlen(name), "");
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  uint16_t port = DEFAULT_PORT;
+  const char* statsPath = NULL;
+  int opt;
+
+  bindAddr.s_addr = INADDR_ANY;
+  inet_aton(MCAST_GROUP, &mcastAddr);
+
+  while ((opt = getopt(argc, argv, "p:a:m:Mr:l:s:")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'a':
+        if (!inet_aton(optarg, &bindAddr)) {
+          usage(argv[0]);
+        }
+        break;
+      case 'm': {
+        char* colon = strchr(optarg, ':');
+        if (colon) {
+          *colon = 0;
+          mcastPort = atoi(colon + 1);
+        }
+        if (!inet_aton(optarg, &mcastAddr) || !IN_MULTICAST(ntohl(mcastAddr.s_addr))) {
+          usage(argv[0]);
+        }
+        break;
+      }
+      case 'M':
+        multicastEnabled = 0;
+        break;
+      case 'r':
+        rateBytes = strtoull(optarg, NULL, 10) * 1024;
+        break;
+      case 'l':
+        lossPercent = atoi(optarg);
+        break;
+      case 's':
+        statsPath = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+  rootDir = argv[optind];
+
+  if (statsPath) {
+    statsFile = fopen(statsPath, "a");
+    if (!statsFile) {
+      perror(statsPath);
+      return 1;
+    }
+    if (ftell(statsFile) == 0) {
+      fprintf(statsFile, "time,client,file,mode,offset,length,blksize,windowsize,ms,KBps,resent,dropped,status\n");
+    }
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  srandom(time(NULL));
+  tokensTime = nowUs();
+
+  imagePreload();
+  mainSock = openSocket(port);
+  if (mainSock < 0) {
+    return 1;
+  }
+  printf("serving %s on %s:%u\n", rootDir, inet_ntoa(bindAddr), port);
+
+  while (1) {
+    // Keep every running transfer's window full
+    int throttled = 0;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      if (sessions[i].used && !sessions[i].group) {
+        throttled |= transferPump(&sessions[i].xfer, sessions[i].sock, &sessions[i].peer);
+      }
+    }
+    for (int i = 0; i < MAX_GROUPS; i++) {
+      if (groups[i].used) {
+        throttled |= transferPump(&groups[i].xfer, groups[i].sock, &groups[i].addr);
+      }
+    }
+
+    // Sleep until a packet comes in or the nearest retransmission is due
+    struct pollfd pfds[1 + MAX_SESSIONS];
+    session_t* owners[1 + MAX_SESSIONS];
+    int count = 0;
+    uint64_t now = nowMs();
+    int timeout = -1;
+
+    pfds[count].fd = mainSock;
+    pfds[count].events = POLLIN;
+    owners[count++] = NULL;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      session_t* s = &sessions[i];
+      if (!s->used) {
+        continue;
+      }
+      pfds[count].fd = s->sock;
+      pfds[count].events = POLLIN;
+      owners[count++] = s;
+
+      transfer_t* t = sessionTransfer(s);
+      if (!s->group || s->master) {
+        int wait = t->deadline > now ? (int)(t->deadline - now) : 0;
+        if (timeout < 0 || wait < timeout) {
+          timeout = wait;
+        }
+      }
+    }
+    if (throttled && (timeout < 0 || timeout > 1)) {
+      timeout = 1;
+    }
+
+    if (poll(pfds, count, timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+      if ((pfds[i].revents & POLLIN) && (!owners[i] || owners[i]->used)) {
+        receiveAll(pfds[i].fd, owners[i]);
+      }
+    }
+
+    now = nowMs();
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      if (sessions[i].used) {
+        sessionTimer(&sessions[i], now);
+      }
+    }
+  }
+}